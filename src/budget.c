@@ -0,0 +1,144 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 画像ダウンロードの通信量の予算
+//
+
+// o 従量課金の回線やシリアル回線では、大きな画像 1枚で他のすべてが
+//   止まってしまうので、画像に使う通信量に上限を設ける。
+// o 1枚あたりの上限は、添付ファイルの size で事前に判定するのに加えて
+//   ダウンロード時の Content-Length でも判定する (こちらは httpclient が
+//   net_opt.max_length で行う)。
+// o 1分あたりの上限は、直近 60 秒間に実際に受信したバイト数で判定する。
+//   1秒単位のバケツを 60 個持ち、古いものから捨てていく。
+//   添付ファイルの size は原寸のファイルのもので、実際に取得する
+//   サムネイルはずっと小さいことが多いので、こちらの判定には使わない。
+// o 予算を超える画像は呼び出し側で Blurhash などに切り替える。
+// o 表示スレッドからも先読みワーカーからも呼ばれる。
+
+#include "sayaka.h"
+#include <pthread.h>
+#include <string.h>
+
+#define BUDGET_WINDOW_SEC	(60)
+
+static uint64 budget_now_sec(void);
+static uint64 budget_used(uint64);
+
+static pthread_mutex_t budget_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint budget_max_image;		// 1枚あたりの上限 [byte] (0 なら無制限)
+static uint budget_per_min;			// 1分あたりの上限 [byte] (0 なら無制限)
+static uint64 budget_bytes[BUDGET_WINDOW_SEC];	// 秒ごとの受信量
+static uint64 budget_sec[BUDGET_WINDOW_SEC];	// そのバケツの時刻 [sec]
+static struct budget_stat budget_stat;
+
+// 1枚あたり max_image バイト、1分あたり per_min バイトを上限にする。
+// どちらも 0 なら無制限。
+void
+budget_init(uint max_image, uint per_min)
+{
+	pthread_mutex_lock(&budget_mtx);
+	budget_max_image = max_image;
+	budget_per_min = per_min;
+	memset(budget_bytes, 0, sizeof(budget_bytes));
+	memset(budget_sec, 0, sizeof(budget_sec));
+	pthread_mutex_unlock(&budget_mtx);
+}
+
+// 元のファイルが size バイト (0 なら不明) の画像をダウンロードしてよければ
+// true を返す。予算を超えるなら false を返す。
+bool
+budget_allow(uint64 size)
+{
+	bool rv = true;
+
+	pthread_mutex_lock(&budget_mtx);
+	if (budget_max_image != 0 && size > budget_max_image) {
+		budget_stat.over_size++;
+		rv = false;
+	} else if (budget_per_min != 0 &&
+		budget_used(budget_now_sec()) >= budget_per_min)
+	{
+		budget_stat.over_rate++;
+		rv = false;
+	} else {
+		budget_stat.allowed++;
+	}
+	pthread_mutex_unlock(&budget_mtx);
+
+	return rv;
+}
+
+// 画像のダウンロードで bytes バイトを受信したことを記録する。
+void
+budget_add(uint64 bytes)
+{
+	uint64 now = budget_now_sec();
+	uint i = now % BUDGET_WINDOW_SEC;
+
+	pthread_mutex_lock(&budget_mtx);
+	if (budget_sec[i] != now) {
+		budget_sec[i] = now;
+		budget_bytes[i] = 0;
+	}
+	budget_bytes[i] += bytes;
+	budget_stat.bytes += bytes;
+	pthread_mutex_unlock(&budget_mtx);
+}
+
+// 統計情報を *stat にコピーする。
+void
+budget_get_stat(struct budget_stat *stat)
+{
+	pthread_mutex_lock(&budget_mtx);
+	memcpy(stat, &budget_stat, sizeof(*stat));
+	pthread_mutex_unlock(&budget_mtx);
+}
+
+// 直近 60 秒間の受信量を返す。budget_mtx を保持して呼ぶこと。
+static uint64
+budget_used(uint64 now)
+{
+	uint64 total = 0;
+
+	for (uint i = 0; i < BUDGET_WINDOW_SEC; i++) {
+		if (now - budget_sec[i] < BUDGET_WINDOW_SEC) {
+			total += budget_bytes[i];
+		}
+	}
+	return total;
+}
+
+// 現在時刻 (CLOCK_MONOTONIC) を秒で返す。
+static uint64
+budget_now_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
@@ -0,0 +1,1288 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// SIXEL キャッシュ (パックファイル)
+//
+
+// o 以前は画像 1枚ごとに <cachedir>/<name>.sixel を作っていたが、
+//   表示のたびに fopen と先頭の読み込み (サイズ取得用) が必要で、
+//   起動時の find(1) もファイル数に比例して遅くなる。
+// o そこで SIXEL はすべて追記のみのパックファイル (sixel.pack) に置き、
+//   キー (キャッシュファイル名だったもの) のハッシュから
+//   位置、長さ、画像サイズを引く索引 (sixel.idx) を mmap しておく。
+//   検索はメモリ上だけで済み、画像サイズも SIXEL を読まずに分かる。
+// o 索引はオープンアドレスのハッシュ表で、大きさは固定。
+//   一杯になるかパックファイルが上限を超えたら、両方を空にして
+//   最初からやり直す (キャッシュなので消えても取り直せばよい)。
+// o パックファイルの各レコードの先頭にもハッシュと長さを置いておき、
+//   読み出す時に照合する。書き込み途中で落ちた場合や、索引と
+//   パックファイルが食い違った場合でも、おかしなものは表示しない。
+// o 追記は表示スレッドからも fetchpool のワーカーからも、さらに
+//   同じキャッシュディレクトリを使う別プロセスからも行われるので、
+//   スレッド間は mutex で、プロセス間は索引ファイルの fcntl ロックで
+//   排他する。
+// o 古いエントリの掃除は、ストリームにつながった後にバックグラウンドの
+//   スレッド (janitor) が行う。以前は起動時に find(1) を実行していたが、
+//   シェルを起動してディレクトリ全体を歩くので最初のノートの表示が
+//   遅れる上、atime を記録しないマウントでは機能しなかった。
+//   o 各エントリには最後に使った時刻を索引に記録しておき、アイコンは
+//     7日、写真は2日使われなければ索引から外す。
+//   o それでも合計が予算を超えていれば、使われていない順に外す。
+//   o 外したレコードはパックファイルに残っているので、無駄な領域が
+//     増えたら生きているレコードだけを新しいパックファイルにコピーして
+//     置き換える (compaction)。コピーは少しずつ休みながら行い、
+//     表示の邪魔をしないようにする。ロックを取るのは最初と最後だけ。
+//   o パックファイルを置き換えたら索引ヘッダの世代を進める。
+//     他のプロセスは世代が変わったのを見てパックファイルを開き直す。
+//     置き換える直前に検索したエントリのために、1つ前の世代の
+//     パックファイルも開いたままにしておく。
+//   o 以前の 1画像 1ファイルの .sixel ファイルもここで削除する。
+// o 同じキャッシュディレクトリを使う複数のプロセスが同じ画像を同時に
+//   取得、変換しないよう、キーごとのロックを用意する。ロックファイル
+//   (sixel.lock) の、キーのハッシュから決まる位置の 1バイトを fcntl で
+//   ロックする (ファイルの大きさは 0 のまま)。プロセスが落ちても
+//   ロックはカーネルが解放するので残らない。
+//   o 位置は 32bit の off_t でも表せる範囲 (1GB 未満) に収める。
+//   o fcntl のロックはプロセス単位なので、同じプロセスの別スレッドが
+//     同じ位置をロックしても待たされず、先に解放したほうが相手の
+//     ロックまで外してしまう。そこでプロセス内では、ロック中の位置を
+//     mutex で守った表に載せてスレッド間で排他してから fcntl を使う。
+// o 書き込みはパックファイルへの追記が終わってから索引に載せ、
+//   パックファイルの置き換えは一時ファイルに書いてから rename するので、
+//   他のプロセスが書きかけのデータを読むことはなく、途中で落ちても
+//   中途半端なエントリは残らない。
+
+#include "sayaka.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(HAVE_SYS_SENDFILE_H)
+#include <sys/sendfile.h>
+#endif
+
+#if defined(SLOW_ARCH)
+#define CACHE_NSLOTS	(8192)
+#define CACHE_PACK_MAX	(32U * 1024 * 1024)
+#define CACHE_BUDGET	(16U * 1024 * 1024)
+#define JANITOR_CHUNK	(16U * 1024)
+#define JANITOR_NAP_MSEC	(50)
+#define CACHE_SEND_BUFSIZE	(8U * 1024)
+#else
+#define CACHE_NSLOTS	(65536)
+#define CACHE_PACK_MAX	(256U * 1024 * 1024)
+#define CACHE_BUDGET	(128U * 1024 * 1024)
+#define JANITOR_CHUNK	(256U * 1024)
+#define JANITOR_NAP_MSEC	(10)
+#define CACHE_SEND_BUFSIZE	(64U * 1024)
+#endif
+
+// 接続してから最初に掃除するまでの時間と、その後の間隔 [sec]。
+#define JANITOR_DELAY		(10)
+#define JANITOR_INTERVAL	(60 * 60)
+
+// 何ファイル削除するごとに休むか (古い .sixel ファイル)。
+#define JANITOR_FILES_PER_NAP	(16)
+
+// キーごとのロックの、ロックファイル上の位置の範囲。
+#define LOCK_RANGE		(1U << 30)
+
+// プロセス内で同時に保持されるキーごとのロックの最大数。
+// ワーカー (最大 FETCHPOOL_MAX_JOBS) と表示スレッドの分。
+#define LOCK_HELD_MAX	(FETCHPOOL_MAX_JOBS + 1)
+
+#define CACHE_IDX_MAGIC	(0x53584958)	// "SXIX"
+#define CACHE_REC_MAGIC	(0x53585043)	// "SXPC"
+#define CACHE_VERSION	(2)
+
+// エントリの種類。期限が異なる。
+#define CACHE_CLASS_PHOTO	(0)
+#define CACHE_CLASS_ICON	(1)
+
+// 種類ごとの期限 [sec]。
+static const uint32 cache_max_age[] = {
+	[CACHE_CLASS_PHOTO]	= 2 * 24 * 60 * 60,
+	[CACHE_CLASS_ICON]	= 7 * 24 * 60 * 60,
+};
+
+// 索引ファイルのヘッダ。
+struct cache_idx_header {
+	uint32 magic;
+	uint32 version;
+	uint32 nslots;			// スロット数
+	uint32 count;			// 使用中のスロット数
+	uint32 generation;		// パックファイルの世代
+	uint32 reserved0;
+	uint64 reserved1;
+};
+
+// 索引ファイルのスロット。
+struct cache_slot {
+	uint64 hash;			// キーのハッシュ (0 なら空き)
+	uint64 offset;			// パックファイル内のレコードの位置
+	uint32 length;			// SIXEL データの長さ
+	uint16 width;			// 画像の幅 [pixel]
+	uint16 height;			// 画像の高さ [pixel]
+	uint32 atime;			// 最後に使った時刻 [sec]
+	uint16 klass;			// CACHE_CLASS_*
+	uint16 reserved;
+};
+
+// janitor が集める生きているレコード。
+struct cache_live {
+	uint64 hash;
+	uint64 offset;			// 元のパックファイルでの位置
+	uint64 newoffset;		// 新しいパックファイルでの位置
+	uint32 size;			// ヘッダを含むレコードの長さ
+	uint32 atime;
+};
+
+// パックファイルの各レコードのヘッダ。この後ろに SIXEL データが続く。
+struct cache_rec_header {
+	uint32 magic;
+	uint32 length;			// SIXEL データの長さ
+	uint64 hash;			// キーのハッシュ
+	uint16 width;
+	uint16 height;
+	uint32 reserved;
+};
+
+static uint64 cache_hash(const char *);
+static int  cache_entry_fd(const struct cache_entry *);
+static bool cache_write_all(int, const char *, uint);
+static uint32 cache_now(void);
+static struct cache_slot *cache_find_slot(uint64, bool);
+static void cache_delete_slot(uint);
+static void cache_check_gen(void);
+static void cache_reset(void);
+static bool cache_lock(void);
+static void cache_unlock(void);
+static void *cache_janitor(void *);
+static void cache_janitor_run(void);
+static bool cache_janitor_copy(int, int, struct cache_live *, uint, char *);
+static void cache_janitor_commit(int, struct cache_live *, uint, uint64,
+	uint64, uint32);
+static void cache_remove_legacy(void);
+static void cache_nap(uint);
+static uint32 cache_lock_pos(const char *);
+static bool cache_lock_is_held(uint32);
+static int cmp_live_atime(const void *, const void *);
+static int cmp_live_offset(const void *, const void *);
+
+static pthread_mutex_t cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static char cache_dir[PATH_MAX];
+static char pack_path[PATH_MAX];
+static int pack_fd = -1;
+static uint32 pack_gen;				// pack_fd の世代
+static int old_pack_fd = -1;		// 1つ前の世代のパックファイル
+static uint32 old_pack_gen;
+static int idx_fd = -1;
+static int lock_fd = -1;			// キーごとのロック用
+static pthread_mutex_t lock_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lock_cv = PTHREAD_COND_INITIALIZER;
+static uint32 lock_held[LOCK_HELD_MAX];	// このプロセスがロック中の位置
+static uint lock_nheld;
+static struct cache_idx_header *idx_hdr;	// mmap した索引
+static struct cache_slot *idx_slots;
+static size_t idx_size;
+static struct cache_stat cache_stat;
+
+// dir にあるパックファイルと索引を開く (なければ作る)。
+// 成功すれば true を返す。
+// 失敗すれば errno をセットして false を返す。この場合キャッシュは
+// 常にヒットせず、追加も失敗する。
+bool
+cache_init(const char *dir)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	bool rv = false;
+
+	strlcpy(cache_dir, dir, sizeof(cache_dir));
+	snprintf(pack_path, sizeof(pack_path), "%s/sixel.pack", dir);
+	pack_fd = open(pack_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (pack_fd < 0) {
+		return false;
+	}
+	snprintf(path, sizeof(path), "%s/sixel.idx", dir);
+	idx_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (idx_fd < 0) {
+		goto abort;
+	}
+	// キーごとのロックは開けなくても重複して取得するだけ。
+	snprintf(path, sizeof(path), "%s/sixel.lock", dir);
+	lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock_fd < 0) {
+		Debug(diag_image, "%s: %s: %s", __func__, path, strerrno());
+	}
+
+	idx_size = sizeof(struct cache_idx_header) +
+		sizeof(struct cache_slot) * CACHE_NSLOTS;
+
+	if (cache_lock() == false) {
+		goto abort;
+	}
+	if (fstat(idx_fd, &st) < 0) {
+		goto abort_unlock;
+	}
+	bool valid = (st.st_size == idx_size);
+	if (valid == false) {
+		// 作り直す。
+		if (ftruncate(idx_fd, 0) < 0 || ftruncate(idx_fd, idx_size) < 0) {
+			goto abort_unlock;
+		}
+	}
+	void *m = mmap(NULL, idx_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		idx_fd, 0);
+	if (m == MAP_FAILED) {
+		goto abort_unlock;
+	}
+	idx_hdr = m;
+	idx_slots = (struct cache_slot *)(idx_hdr + 1);
+
+	if (valid == false ||
+		idx_hdr->magic != CACHE_IDX_MAGIC ||
+		idx_hdr->version != CACHE_VERSION ||
+		idx_hdr->nslots != CACHE_NSLOTS)
+	{
+		Debug(diag_image, "%s: initialize index", __func__);
+		idx_hdr->magic = CACHE_IDX_MAGIC;
+		idx_hdr->version = CACHE_VERSION;
+		idx_hdr->nslots = CACHE_NSLOTS;
+		cache_reset();
+	}
+	pack_gen = idx_hdr->generation;
+	old_pack_gen = pack_gen;
+	rv = true;
+
+ abort_unlock:
+	cache_unlock();
+ abort:
+	if (rv == false) {
+		int saved_errno = errno;
+		cache_cleanup();
+		errno = saved_errno;
+	}
+	return rv;
+}
+
+// キャッシュを閉じる。
+void
+cache_cleanup(void)
+{
+	if (idx_hdr) {
+		munmap(idx_hdr, idx_size);
+		idx_hdr = NULL;
+		idx_slots = NULL;
+	}
+	if (idx_fd >= 0) {
+		close(idx_fd);
+		idx_fd = -1;
+	}
+	if (lock_fd >= 0) {
+		close(lock_fd);
+		lock_fd = -1;
+	}
+	if (pack_fd >= 0) {
+		close(pack_fd);
+		pack_fd = -1;
+	}
+	if (old_pack_fd >= 0) {
+		close(old_pack_fd);
+		old_pack_fd = -1;
+	}
+}
+
+// key (キャッシュファイル名) のエントリを探す。
+// 見付かれば e が NULL でなければ *e に書き出して true を返す。
+// 見付からなければ false を返す。
+bool
+cache_lookup(const char *key, struct cache_entry *e)
+{
+	uint64 hash = cache_hash(key);
+	bool rv = false;
+
+	pthread_mutex_lock(&cache_mtx);
+	if (__predict_true(idx_hdr != NULL)) {
+		cache_stat.lookups++;
+		cache_check_gen();
+		struct cache_slot *slot = cache_find_slot(hash, false);
+		if (slot && slot->hash == hash) {
+			if (e) {
+				e->hash   = slot->hash;
+				e->offset = slot->offset;
+				e->length = slot->length;
+				e->width  = slot->width;
+				e->height = slot->height;
+				e->gen    = pack_gen;
+			}
+			// 使った時刻はロックなしで更新する (多少ずれても構わない)。
+			slot->atime = cache_now();
+			cache_stat.hits++;
+			rv = true;
+		}
+	}
+	pthread_mutex_unlock(&cache_mtx);
+
+	return rv;
+}
+
+// key (キャッシュファイル名) で、大きさ width x height の SIXEL データ
+// data (長さ len) をキャッシュに追加する。
+// すでにあれば置き換える (古いデータはパックファイル内に残るが
+// 参照されなくなる)。
+// 成功すれば true を返す。
+// 失敗すれば errno をセットして false を返す。
+bool
+cache_put(const char *key, const void *data, uint len,
+	uint width, uint height)
+{
+	struct cache_rec_header rec;
+	struct stat st;
+	bool rv = false;
+
+	if (__predict_false(width > 0xffff || height > 0xffff)) {
+		errno = EFBIG;
+		return false;
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic  = CACHE_REC_MAGIC;
+	rec.length = len;
+	rec.hash   = cache_hash(key);
+	rec.width  = width;
+	rec.height = height;
+
+	pthread_mutex_lock(&cache_mtx);
+	if (__predict_false(idx_hdr == NULL)) {
+		errno = ENXIO;
+		goto done;
+	}
+	if (cache_lock() == false) {
+		goto done;
+	}
+	cache_check_gen();
+
+	if (fstat(pack_fd, &st) < 0) {
+		goto done_unlock;
+	}
+	uint64 offset = st.st_size;
+	if (offset + sizeof(rec) + len > CACHE_PACK_MAX ||
+		idx_hdr->count >= CACHE_NSLOTS / 4 * 3)
+	{
+		// 一杯になったので最初からやり直す。
+		Debug(diag_image, "%s: pack full (size=%" PRIu64 " count=%u)",
+			__func__, offset, idx_hdr->count);
+		cache_reset();
+		cache_stat.resets++;
+		offset = 0;
+	}
+
+	if (pwrite(pack_fd, &rec, sizeof(rec), offset) != sizeof(rec) ||
+		pwrite(pack_fd, data, len, offset + sizeof(rec)) != len)
+	{
+		// 中途半端に書いた分は次の追記で上書きされる。
+		if (ftruncate(pack_fd, offset) < 0) {
+			// どうしようもない。
+		}
+		goto done_unlock;
+	}
+
+	// 書き終わってから索引に載せる。
+	struct cache_slot *slot = cache_find_slot(rec.hash, true);
+	if (slot->hash == 0) {
+		idx_hdr->count++;
+	}
+	slot->offset = offset;
+	slot->length = len;
+	slot->width  = width;
+	slot->height = height;
+	slot->atime  = cache_now();
+	// キーの先頭で種類を決める (print.c でのキャッシュファイル名の規則)。
+	slot->klass  = (strncmp(key, "icon-", 5) == 0)
+		? CACHE_CLASS_ICON : CACHE_CLASS_PHOTO;
+	slot->hash   = rec.hash;
+
+	cache_stat.puts++;
+	cache_stat.put_bytes += len;
+	rv = true;
+
+ done_unlock:
+	cache_unlock();
+ done:
+	pthread_mutex_unlock(&cache_mtx);
+	return rv;
+}
+
+// エントリ e の SIXEL データの pos バイト目から最大 bufsize バイトを
+// buf に読み込む。
+// 読み込んだバイト数を返す。データの終端なら 0 を返す。
+// 失敗すれば errno をセットして -1 を返す。
+// pos が 0 の時はレコードのヘッダも読んで照合する。bufsize がヘッダより
+// 大きければ、ヘッダとデータを一度に読む。
+int
+cache_read(const struct cache_entry *e, uint pos, char *buf, uint bufsize)
+{
+	ssize_t n;
+	int fd;
+
+	if (pos >= e->length) {
+		return 0;
+	}
+
+	fd = cache_entry_fd(e);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (pos == 0) {
+		struct cache_rec_header rec;
+		const uint hdrlen = sizeof(rec);
+		bool together = (bufsize > hdrlen);
+
+		if (together) {
+			n = pread(fd, buf, MIN(bufsize, hdrlen + e->length),
+				e->offset);
+		} else {
+			n = pread(fd, &rec, hdrlen, e->offset);
+		}
+		if (n < 0) {
+			return -1;
+		}
+		if (n < hdrlen + together) {
+			errno = ESTALE;
+			return -1;
+		}
+		if (together) {
+			memcpy(&rec, buf, hdrlen);
+		}
+		if (rec.magic != CACHE_REC_MAGIC || rec.hash != e->hash ||
+			rec.length != e->length)
+		{
+			Debug(diag_image, "%s: record mismatch at %" PRIu64, __func__,
+				e->offset);
+			errno = ESTALE;
+			return -1;
+		}
+		if (together) {
+			n -= hdrlen;
+			memmove(buf, buf + hdrlen, n);
+			return n;
+		}
+	}
+
+	n = pread(fd, buf, MIN(bufsize, e->length - pos),
+		e->offset + sizeof(struct cache_rec_header) + pos);
+	if (n < 0) {
+		return -1;
+	}
+	if (n == 0) {
+		// 途中でパックファイルが空にされた。
+		errno = ESTALE;
+		return -1;
+	}
+	return n;
+}
+
+// エントリ e のデータの pos バイト目から最後までを、ファイルディスクリプタ
+// outfd に直接書き出す。stdio を経由しないので、呼び出し側は先に
+// 出力ストリームをフラッシュしておくこと。
+// 可能なら sendfile(2) でカーネル内でコピーし、使えなければ
+// 大きめのバッファで pread(2) と write(2) を繰り返す。
+// レコードのヘッダは照合しないので、先に cache_read() で pos 0 から
+// 読んでおくこと。
+// 最後まで書き出せば true を返す。
+// 失敗すれば errno をセットして false を返す。
+bool
+cache_send(const struct cache_entry *e, uint pos, int outfd)
+{
+	int fd;
+
+	if (pos >= e->length) {
+		return true;
+	}
+
+	fd = cache_entry_fd(e);
+	if (fd < 0) {
+		return false;
+	}
+	off_t off = e->offset + sizeof(struct cache_rec_header) + pos;
+	off_t end = e->offset + sizeof(struct cache_rec_header) + e->length;
+
+#if defined(HAVE_SYS_SENDFILE_H)
+	while (off < end) {
+		ssize_t n = sendfile(outfd, fd, &off, end - off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EINVAL || errno == ENOSYS) {
+				// この組み合わせでは使えない。以降は下で書く。
+				break;
+			}
+			return false;
+		}
+		if (n == 0) {
+			// 途中でパックファイルが空にされた。
+			errno = ESTALE;
+			return false;
+		}
+	}
+#endif
+
+	char *buf = NULL;
+	while (off < end) {
+		if (buf == NULL) {
+			buf = malloc(CACHE_SEND_BUFSIZE);
+			if (buf == NULL) {
+				return false;
+			}
+		}
+		ssize_t n = pread(fd, buf, MIN(end - off, CACHE_SEND_BUFSIZE), off);
+		if (n <= 0) {
+			if (n == 0) {
+				errno = ESTALE;
+			}
+			free(buf);
+			return false;
+		}
+		if (cache_write_all(outfd, buf, n) == false) {
+			free(buf);
+			return false;
+		}
+		off += n;
+	}
+	free(buf);
+	return true;
+}
+
+// 統計情報を *stat にコピーする。
+void
+cache_get_stat(struct cache_stat *stat)
+{
+	pthread_mutex_lock(&cache_mtx);
+	memcpy(stat, &cache_stat, sizeof(*stat));
+	if (idx_hdr) {
+		stat->count = idx_hdr->count;
+	}
+	pthread_mutex_unlock(&cache_mtx);
+}
+
+// 取得元 lockkey (URL など) から key のエントリを作る前に、他のプロセスと
+// 排他するためにロックする。他のプロセスがロックしていれば解放される
+// まで待つ。
+// 呼び出し側がエントリを作るべきなら true を返す。作り終えたら
+// cache_unlock_key() でロックを解放すること。ロック自体ができなくても、
+// 重複して取得するだけなので true を返す。
+// 待っている間に他のプロセスが key を追加していれば、ロックを解放して
+// false を返す。呼び出し側はそれを使えばよい。
+// 同じプロセスの他のスレッドがロックしている場合も同様。
+bool
+cache_lock_key(const char *lockkey, const char *key)
+{
+	struct flock fl;
+	uint32 pos;
+	bool waited;
+
+	if (lock_fd < 0) {
+		return true;
+	}
+	pos = cache_lock_pos(lockkey);
+
+	// fcntl のロックはスレッド間では排他しないので、まずプロセス内で
+	// 同じ位置をロックしているスレッドが解放するのを待つ。
+	waited = false;
+	pthread_mutex_lock(&lock_mtx);
+	while (lock_nheld >= LOCK_HELD_MAX || cache_lock_is_held(pos)) {
+		if (waited == false) {
+			Debug(diag_image, "%s: %s: waiting for another thread",
+				__func__, key);
+			waited = true;
+		}
+		pthread_cond_wait(&lock_cv, &lock_mtx);
+	}
+	lock_held[lock_nheld++] = pos;
+	pthread_mutex_unlock(&lock_mtx);
+	if (waited && cache_lookup(key, NULL)) {
+		cache_unlock_key(lockkey);
+		pthread_mutex_lock(&cache_mtx);
+		cache_stat.lock_shared++;
+		pthread_mutex_unlock(&cache_mtx);
+		return false;
+	}
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = pos;
+	fl.l_len = 1;
+	if (fcntl(lock_fd, F_SETLK, &fl) == 0) {
+		return true;
+	}
+	if (errno != EACCES && errno != EAGAIN) {
+		return true;
+	}
+
+	pthread_mutex_lock(&cache_mtx);
+	cache_stat.lock_waits++;
+	pthread_mutex_unlock(&cache_mtx);
+	Debug(diag_image, "%s: %s: waiting for another process", __func__, key);
+
+	while (fcntl(lock_fd, F_SETLKW, &fl) < 0) {
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EDEADLK) {
+			// fcntl のロックはプロセス単位なので、別々のスレッドが
+			// 相手のプロセスとそれぞれ別のキーを待ち合うと、実際には
+			// デッドロックしていなくてもこうなる。その場合は少しずつ
+			// 休みながら空くのを待つ。(同じキーをプロセス内の複数の
+			// スレッドが持つことは、上の表で防いでいる)
+			cache_nap(JANITOR_NAP_MSEC);
+			if (fcntl(lock_fd, F_SETLK, &fl) == 0) {
+				break;
+			}
+			continue;
+		}
+		Debug(diag_image, "%s: %s: %s", __func__, key, strerrno());
+		return true;
+	}
+
+	if (cache_lookup(key, NULL)) {
+		cache_unlock_key(lockkey);
+		pthread_mutex_lock(&cache_mtx);
+		cache_stat.lock_shared++;
+		pthread_mutex_unlock(&cache_mtx);
+		return false;
+	}
+	return true;
+}
+
+// cache_lock_key() でロックした lockkey を解放する。
+void
+cache_unlock_key(const char *lockkey)
+{
+	struct flock fl;
+	uint32 pos;
+
+	if (lock_fd < 0) {
+		return;
+	}
+	pos = cache_lock_pos(lockkey);
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = pos;
+	fl.l_len = 1;
+	fcntl(lock_fd, F_SETLK, &fl);
+
+	// プロセス内の表からも外して、待っているスレッドを起こす。
+	pthread_mutex_lock(&lock_mtx);
+	for (uint i = 0; i < lock_nheld; i++) {
+		if (lock_held[i] == pos) {
+			lock_held[i] = lock_held[--lock_nheld];
+			break;
+		}
+	}
+	pthread_cond_broadcast(&lock_cv);
+	pthread_mutex_unlock(&lock_mtx);
+}
+
+// lockkey のロックファイル上の位置を返す。
+static uint32
+cache_lock_pos(const char *lockkey)
+{
+	return cache_hash(lockkey) % LOCK_RANGE;
+}
+
+// このプロセスのいずれかのスレッドが位置 pos をロック中なら true を返す。
+// lock_mtx を保持した状態で呼ぶこと。
+static bool
+cache_lock_is_held(uint32 pos)
+{
+	for (uint i = 0; i < lock_nheld; i++) {
+		if (lock_held[i] == pos) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// 掃除用のスレッド (janitor) を起動する。
+// ストリームにつながってから呼ぶ。2回目以降は何もしない。
+void
+cache_janitor_start(void)
+{
+	static bool started;
+	sigset_t newmask;
+	sigset_t oldmask;
+	pthread_t th;
+
+	if (started || idx_hdr == NULL) {
+		return;
+	}
+	started = true;
+
+	// シグナルは表示側のスレッドで受けたいのですべてブロック。
+	sigfillset(&newmask);
+	pthread_sigmask(SIG_SETMASK, &newmask, &oldmask);
+	int r = pthread_create(&th, NULL, cache_janitor, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if (r != 0) {
+		Debug(diag_image, "%s: pthread_create failed: %s", __func__,
+			strerror(r));
+		return;
+	}
+	pthread_detach(th);
+}
+
+// キーのハッシュを返す。0 は空きスロットを表すので使わない。
+static uint64
+cache_hash(const char *key)
+{
+	uint64 hash = hash_fnv1a64(key);
+	return (hash != 0) ? hash : 1;
+}
+
+// エントリ e を検索した時の世代のパックファイルのディスクリプタを返す。
+// もう開いていなければ errno = ESTALE で -1 を返す。
+static int
+cache_entry_fd(const struct cache_entry *e)
+{
+	int fd;
+
+	pthread_mutex_lock(&cache_mtx);
+	if (e->gen == pack_gen) {
+		fd = pack_fd;
+	} else if (e->gen == old_pack_gen) {
+		fd = old_pack_fd;
+	} else {
+		fd = -1;
+	}
+	pthread_mutex_unlock(&cache_mtx);
+	if (fd < 0) {
+		errno = ESTALE;
+	}
+	return fd;
+}
+
+// buf の len バイトをすべて fd に書き出す。
+// 失敗すれば errno をセットして false を返す。
+static bool
+cache_write_all(int fd, const char *buf, uint len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+// 索引に記録する現在時刻を返す。
+static uint32
+cache_now(void)
+{
+	return (uint32)time(NULL);
+}
+
+// hash のスロットを探す。cache_mtx を保持して呼ぶこと。
+// 見付かればそのスロットを返す。
+// 見付からなければ、for_add が true なら空きスロットを、false なら NULL を
+// 返す。索引は一杯になる前に空にするので、空きは必ずある。
+static struct cache_slot *
+cache_find_slot(uint64 hash, bool for_add)
+{
+	uint i = hash % CACHE_NSLOTS;
+
+	for (uint n = 0; n < CACHE_NSLOTS; n++) {
+		struct cache_slot *slot = &idx_slots[i];
+		if (slot->hash == hash) {
+			return slot;
+		}
+		if (slot->hash == 0) {
+			return for_add ? slot : NULL;
+		}
+		i = (i + 1) % CACHE_NSLOTS;
+	}
+	assert(for_add == false);
+	return NULL;
+}
+
+// i 番目のスロットを空ける。ロックを保持して呼ぶこと。
+// 後ろに続くスロットのうち、本来の位置が空けた位置より前にあるものを
+// 詰めてくる (そうしないと検索が途中の空きで止まってしまう)。
+// そのため i 番目には別のエントリが入ることがある。
+static void
+cache_delete_slot(uint i)
+{
+	uint j = i;
+
+	for (;;) {
+		j = (j + 1) % CACHE_NSLOTS;
+		if (idx_slots[j].hash == 0) {
+			break;
+		}
+		uint home = idx_slots[j].hash % CACHE_NSLOTS;
+		// home が (i, j] の範囲 (巡回) になければ i に移せる。
+		bool movable;
+		if (i <= j) {
+			movable = (home <= i || home > j);
+		} else {
+			movable = (home <= i && home > j);
+		}
+		if (movable) {
+			idx_slots[i] = idx_slots[j];
+			i = j;
+		}
+	}
+	memset(&idx_slots[i], 0, sizeof(idx_slots[i]));
+	idx_hdr->count--;
+}
+
+// 他のプロセスがパックファイルを置き換えていれば開き直す。
+// cache_mtx を保持して呼ぶこと。
+static void
+cache_check_gen(void)
+{
+	uint32 gen = idx_hdr->generation;
+
+	if (__predict_true(gen == pack_gen)) {
+		return;
+	}
+
+	int fd = open(pack_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		Debug(diag_image, "%s: %s: %s", __func__, pack_path, strerrno());
+		return;
+	}
+	if (old_pack_fd >= 0) {
+		close(old_pack_fd);
+	}
+	old_pack_fd = pack_fd;
+	old_pack_gen = pack_gen;
+	pack_fd = fd;
+	pack_gen = gen;
+	Debug(diag_image, "%s: generation %u", __func__, gen);
+}
+
+// パックファイルと索引を空にする。ロックを保持して呼ぶこと。
+// 位置が変わるので世代も進める。
+static void
+cache_reset(void)
+{
+	memset(idx_slots, 0, sizeof(struct cache_slot) * CACHE_NSLOTS);
+	idx_hdr->count = 0;
+	if (ftruncate(pack_fd, 0) < 0) {
+		Debug(diag_image, "%s: ftruncate: %s", __func__, strerrno());
+	}
+	idx_hdr->generation++;
+	pack_gen = idx_hdr->generation;
+}
+
+// 他のプロセスとの排他のため、索引ファイルをロックする。
+static bool
+cache_lock(void)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	while (fcntl(idx_fd, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR) {
+			Debug(diag_image, "%s: %s", __func__, strerrno());
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+cache_unlock(void)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fcntl(idx_fd, F_SETLK, &fl);
+}
+
+// janitor スレッド。
+static void *
+cache_janitor(void *arg)
+{
+	sleep(JANITOR_DELAY);
+
+	cache_remove_legacy();
+	for (;;) {
+		cache_janitor_run();
+		sleep(JANITOR_INTERVAL);
+	}
+	return NULL;
+}
+
+// 期限切れと予算超過のエントリを外し、必要ならパックファイルを詰める。
+static void
+cache_janitor_run(void)
+{
+	struct cache_live *live = NULL;
+	char *buf = NULL;
+	uint nlive = 0;
+	uint64 live_bytes = 0;
+	uint64 pack_end;
+	uint32 gen;
+	struct stat st;
+	char newpath[PATH_MAX + 8];
+	int srcfd = -1;
+	int newfd = -1;
+
+	// 1. 索引から外すものを外して、残ったものを集める。
+	// ここはメモリ上の操作だけなのでロックしたまま行う。
+	pthread_mutex_lock(&cache_mtx);
+	if (cache_lock() == false) {
+		pthread_mutex_unlock(&cache_mtx);
+		return;
+	}
+	cache_check_gen();
+
+	uint32 now = cache_now();
+	for (uint i = 0; i < CACHE_NSLOTS; ) {
+		const struct cache_slot *slot = &idx_slots[i];
+		if (slot->hash != 0 && slot->klass < countof(cache_max_age) &&
+			now - slot->atime > cache_max_age[slot->klass])
+		{
+			cache_delete_slot(i);
+			cache_stat.expired++;
+			// 後ろから詰めてきたものがあるので同じ位置をもう一度見る。
+			continue;
+		}
+		i++;
+	}
+
+	live = malloc(sizeof(*live) * (idx_hdr->count + 1));
+	if (live == NULL) {
+		goto abort_locked;
+	}
+	for (uint i = 0; i < CACHE_NSLOTS; i++) {
+		const struct cache_slot *slot = &idx_slots[i];
+		if (slot->hash != 0) {
+			struct cache_live *l = &live[nlive++];
+			l->hash = slot->hash;
+			l->offset = slot->offset;
+			l->size = sizeof(struct cache_rec_header) + slot->length;
+			l->atime = slot->atime;
+			live_bytes += l->size;
+		}
+	}
+
+	// 予算を超えていれば、使われていない順に外す。
+	// 毎回ぎりぎりにならないよう 1割ほど余裕をもたせる。
+	if (live_bytes > CACHE_BUDGET) {
+		qsort(live, nlive, sizeof(*live), cmp_live_atime);
+		uint n = 0;
+		while (n < nlive && live_bytes > CACHE_BUDGET / 10 * 9) {
+			struct cache_slot *slot = cache_find_slot(live[n].hash, false);
+			if (slot) {
+				cache_delete_slot(slot - idx_slots);
+				cache_stat.evicted++;
+			}
+			live_bytes -= live[n].size;
+			n++;
+		}
+		memmove(&live[0], &live[n], sizeof(*live) * (nlive - n));
+		nlive -= n;
+	}
+
+	if (fstat(pack_fd, &st) < 0) {
+		goto abort_locked;
+	}
+	pack_end = st.st_size;
+	gen = pack_gen;
+
+	// 無駄な領域が 1/4 以上あれば詰める。
+	if (pack_end - live_bytes < pack_end / 4 || pack_end == 0) {
+		goto abort_locked;
+	}
+	srcfd = dup(pack_fd);
+	cache_unlock();
+	pthread_mutex_unlock(&cache_mtx);
+	if (srcfd < 0) {
+		goto abort;
+	}
+
+	// 2. 生きているレコードを新しいパックファイルに少しずつコピーする。
+	// ロックは取らないので、この間も表示や追加は普通にできる。
+	Debug(diag_image, "%s: compacting %" PRIu64 " -> %" PRIu64 " bytes",
+		__func__, pack_end, live_bytes);
+	snprintf(newpath, sizeof(newpath), "%s.new", pack_path);
+	newfd = open(newpath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (newfd < 0) {
+		Debug(diag_image, "%s: %s: %s", __func__, newpath, strerrno());
+		goto abort;
+	}
+	buf = malloc(JANITOR_CHUNK);
+	if (buf == NULL) {
+		goto abort;
+	}
+	qsort(live, nlive, sizeof(*live), cmp_live_offset);
+	if (cache_janitor_copy(srcfd, newfd, live, nlive, buf) == false) {
+		goto abort;
+	}
+
+	// 3. コピー中に追加された分を足して置き換える。
+	pthread_mutex_lock(&cache_mtx);
+	if (cache_lock() == false) {
+		pthread_mutex_unlock(&cache_mtx);
+		goto abort;
+	}
+	cache_janitor_commit(newfd, live, nlive, pack_end, live_bytes, gen);
+	cache_unlock();
+	pthread_mutex_unlock(&cache_mtx);
+	newfd = -1;
+
+ abort:
+	if (newfd >= 0) {
+		close(newfd);
+		unlink(newpath);
+	}
+	if (srcfd >= 0) {
+		close(srcfd);
+	}
+	free(buf);
+	free(live);
+	return;
+
+ abort_locked:
+	cache_unlock();
+	pthread_mutex_unlock(&cache_mtx);
+	free(live);
+}
+
+// live[] (nlive 個、位置順) のレコードを srcfd から dstfd へ順に詰めて
+// コピーし、新しい位置を newoffset に記録する。buf は作業用。
+// ロックは取らずに呼び、少しずつ休みながらコピーする。
+static bool
+cache_janitor_copy(int srcfd, int dstfd, struct cache_live *live, uint nlive,
+	char *buf)
+{
+	uint64 dst = 0;
+
+	for (uint i = 0; i < nlive; i++) {
+		struct cache_live *l = &live[i];
+		l->newoffset = dst;
+		for (uint pos = 0; pos < l->size; ) {
+			uint len = MIN(l->size - pos, JANITOR_CHUNK);
+			ssize_t n = pread(srcfd, buf, len, l->offset + pos);
+			if (n <= 0) {
+				Debug(diag_image, "%s: pread: %s", __func__,
+					n < 0 ? strerrno() : "short read");
+				return false;
+			}
+			if (pwrite(dstfd, buf, n, dst) != n) {
+				Debug(diag_image, "%s: pwrite: %s", __func__, strerrno());
+				return false;
+			}
+			pos += n;
+			dst += n;
+			cache_nap(JANITOR_NAP_MSEC);
+		}
+	}
+	return true;
+}
+
+// コピーし終えた新しいパックファイル newfd で置き換える。
+// live[] は位置順、pack_end はコピーを始めた時の元のパックファイルの
+// 長さ、live_bytes はコピーした長さ、gen はその時の世代。
+// cache_mtx とロックを保持して呼ぶこと。成功しても失敗しても newfd は
+// ここで引き取る。
+static void
+cache_janitor_commit(int newfd, struct cache_live *live, uint nlive,
+	uint64 pack_end, uint64 live_bytes, uint32 gen)
+{
+	struct stat st;
+	char newpath[PATH_MAX + 8];
+	uint64 *stale = NULL;
+	uint nstale = 0;
+
+	snprintf(newpath, sizeof(newpath), "%s.new", pack_path);
+
+	cache_check_gen();
+	if (pack_gen != gen || fstat(pack_fd, &st) < 0 || st.st_size < pack_end) {
+		// 途中で空にされたか、他のプロセスが詰めた。
+		Debug(diag_image, "%s: pack file changed; abort", __func__);
+		goto abort;
+	}
+
+	// コピーを始めてから追記された分 (通常はわずか) を後ろにつなげる。
+	uint64 tail = st.st_size - pack_end;
+	for (uint64 pos = 0; pos < tail; ) {
+		char buf[4096];
+		ssize_t n = pread(pack_fd, buf, MIN(tail - pos, sizeof(buf)),
+			pack_end + pos);
+		if (n <= 0 || pwrite(newfd, buf, n, live_bytes + pos) != n) {
+			Debug(diag_image, "%s: copy tail failed", __func__);
+			goto abort;
+		}
+		pos += n;
+	}
+
+	if (rename(newpath, pack_path) < 0) {
+		Debug(diag_image, "%s: rename: %s", __func__, strerrno());
+		goto abort;
+	}
+
+	// 索引の位置を新しいパックファイルでの位置に付け替える。
+	// 見付からないもの (あるはずはないが) は後でまとめて外す。
+	stale = malloc(sizeof(*stale) * (idx_hdr->count + 1));
+	for (uint i = 0; i < CACHE_NSLOTS; i++) {
+		struct cache_slot *slot = &idx_slots[i];
+		if (slot->hash == 0) {
+			continue;
+		}
+		if (slot->offset >= pack_end) {
+			slot->offset = live_bytes + (slot->offset - pack_end);
+		} else {
+			struct cache_live key;
+			key.offset = slot->offset;
+			const struct cache_live *l = bsearch(&key, live, nlive,
+				sizeof(*live), cmp_live_offset);
+			if (l && l->hash == slot->hash) {
+				slot->offset = l->newoffset;
+			} else if (stale) {
+				stale[nstale++] = slot->hash;
+			}
+		}
+	}
+	for (uint i = 0; i < nstale; i++) {
+		struct cache_slot *slot = cache_find_slot(stale[i], false);
+		if (slot) {
+			cache_delete_slot(slot - idx_slots);
+		}
+	}
+	free(stale);
+
+	// 世代を進めて、新しいパックファイルに切り替える。
+	idx_hdr->generation++;
+	if (old_pack_fd >= 0) {
+		close(old_pack_fd);
+	}
+	old_pack_fd = pack_fd;
+	old_pack_gen = pack_gen;
+	pack_fd = newfd;
+	pack_gen = idx_hdr->generation;
+
+	cache_stat.compactions++;
+	cache_stat.reclaimed += pack_end - live_bytes;
+	Debug(diag_image, "%s: generation %u", __func__, pack_gen);
+	return;
+
+ abort:
+	close(newfd);
+	unlink(newpath);
+}
+
+// 以前の 1画像 1ファイル形式のキャッシュファイルを削除する。
+static void
+cache_remove_legacy(void)
+{
+	struct dirent *d;
+	DIR *dir;
+	uint n = 0;
+
+	dir = opendir(cache_dir);
+	if (dir == NULL) {
+		return;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		size_t len = strlen(d->d_name);
+		if (len < 6 || strcmp(d->d_name + len - 6, ".sixel") != 0) {
+			continue;
+		}
+		if (unlinkat(dirfd(dir), d->d_name, 0) == 0) {
+			pthread_mutex_lock(&cache_mtx);
+			cache_stat.legacy_removed++;
+			pthread_mutex_unlock(&cache_mtx);
+		}
+		if (++n % JANITOR_FILES_PER_NAP == 0) {
+			cache_nap(JANITOR_NAP_MSEC);
+		}
+	}
+	closedir(dir);
+}
+
+// msec ミリ秒休む。
+static void
+cache_nap(uint msec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000 * 1000;
+	nanosleep(&ts, NULL);
+}
+
+// qsort 用。使った時刻の古い順。
+static int
+cmp_live_atime(const void *a, const void *b)
+{
+	const struct cache_live *la = a;
+	const struct cache_live *lb = b;
+
+	if (la->atime < lb->atime) {
+		return -1;
+	}
+	return (la->atime > lb->atime);
+}
+
+// qsort, bsearch 用。元の位置順。
+static int
+cmp_live_offset(const void *a, const void *b)
+{
+	const struct cache_live *la = a;
+	const struct cache_live *lb = b;
+
+	if (la->offset < lb->offset) {
+		return -1;
+	}
+	return (la->offset > lb->offset);
+}
@@ -74,6 +74,39 @@ struct net_opt {
 	// 接続タイムアウト [msec]。
 	// 0 ならタイムアウトしない (デフォルト)。
 	uint timeout_msec;
+
+	// 転送全体のタイムアウト [msec]。接続開始から本文を読み終わるまで。
+	// 今のところ httpclient だけが使う。
+	// 0 ならタイムアウトしない (デフォルト)。
+	uint deadline_msec;
+
+	// 受け取る本文の最大バイト数。今のところ httpclient だけが使う。
+	// Content-Length がこれを超えていれば本文を読まずに、長さが事前に
+	// 分からなければ超えた時点で EFBIG で失敗する。
+	// 0 なら無制限 (デフォルト)。
+	uint max_length;
+};
+
+// ネットワークの統計情報。
+struct net_stat {
+	uint64 tls_full;	// TLS のフルハンドシェイク数
+	uint64 tls_resumed;	// TLS のセッション再開数
+	uint64 dns_hit;		// 名前解決のキャッシュヒット数
+	uint64 dns_negative;	// 見付からなかったという結果のヒット数
+	uint64 dns_miss;	// 名前解決のキャッシュミス数
+	uint64 dns_timeout;	// 名前解決がタイムアウトした数
+	uint64 read_timeout;	// 受信の期限を過ぎた数
+};
+
+// HTTP 接続プールの統計情報。
+struct httpclient_stat {
+	uint64 connected;	// 新規に接続した数
+	uint64 reused;		// プールの接続を再利用した数
+	uint64 pooled;		// プールに戻した数
+	uint64 expired;		// 期限切れで閉じた数
+	uint64 closed;		// 再利用しようとしたら閉じられていた数
+	uint64 evicted;		// プールが一杯で閉じた数
+	uint64 retried;		// 再利用した接続で失敗してやり直した数
 };
 
 // コマンドラインオプション文字列のデコード用
@@ -118,8 +151,18 @@ extern int  httpclient_connect(struct httpclient *, const char *,
 	const struct net_opt *);
 extern const char *httpclient_get_resmsg(const struct httpclient *);
 extern FILE *httpclient_fopen(struct httpclient *);
+extern bool httpclient_is_expired(const struct httpclient *);
+extern bool httpclient_is_too_large(const struct httpclient *);
+extern uint64 httpclient_get_received(const struct httpclient *);
+extern void httpclient_pool_init(uint);
+extern void httpclient_pool_cleanup(void);
+extern void httpclient_get_stat(struct httpclient_stat *);
 extern void diag_http_header(const struct diag *, const string *);
 
+// lz.c
+extern uint lz_compress(const uint8 *, uint, uint8 *, uint);
+extern int  lz_decompress(const uint8 *, uint, uint8 *, uint);
+
 // net.c
 extern struct urlinfo *urlinfo_parse(const char *);
 extern void urlinfo_free(struct urlinfo *);
@@ -135,6 +178,10 @@ extern int  net_read(struct net *, void *, uint);
 extern int  net_write(struct net *, const void *, uint);
 extern void net_shutdown_half(struct net *);
 extern void net_close(struct net *);
+extern bool net_is_idle(const struct net *);
+extern bool net_pending(const struct net *);
+extern void net_set_deadline(struct net *, uint64);
+extern void net_get_stat(struct net_stat *);
 extern int  net_get_fd(const struct net *);
 
 // pstream.c
@@ -80,11 +80,12 @@ diag_print(const struct diag *diag, const char *fmt, ...)
 
 	if (__predict_false(diag->timestamp)) {
 		struct timespec now;
+		struct tm tm;
 		clock_gettime(CLOCK_REALTIME, &now);
-		struct tm *tm = localtime(&now.tv_sec);
+		localtime_r(&now.tv_sec, &tm);
 		uint ms = now.tv_nsec / 1000000;
 		fprintf(stderr, "%02u:%02u:%02u.%03u ",
-			tm->tm_hour, tm->tm_min, tm->tm_sec, ms);
+			tm.tm_hour, tm.tm_min, tm.tm_sec, ms);
 	}
 
 	va_start(ap, fmt);
@@ -0,0 +1,443 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 画像の先読みワーカー
+//
+
+// o 表示側はノートを表示する前に、そのノート (と後続のいくつか) で使う
+//   画像を fetchpool_request() で依頼しておく。
+// o ワーカースレッドは依頼された順にダウンロード、デコード、減色、
+//   SIXEL 変換まで行ってキャッシュファイルに書き出す。
+//   画面には一切出力しないので、表示順序は表示側が守ることになる。
+// o show_image() は表示する直前に fetchpool_wait() でそのファイルの完了を
+//   待つ。まだどのワーカーも着手していなければ表示側が自分で処理する。
+// o ジョブはキャッシュファイル名で識別する。同じファイルは二重に依頼しない。
+
+#include "sayaka.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+enum {
+	JOB_QUEUED,		// 待機中
+	JOB_RUNNING,	// 処理中
+	JOB_DONE,		// 成功した
+	JOB_FAILED,		// 失敗した
+};
+
+struct fetchjob {
+	struct fetchjob *next;
+
+	char *img_file;			// キャッシュファイル名 (拡張子なし)。キー
+	char *img_url;
+	uint width;
+	uint height;
+	bool shade;
+
+	int state;
+	int error;				// 失敗した時の errno
+	struct timespec queued;	// 依頼された時刻
+};
+
+static void *fetchpool_worker(void *);
+static void fetchpool_run(struct fetchjob *);
+static struct fetchjob *fetchpool_find(const char *);
+static void fetchpool_unlink(struct fetchjob *);
+static void fetchjob_free(struct fetchjob *);
+
+uint opt_image_workers;			// ワーカー数。0 なら使わない
+
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_job_cv = PTHREAD_COND_INITIALIZER;	// ジョブ追加
+static pthread_cond_t pool_done_cv = PTHREAD_COND_INITIALIZER;	// ジョブ完了
+
+// ジョブリスト。依頼順に並んでいる。
+static struct fetchjob *pool_head;
+static struct fetchjob *pool_tail;
+static uint pool_njobs;
+
+static uint pool_nworkers;		// 起動したワーカー数
+static struct fetchpool_stat pool_stat;
+
+// ワーカーを opt_image_workers 個起動する。
+// 起動できなければ (あるいは 0 個なら) false を返す。
+// その場合でも他の関数は呼んでよく、すべて表示側で処理することになる。
+bool
+fetchpool_init(void)
+{
+	sigset_t newmask;
+	sigset_t oldmask;
+
+	if (pool_nworkers > 0) {
+		return true;
+	}
+
+	// シグナルは表示側のスレッドで受けたいので、ワーカーには
+	// ブロックしたシグナルマスクを継承させる。
+	sigfillset(&newmask);
+	pthread_sigmask(SIG_SETMASK, &newmask, &oldmask);
+	for (uint i = 0; i < opt_image_workers; i++) {
+		pthread_t th;
+		int r = pthread_create(&th, NULL, fetchpool_worker, NULL);
+		if (r != 0) {
+			Debug(diag_image, "%s: pthread_create failed: %s", __func__,
+				strerror(r));
+			break;
+		}
+		pthread_detach(th);
+		pool_nworkers++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	Debug(diag_image, "%s: %u workers", __func__, pool_nworkers);
+	return (pool_nworkers > 0);
+}
+
+// ワーカーが動いていれば true を返す。
+bool
+fetchpool_enabled(void)
+{
+	return (pool_nworkers > 0);
+}
+
+// img_url の画像を width x height で img_file に作成するよう依頼する。
+// 引数は show_image() と同じ。
+// すでにキャッシュにあるか、同じファイルを依頼済みなら何もしない。
+void
+fetchpool_request(const char *img_file, const char *img_url,
+	uint width, uint height, bool shade)
+{
+	struct fetchjob *job;
+
+	if (pool_nworkers == 0) {
+		return;
+	}
+
+	if (opt_overwrite_cache == false && cache_lookup(img_file, NULL)) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool_mtx);
+
+	if (fetchpool_find(img_file) != NULL) {
+		goto done;
+	}
+
+	// 一杯なら、完了しているもののうち一番古いものを忘れる。
+	if (pool_njobs >= FETCHPOOL_MAX_JOBS) {
+		for (job = pool_head; job; job = job->next) {
+			if (job->state == JOB_DONE || job->state == JOB_FAILED) {
+				break;
+			}
+		}
+		if (job == NULL) {
+			// 全部処理待ちか処理中ならこれ以上は受け付けない。
+			// 表示時に表示側で処理される。
+			pool_stat.rejected++;
+			goto done;
+		}
+		fetchpool_unlink(job);
+		fetchjob_free(job);
+		pool_stat.forgotten++;
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		goto done;
+	}
+	job->img_file = strdup(img_file);
+	job->img_url = strdup(img_url);
+	if (job->img_file == NULL || job->img_url == NULL) {
+		fetchjob_free(job);
+		goto done;
+	}
+	job->width = width;
+	job->height = height;
+	job->shade = shade;
+	job->state = JOB_QUEUED;
+	clock_gettime(CLOCK_MONOTONIC, &job->queued);
+
+	if (pool_tail) {
+		pool_tail->next = job;
+	} else {
+		pool_head = job;
+	}
+	pool_tail = job;
+	pool_njobs++;
+	pool_stat.requested++;
+
+	pthread_cond_signal(&pool_job_cv);
+ done:
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+// img_file のジョブが処理待ちか処理中なら true を返す。
+bool
+fetchpool_busy(const char *img_file)
+{
+	struct fetchjob *job;
+	bool busy = false;
+
+	if (pool_nworkers == 0) {
+		return false;
+	}
+
+	pthread_mutex_lock(&pool_mtx);
+	job = fetchpool_find(img_file);
+	if (job && (job->state == JOB_QUEUED || job->state == JOB_RUNNING)) {
+		busy = true;
+	}
+	pthread_mutex_unlock(&pool_mtx);
+
+	return busy;
+}
+
+// img_file のジョブの完了を待って、結果を返す。
+// 処理中なら完了を待つ。まだ誰も着手していなければここで処理する。
+// 成功していれば 1、失敗していれば 0 を返す (errno もセットする)。
+// 依頼されていなければ -1 を返す。
+// 結果を返したジョブは忘れる。
+int
+fetchpool_wait(const char *img_file)
+{
+	struct fetchjob *job;
+	int rv;
+
+	if (pool_nworkers == 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool_mtx);
+
+	job = fetchpool_find(img_file);
+	if (job == NULL) {
+		pthread_mutex_unlock(&pool_mtx);
+		return -1;
+	}
+
+	if (job->state == JOB_QUEUED) {
+		// 誰も着手していないので自分でやる。
+		job->state = JOB_RUNNING;
+		pool_stat.self++;
+		pthread_mutex_unlock(&pool_mtx);
+		fetchpool_run(job);
+		pthread_mutex_lock(&pool_mtx);
+	} else if (job->state == JOB_RUNNING) {
+		// ワーカーの処理を待つ。
+		struct timespec start;
+		struct timespec end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (job->state == JOB_RUNNING) {
+			pthread_cond_wait(&pool_done_cv, &pool_mtx);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		pool_stat.waited++;
+		pool_stat.wait_msec +=
+			timespec_to_msec(&end) - timespec_to_msec(&start);
+	} else {
+		// 完了済み。
+		pool_stat.ready++;
+	}
+
+	if (job->state == JOB_DONE) {
+		rv = 1;
+	} else {
+		rv = 0;
+		errno = job->error;
+	}
+	fetchpool_unlink(job);
+
+	pthread_mutex_unlock(&pool_mtx);
+
+	fetchjob_free(job);
+	return rv;
+}
+
+// 処理待ちと処理中のジョブが max 個以下になるか msec 経つまで待って、
+// その時点の処理待ちと処理中のジョブ数を返す。
+// max は FETCHPOOL_MAX_JOBS / 2 までに切り詰める。
+// 完了したジョブは表示側が待つことはないのでここで忘れる。
+// 表示せずにキャッシュだけ作る時に、依頼を溢れさせないために使う。
+uint
+fetchpool_drain(uint max, uint msec)
+{
+	struct fetchjob *job;
+	struct fetchjob *next;
+	struct timespec abstime;
+	uint pending;
+
+	if (pool_nworkers == 0) {
+		return 0;
+	}
+
+	// 完了済みを忘れても一杯にならないように。
+	max = MIN(max, FETCHPOOL_MAX_JOBS / 2);
+
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_sec  += msec / 1000;
+	abstime.tv_nsec += (msec % 1000) * 1000000;
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&pool_mtx);
+	for (;;) {
+		pending = 0;
+		for (job = pool_head; job; job = next) {
+			next = job->next;
+			if (job->state == JOB_DONE || job->state == JOB_FAILED) {
+				fetchpool_unlink(job);
+				fetchjob_free(job);
+			} else {
+				pending++;
+			}
+		}
+		if (pending <= max) {
+			break;
+		}
+		if (pthread_cond_timedwait(&pool_done_cv, &pool_mtx, &abstime) != 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool_mtx);
+
+	return pending;
+}
+
+// 統計情報を *stat にコピーする。
+void
+fetchpool_get_stat(struct fetchpool_stat *stat)
+{
+	pthread_mutex_lock(&pool_mtx);
+	memcpy(stat, &pool_stat, sizeof(*stat));
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+// ワーカースレッド。
+static void *
+fetchpool_worker(void *arg)
+{
+	struct fetchjob *job;
+
+	pthread_mutex_lock(&pool_mtx);
+	for (;;) {
+		for (job = pool_head; job; job = job->next) {
+			if (job->state == JOB_QUEUED) {
+				break;
+			}
+		}
+		if (job == NULL) {
+			pthread_cond_wait(&pool_job_cv, &pool_mtx);
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&pool_mtx);
+		fetchpool_run(job);
+		pthread_mutex_lock(&pool_mtx);
+	}
+
+	// NOTREACHED
+	return NULL;
+}
+
+// job を実行する。pool_mtx を保持せずに呼ぶこと。
+// job はこの間 JOB_RUNNING なのでリストから消されることはない。
+static void
+fetchpool_run(struct fetchjob *job)
+{
+	struct timespec start;
+	bool ok;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	Debug(diag_image, "%s: %s (queued %u msec)", __func__, job->img_file,
+		(uint)(timespec_to_msec(&start) - timespec_to_msec(&job->queued)));
+
+	errno = 0;
+	ok = make_image_cache(job->img_file, job->img_url,
+		job->width, job->height, job->shade);
+
+	pthread_mutex_lock(&pool_mtx);
+	if (ok) {
+		job->state = JOB_DONE;
+	} else {
+		job->state = JOB_FAILED;
+		job->error = errno;
+		pool_stat.failed++;
+	}
+	pthread_cond_broadcast(&pool_done_cv);
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+// img_file のジョブを探す。pool_mtx を保持して呼ぶこと。
+static struct fetchjob *
+fetchpool_find(const char *img_file)
+{
+	struct fetchjob *job;
+
+	for (job = pool_head; job; job = job->next) {
+		if (strcmp(job->img_file, img_file) == 0) {
+			break;
+		}
+	}
+	return job;
+}
+
+// job をリストから外す。pool_mtx を保持して呼ぶこと。
+static void
+fetchpool_unlink(struct fetchjob *job)
+{
+	struct fetchjob *prev = NULL;
+
+	for (struct fetchjob *p = pool_head; p; prev = p, p = p->next) {
+		if (p == job) {
+			if (prev) {
+				prev->next = job->next;
+			} else {
+				pool_head = job->next;
+			}
+			if (pool_tail == job) {
+				pool_tail = prev;
+			}
+			job->next = NULL;
+			pool_njobs--;
+			break;
+		}
+	}
+}
+
+static void
+fetchjob_free(struct fetchjob *job)
+{
+	free(job->img_file);
+	free(job->img_url);
+	free(job);
+}
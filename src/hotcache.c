@@ -0,0 +1,217 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 表示済みアイコンのメモリキャッシュ
+//
+
+// o 同じユーザは何度も投稿するので、同じアイコンを何度も表示する。
+//   そのたびにディスクのキャッシュから読むのは、X68k の SCSI ディスク
+//   のような遅いディスクでは一番大きなコストになる。
+// o そこで最近表示した SIXEL をメモリ上に LRU で保持しておき、
+//   次からはメモリから直接端末に出力する。
+// o キーはディスクのキャッシュと同じ (icon-<color>-<fontheight>-...)。
+//   色数やフォントサイズはキーに含まれているので、それらが変わっても
+//   古いものが出ることはない。
+// o 保持するバイト数の合計に上限を設け、超えたら古いものから捨てる。
+//   上限の 1/4 を超えるような大きなものは最初から保持しない。
+// o 表示スレッドからのみ呼ぶので排他はしていない。
+
+#include "sayaka.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(SLOW_ARCH)
+#define HOTCACHE_MAX_BYTES	(512U * 1024)
+#define HOTCACHE_NBUCKETS	(64)
+#else
+#define HOTCACHE_MAX_BYTES	(8U * 1024 * 1024)
+#define HOTCACHE_NBUCKETS	(256)
+#endif
+
+struct hotcache_node {
+	struct hotcache_node *prev;		// LRU リスト (新しい側)
+	struct hotcache_node *next;		// LRU リスト (古い側)
+	struct hotcache_node *chain;	// ハッシュの同じバケツの次
+	uint32 hash;
+	struct hotcache_entry e;
+	char key[];						// キー、その後ろにデータが続く
+};
+
+static struct hotcache_node *hotcache_find(const char *, uint32);
+static void hotcache_unlink(struct hotcache_node *);
+static void hotcache_remove(struct hotcache_node *);
+
+static struct hotcache_node *buckets[HOTCACHE_NBUCKETS];
+static struct hotcache_node *lru_head;	// 一番最近使ったもの
+static struct hotcache_node *lru_tail;	// 一番古いもの
+static struct hotcache_stat hotcache_stat;
+
+// key のエントリを探す。
+// 見付かればそのエントリを返す (次に hotcache_put() を呼ぶまで有効)。
+// 見付からなければ NULL を返す。
+const struct hotcache_entry *
+hotcache_get(const char *key)
+{
+	struct hotcache_node *node;
+
+	hotcache_stat.lookups++;
+	node = hotcache_find(key, hash_fnv1a(key));
+	if (node == NULL) {
+		return NULL;
+	}
+	hotcache_stat.hits++;
+
+	// LRU の先頭に移動。
+	if (node != lru_head) {
+		hotcache_unlink(node);
+		node->next = lru_head;
+		lru_head->prev = node;
+		lru_head = node;
+	}
+	return &node->e;
+}
+
+// 大きさ width x height の SIXEL データ data (長さ len) をコピーして、
+// key で保持する。すでにあれば置き換える。
+// 成功すればそのエントリを返す。
+// 大きすぎて保持しない場合は errno = 0 で、メモリが確保できなければ
+// errno をセットして、NULL を返す。
+const struct hotcache_entry *
+hotcache_put(const char *key, const char *data, uint len,
+	uint width, uint height)
+{
+	struct hotcache_node *node;
+	uint32 hash = hash_fnv1a(key);
+	size_t keylen = strlen(key) + 1;
+
+	node = hotcache_find(key, hash);
+	if (node) {
+		hotcache_remove(node);
+	}
+
+	if (len > HOTCACHE_MAX_BYTES / 4) {
+		errno = 0;
+		return NULL;
+	}
+
+	node = malloc(sizeof(*node) + keylen + len);
+	if (node == NULL) {
+		return NULL;
+	}
+	memcpy(node->key, key, keylen);
+	char *p = node->key + keylen;
+	memcpy(p, data, len);
+	node->hash = hash;
+	node->e.data   = p;
+	node->e.length = len;
+	node->e.width  = width;
+	node->e.height = height;
+
+	// 入るまで古いものから捨てる。
+	while (lru_tail &&
+		hotcache_stat.bytes + len > HOTCACHE_MAX_BYTES)
+	{
+		hotcache_remove(lru_tail);
+		hotcache_stat.evicted++;
+	}
+
+	uint i = hash % HOTCACHE_NBUCKETS;
+	node->chain = buckets[i];
+	buckets[i] = node;
+	node->prev = NULL;
+	node->next = lru_head;
+	if (lru_head) {
+		lru_head->prev = node;
+	} else {
+		lru_tail = node;
+	}
+	lru_head = node;
+
+	hotcache_stat.loads++;
+	hotcache_stat.bytes += len;
+	hotcache_stat.count++;
+	return &node->e;
+}
+
+// 統計情報を *stat にコピーする。
+void
+hotcache_get_stat(struct hotcache_stat *stat)
+{
+	memcpy(stat, &hotcache_stat, sizeof(*stat));
+}
+
+// key (ハッシュは hash) のノードを返す。なければ NULL を返す。
+static struct hotcache_node *
+hotcache_find(const char *key, uint32 hash)
+{
+	struct hotcache_node *node;
+
+	for (node = buckets[hash % HOTCACHE_NBUCKETS]; node; node = node->chain) {
+		if (node->hash == hash && strcmp(node->key, key) == 0) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+// node を LRU リストから外す。
+static void
+hotcache_unlink(struct hotcache_node *node)
+{
+	if (node->prev) {
+		node->prev->next = node->next;
+	} else {
+		lru_head = node->next;
+	}
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		lru_tail = node->prev;
+	}
+	node->prev = NULL;
+	node->next = NULL;
+}
+
+// node をハッシュと LRU リストから外して解放する。
+static void
+hotcache_remove(struct hotcache_node *node)
+{
+	struct hotcache_node **p;
+
+	for (p = &buckets[node->hash % HOTCACHE_NBUCKETS]; *p; p = &(*p)->chain) {
+		if (*p == node) {
+			*p = node->chain;
+			break;
+		}
+	}
+	hotcache_unlink(node);
+
+	hotcache_stat.bytes -= node->e.length;
+	hotcache_stat.count--;
+	free(node);
+}
@@ -30,8 +30,10 @@
 
 #include "common.h"
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #if defined(HAVE_BSD_BSD_H)
 #include <bsd/stdio.h>
 #endif
@@ -57,9 +59,41 @@ struct httpclient {
 	uint chunk_len;		// 現在のバッファの有効長
 	uint chunk_pos;		// 現在位置
 
+	// 本文
+	bool chunked;			// Transfer-Encoding: chunked
+	bool has_length;		// Content-Length があった
+	uint64 body_remain;		// Content-Length の残りバイト数
+	bool body_done;			// 本文を最後まで読んだ
+	uint64 body_read;		// 本文を読んだバイト数
+	uint max_length;		// 本文の上限 (0 なら無制限)
+	bool too_large;			// 本文が上限を超えた
+
+	// 転送全体の期限 (CLOCK_MONOTONIC [usec])。0 なら期限なし。
+	uint64 deadline_usec;
+
+	// 接続の再利用
+	bool keepalive;			// 応答後もこの接続を再利用できる
+	bool reused;			// この接続はプールから取り出したもの
+	string *pool_key;		// プールのキー
+
 	const struct diag *diag;
 };
 
+// 再利用を待っている接続。
+struct http_idle {
+	struct http_idle *next;
+	struct net *net;
+	string *key;			// 接続先とオプションを表す文字列
+	uint64 since_msec;		// プールに戻した時刻 (CLOCK_MONOTONIC)
+};
+
+// 接続プールに保持する最大接続数 (全ホスト合計と、1ホストあたり)。
+#define HTTP_POOL_MAX			(8)
+#define HTTP_POOL_MAX_PER_HOST	(4)
+
+// 再利用する接続に読み残しがあった場合、これ以下なら読み捨てて再利用する。
+#define HTTP_DRAIN_MAX			(16 * 1024)
+
 static int  do_connect(struct httpclient *, const struct net_opt *);
 static int  recv_header(struct httpclient *);
 static const char *find_recvhdr(const struct httpclient *, const char *);
@@ -67,6 +101,19 @@ static void clear_recvhdr(struct httpclient *);
 static int  http_net_read_cb(void *, char *, int);
 static int  http_chunk_read_cb(void *, char *, int);
 static int  read_chunk(struct httpclient *);
+static void check_body(struct httpclient *);
+static bool count_body(struct httpclient *, int);
+static void release_net(struct httpclient *);
+static struct net *pool_get(const string *, const struct diag *);
+static void pool_put(const string *, struct net *);
+static uint64 now_msec(void);
+
+// 接続プール。複数のスレッドから使われる。
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct http_idle *pool_head;
+static uint pool_count;
+static uint pool_idle_msec;		// 0 ならプールを使わない
+static struct httpclient_stat pool_stat;
 
 struct httpclient *
 httpclient_create(const struct diag *diag)
@@ -89,8 +136,9 @@ httpclient_destroy(struct httpclient *http)
 	if (http) {
 		string_free(http->resline);
 		clear_recvhdr(http);
-		net_destroy(http->net);
+		release_net(http);
 		urlinfo_free(http->url);
+		string_free(http->pool_key);
 		free(http->chunk_buf);
 		free(http);
 	}
@@ -117,42 +165,100 @@ httpclient_connect(struct httpclient *http, const char *urlstr,
 		string_free(u);
 	}
 
+	// 期限はリダイレクトややり直しも含めた全体に対して設ける。
+	// httpclient_fopen() で本文を読み終わるまで有効。
+	if (opt->deadline_msec != 0) {
+		http->deadline_usec = now_msec() * 1000 +
+			(uint64)opt->deadline_msec * 1000;
+	}
+
+	http->max_length = opt->max_length;
+	http->too_large = false;
+
+	bool retried = false;
 	for (;;) {
-		// net を(再)生成。
-		if (http->net) {
-			net_destroy(http->net);
-		}
-		http->net = net_create(diag);
-		if (http->net == NULL) {
-			Debug(diag, "%s: net_create failed", __func__);
-			return -1;
+		// 接続先が変わったかも知れないのでキーを作り直す。
+		const char *scheme = string_get(http->url->scheme);
+		const char *host = string_get(http->url->host);
+		const char *pqf  = string_get(http->url->pqf);
+		string_free(http->pool_key);
+		http->pool_key = string_init();
+		string_append_printf(http->pool_key, "%s://%s:%s/%d%s",
+			scheme, host, string_get(http->url->port),
+			opt->address_family, (opt->use_rsa_only ? "/rsa" : ""));
+
+		// 前の接続は再利用できるなら戻してから、net を(再)生成。
+		// やり直しの時は新しく接続する。
+		release_net(http);
+		http->net = NULL;
+		if (retried == false) {
+			http->net = pool_get(http->pool_key, diag);
 		}
-
-		// 接続。
-		int r = do_connect(http, opt);
-		if (r < 0) {
-			Debug(diag, "%s: do_connect failed: %s", __func__,
-				(r == -1 ? strerrno() : "SSL not compiled"));
-			return r;
+		if (http->net) {
+			http->reused = true;
+			net_set_deadline(http->net, http->deadline_usec);
+		} else {
+			http->reused = false;
+			http->net = net_create(diag);
+			if (http->net == NULL) {
+				Debug(diag, "%s: net_create failed", __func__);
+				return -1;
+			}
+			net_set_deadline(http->net, http->deadline_usec);
+
+			// 接続。
+			int r = do_connect(http, opt);
+			if (r < 0) {
+				Debug(diag, "%s: do_connect failed: %s", __func__,
+					(r == -1 ? strerrno() : "SSL not compiled"));
+				return r;
+			}
+			if (pool_idle_msec != 0) {
+				pthread_mutex_lock(&pool_mtx);
+				pool_stat.connected++;
+				pthread_mutex_unlock(&pool_mtx);
+			}
 		}
 
 		// ヘッダを送信。
-		const char *host = string_get(http->url->host);
-		const char *pqf  = string_get(http->url->pqf);
+		// プールを使う場合は HTTP/1.1 のデフォルトどおり持続接続にする。
 		string *hdr = string_init();
 		string_append_printf(hdr, "GET %s HTTP/1.1\r\n", pqf);
 		string_append_printf(hdr, "Host: %s\r\n", host);
-		string_append_cstr(hdr,   "Connection: close\r\n");
+		if (pool_idle_msec == 0) {
+			string_append_cstr(hdr, "Connection: close\r\n");
+		}
 		string_append_printf(hdr, "User-Agent: %s/%s\r\n", progname, progver);
 		string_append_cstr(hdr,   "\r\n");
 		if (__predict_false(diag_get_level(diag) >= 2)) {
 			diag_http_header(http->diag, hdr);	// デバッグ表示
 		}
-		net_write(http->net, string_get(hdr), string_len(hdr));
+		int w = net_write(http->net, string_get(hdr), string_len(hdr));
 		string_free(hdr);
 
 		// 応答を受信。
-		int code = recv_header(http);
+		int code = -1;
+		if (w > 0) {
+			code = recv_header(http);
+		}
+
+		// 再利用した接続が向こうで閉じられていたら、一度だけ新しい接続で
+		// やり直す。
+		if (code < 0 && http->reused && http->resline == NULL && !retried) {
+			Debug(diag, "%s: reused connection was closed; retrying",
+				__func__);
+			pthread_mutex_lock(&pool_mtx);
+			pool_stat.retried++;
+			pthread_mutex_unlock(&pool_mtx);
+			retried = true;
+			http->keepalive = false;
+			clear_recvhdr(http);
+			continue;
+		}
+		if (code < 0) {
+			return code;
+		}
+		check_body(http);
 
 		if (300 <= code && code < 400) {
 			const char *location = find_recvhdr(http, "Location:");
@@ -173,20 +279,36 @@ httpclient_connect(struct httpclient *http, const char *urlstr,
 					string_free(u);
 				}
 				// 内部状態をリセット。
-				net_close(http->net);
+				// 接続はリダイレクト応答の本文を読み捨てられれば再利用する。
+				release_net(http);
 				clear_recvhdr(http);
 				string_free(http->resline);
 				http->resline = NULL;
 				http->rescode = 0;
 				http->resmsg = NULL;
+				retried = false;
 				continue;
 			}
 		} else if (code >= 400) {
 			return code;
 		}
 
+		// 大きすぎるなら本文は読まない。
+		if (http->max_length != 0 && http->has_length &&
+			http->body_remain > http->max_length)
+		{
+			Debug(diag, "%s: Content-Length %" PRIu64 " exceeds %u",
+				__func__, http->body_remain, http->max_length);
+			http->keepalive = false;
+			http->too_large = true;
+			errno = EFBIG;
+			return -1;
+		}
+
 		Trace(diag, "%s: connected.", __func__);
-		net_shutdown_half(http->net);
+		if (http->keepalive == false) {
+			net_shutdown_half(http->net);
+		}
 		return 0;
 	}
 }
@@ -370,6 +492,128 @@ clear_recvhdr(struct httpclient *http)
 	http->recvhdr_num = 0;
 }
 
+// 受信ヘッダから本文の長さの決まり方と、接続を再利用できるかを調べる。
+static void
+check_body(struct httpclient *http)
+{
+	const char *p;
+
+	http->chunked = false;
+	http->has_length = false;
+	http->body_remain = 0;
+	http->body_read = 0;
+	http->body_done = false;
+	http->chunk_len = 0;
+	http->chunk_pos = 0;
+
+	p = find_recvhdr(http, "Transfer-Encoding:");
+	if (p && strcasecmp(p, "chunked") == 0) {
+		http->chunked = true;
+	} else {
+		p = find_recvhdr(http, "Content-Length:");
+		if (p) {
+			char *end;
+			errno = 0;
+			unsigned long long len = strtoull(p, &end, 10);
+			if (errno == 0 && end != p) {
+				http->has_length = true;
+				http->body_remain = len;
+			}
+		}
+	}
+	// 1xx, 204, 304 は本文を持たない。
+	if (http->rescode < 200 || http->rescode == 204 || http->rescode == 304) {
+		http->chunked = false;
+		http->has_length = true;
+		http->body_remain = 0;
+	}
+	if (http->has_length && http->body_remain == 0) {
+		http->body_done = true;
+	}
+
+	// 再利用できるのは、プールが有効で、本文の終わりが分かり、
+	// サーバが接続を閉じると言っていない場合。
+	http->keepalive = false;
+	if (pool_idle_msec != 0 && (http->chunked || http->has_length)) {
+		const char *conn = find_recvhdr(http, "Connection:");
+		if (strncmp(string_get(http->resline), "HTTP/1.1", 8) == 0) {
+			if (conn == NULL || strcasecmp(conn, "close") != 0) {
+				http->keepalive = true;
+			}
+		} else {
+			if (conn && strcasecmp(conn, "keep-alive") == 0) {
+				http->keepalive = true;
+			}
+		}
+	}
+	Trace(http->diag, "%s: %s remain=%" PRIu64 "%s", __func__,
+		(http->chunked ? "chunked" : http->has_length ? "length" : "eof"),
+		http->body_remain, (http->keepalive ? " keep-alive" : ""));
+}
+
+// 今の接続を手放す。
+// 本文を最後まで読んでいて再利用できるなら、プールに戻す。
+static void
+release_net(struct httpclient *http)
+{
+	if (http->net == NULL) {
+		return;
+	}
+
+	// 読み残しが少しなら読み捨てて再利用する。
+	// 期限切れならもう読まない。
+	if (http->keepalive && http->body_done == false &&
+		(http->chunked || http->body_remain <= HTTP_DRAIN_MAX) &&
+		httpclient_is_expired(http) == false)
+	{
+		char buf[1024];
+		uint total = 0;
+		int n;
+		do {
+			if (http->chunked) {
+				n = http_chunk_read_cb(http, buf, sizeof(buf));
+			} else {
+				n = http_net_read_cb(http, buf, sizeof(buf));
+			}
+			total += MAX(n, 0);
+		} while (n > 0 && total <= HTTP_DRAIN_MAX);
+		Trace(http->diag, "%s: drained %u bytes", __func__, total);
+	}
+
+	if (http->keepalive && http->body_done) {
+		// 期限はこの転送のものなので外して戻す。
+		net_set_deadline(http->net, 0);
+		pool_put(http->pool_key, http->net);
+	} else {
+		net_destroy(http->net);
+	}
+	http->net = NULL;
+	http->keepalive = false;
+}
+
+// 転送全体の期限 (net_opt.deadline_msec) を過ぎていれば true を返す。
+// 取得に失敗した時に、それが期限切れによるものかを調べるために使う。
+bool
+httpclient_is_expired(const struct httpclient *http)
+{
+	return (http->deadline_usec != 0 &&
+		now_msec() * 1000 >= http->deadline_usec);
+}
+
+// 本文が net_opt.max_length を超えたため失敗したのなら true を返す。
+bool
+httpclient_is_too_large(const struct httpclient *http)
+{
+	return http->too_large;
+}
+
+// これまでに受信した本文のバイト数を返す。
+uint64
+httpclient_get_received(const struct httpclient *http)
+{
+	return http->body_read;
+}
+
 // HTTP 応答のメッセージ部分を返す。
 // 接続していないなどでメッセージがなければ NULL を返す。
 const char *
@@ -381,13 +625,13 @@ httpclient_get_resmsg(const struct httpclient *http)
 // ストリームを返す。
 // httpclient_connect() が成功した場合のみ有効。
 // 受け取った fp は fclose() すること。
+// Content-Length があればその長さで、chunked ならその終端で EOF になる。
 FILE *
 httpclient_fopen(struct httpclient *http)
 {
 	FILE *fp;
 
-	const char *transfer = find_recvhdr(http, "Transfer-Encoding:");
-	if (transfer && strcasecmp(transfer, "chunked") == 0) {
+	if (http->chunked) {
 		fp = funopen(http, http_chunk_read_cb, NULL, NULL, NULL);
 		if (fp == NULL) {
 			Debug(http->diag, "%s: funopen(chunk) failed: %s", __func__,
@@ -409,7 +653,34 @@ static int
 http_net_read_cb(void *arg, char *dst, int dstsize)
 {
 	struct httpclient *http = (struct httpclient *)arg;
-	int n = net_read(http->net, dst, dstsize);
+
+	if (http->has_length == false) {
+		// 長さが分からなければ切断されるまで読む。
+		int n = net_read(http->net, dst, dstsize);
+		if (n == 0) {
+			http->body_done = true;
+		}
+		if (count_body(http, n) == false) {
+			return -1;
+		}
+		return n;
+	}
+
+	if (http->body_remain == 0) {
+		http->body_done = true;
+		return 0;
+	}
+	int n = net_read(http->net, dst, MIN(http->body_remain, (uint)dstsize));
+	if (n > 0) {
+		http->body_read += n;
+		http->body_remain -= n;
+		if (http->body_remain == 0) {
+			http->body_done = true;
+		}
+	} else {
+		// 途中で切れたり失敗した接続は再利用しない。
+		http->keepalive = false;
+	}
 	return n;
 }
 
@@ -421,12 +692,19 @@ http_chunk_read_cb(void *arg, char *dst, int dstsize)
 
 	Verbose(diag, "%s(%d)", __func__, dstsize);
 
+	if (http->body_done) {
+		return 0;
+	}
+
 	// バッファが空なら次のチャンクを読み込む。
 	if (http->chunk_pos == http->chunk_len) {
 		Verbose(diag, "%s Need to fill", __func__);
 		int r = read_chunk(http);
 		Verbose(diag, "%s read_chunk filled %d", __func__, r);
 		if (__predict_false(r < 1)) {
+			if (r < 0) {
+				http->keepalive = false;
+			}
 			return r;
 		}
 	}
@@ -436,9 +714,31 @@ http_chunk_read_cb(void *arg, char *dst, int dstsize)
 	Verbose(diag, "%s copylen=%d", __func__, copylen);
 	memcpy(dst, http->chunk_buf + http->chunk_pos, copylen);
 	http->chunk_pos += copylen;
+	if (count_body(http, copylen) == false) {
+		return -1;
+	}
 	return copylen;
 }
 
+// 長さが事前に分からない本文を n バイト読んだことを記録する。
+// 上限を超えたら errno を EFBIG にして false を返す。
+static bool
+count_body(struct httpclient *http, int n)
+{
+	if (n > 0) {
+		http->body_read += n;
+		if (http->max_length != 0 && http->body_read > http->max_length) {
+			Debug(http->diag, "%s: body exceeds %u", __func__,
+				http->max_length);
+			http->keepalive = false;
+			http->too_large = true;
+			errno = EFBIG;
+			return false;
+		}
+	}
+	return true;
+}
+
 // 1つのチャンクを読み込む。
 // 成功すれば読み込んだバイト数を返す。
 // 失敗すれば errno をセットして -1 を返す。
@@ -456,6 +756,7 @@ read_chunk(struct httpclient *http)
 	}
 	if (__predict_false(string_len(slen) == 0)) {
 		Debug(diag, "%s: Unexpected EOF while reading chunk length?", __func__);
+		http->keepalive = false;
 		chunklen = 0;
 		goto done;
 	}
@@ -480,9 +781,23 @@ read_chunk(struct httpclient *http)
 	Verbose(diag, "chunklen=%d", chunklen);
 
 	if (chunklen == 0) {
-		// データ終わり。CRLF を読み捨てる。
-		string *dummy = net_gets(http->net);
-		string_free(dummy);
+		// データ終わり。トレーラがあれば空行まで読み捨てる。
+		for (;;) {
+			string *dummy = net_gets(http->net);
+			if (dummy == NULL || string_len(dummy) == 0) {
+				// 空行の前に切れた。
+				string_free(dummy);
+				http->keepalive = false;
+				break;
+			}
+			string_rtrim_inplace(dummy);
+			bool empty = (string_len(dummy) == 0);
+			string_free(dummy);
+			if (empty) {
+				break;
+			}
+		}
+		http->body_done = true;
 		Verbose(diag, "%s: This wa sthe last chunk.", __func__);
 		goto done;
 	}
@@ -533,6 +848,188 @@ read_chunk(struct httpclient *http)
 }
 
 
+//
+// 接続プール
+//
+
+// 接続プールを有効にする。
+// 以降、本文を最後まで読んだ接続はプールに戻され、同じ接続先
+// (とオプション) への次のリクエストで再利用される。
+// idle_msec はプールに置いておく最大時間 [msec]。0 なら無効のまま。
+void
+httpclient_pool_init(uint idle_msec)
+{
+	pthread_mutex_lock(&pool_mtx);
+	pool_idle_msec = idle_msec;
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+// プールの接続をすべて閉じて、プールを無効にする。
+void
+httpclient_pool_cleanup(void)
+{
+	struct http_idle *list;
+
+	pthread_mutex_lock(&pool_mtx);
+	list = pool_head;
+	pool_head = NULL;
+	pool_count = 0;
+	pool_idle_msec = 0;
+	pthread_mutex_unlock(&pool_mtx);
+
+	while (list) {
+		struct http_idle *next = list->next;
+		net_destroy(list->net);
+		string_free(list->key);
+		free(list);
+		list = next;
+	}
+}
+
+// 統計情報を *stat にコピーする。
+void
+httpclient_get_stat(struct httpclient_stat *stat)
+{
+	pthread_mutex_lock(&pool_mtx);
+	memcpy(stat, &pool_stat, sizeof(*stat));
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+// key に対応する再利用可能な接続をプールから取り出す。
+// なければ NULL を返す。
+// 古すぎるものや、サーバから閉じられたものはここで捨てる。
+static struct net *
+pool_get(const string *key, const struct diag *diag)
+{
+	struct http_idle **p;
+	struct http_idle *e;
+	struct http_idle *found = NULL;
+	struct http_idle *dead = NULL;
+	uint64 now = now_msec();
+
+	pthread_mutex_lock(&pool_mtx);
+	for (p = &pool_head; (e = *p) != NULL; ) {
+		if (now - e->since_msec > pool_idle_msec) {
+			// 期限切れ。
+			*p = e->next;
+			e->next = dead;
+			dead = e;
+			pool_count--;
+			pool_stat.expired++;
+			continue;
+		}
+		if (found == NULL && strcmp(string_get(e->key), string_get(key)) == 0) {
+			*p = e->next;
+			pool_count--;
+			if (net_is_idle(e->net)) {
+				found = e;
+			} else {
+				// 向こうから閉じられたか、余計なデータが来ている。
+				e->next = dead;
+				dead = e;
+				pool_stat.closed++;
+			}
+			continue;
+		}
+		p = &e->next;
+	}
+	if (found) {
+		pool_stat.reused++;
+	}
+	pthread_mutex_unlock(&pool_mtx);
+
+	while (dead) {
+		e = dead->next;
+		net_destroy(dead->net);
+		string_free(dead->key);
+		free(dead);
+		dead = e;
+	}
+
+	if (found == NULL) {
+		return NULL;
+	}
+	Debug(diag, "Reusing connection %s (idle %u msec)",
+		string_get(key), (uint)(now - found->since_msec));
+	struct net *net = found->net;
+	string_free(found->key);
+	free(found);
+	return net;
+}
+
+// 接続 net を key に対応する接続としてプールに戻す。
+// プールが一杯なら一番古いものを閉じる。
+static void
+pool_put(const string *key, struct net *net)
+{
+	struct http_idle *e;
+	struct http_idle *victim = NULL;
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL) {
+		net_destroy(net);
+		return;
+	}
+	e->net = net;
+	e->key = string_dup(key);
+	e->since_msec = now_msec();
+
+	pthread_mutex_lock(&pool_mtx);
+	if (pool_idle_msec == 0) {
+		// 途中で無効にされた。
+		victim = e;
+	} else {
+		// 同じ接続先の数と、一番古いもの (末尾) を調べる。
+		uint same = 0;
+		struct http_idle **oldest = NULL;
+		struct http_idle **oldest_same = NULL;
+		struct http_idle **p;
+		for (p = &pool_head; *p; p = &(*p)->next) {
+			oldest = p;
+			if (strcmp(string_get((*p)->key), string_get(key)) == 0) {
+				same++;
+				oldest_same = p;
+			}
+		}
+		if (same >= HTTP_POOL_MAX_PER_HOST) {
+			victim = *oldest_same;
+		} else if (pool_count >= HTTP_POOL_MAX) {
+			victim = *oldest;
+		}
+		if (victim) {
+			// victim を外す。
+			for (p = &pool_head; *p != victim; p = &(*p)->next)
+				;
+			*p = victim->next;
+			pool_count--;
+			pool_stat.evicted++;
+		}
+		// 新しいものは先頭に置く。
+		e->next = pool_head;
+		pool_head = e;
+		pool_count++;
+		pool_stat.pooled++;
+	}
+	pthread_mutex_unlock(&pool_mtx);
+
+	if (victim) {
+		net_destroy(victim->net);
+		string_free(victim->key);
+		free(victim);
+	}
+}
+
+// 現在時刻 (CLOCK_MONOTONIC) を msec で返す。
+static uint64
+now_msec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_msec(&now);
+}
+
+
 #if defined(TEST)
 
 #include <err.h>
@@ -30,6 +30,8 @@
 
 #include "common.h"
 #include "image_priv.h"
+#include <errno.h>
+#include <pthread.h>
 #include <string.h>
 
 //#define IMAGE_PROFILE
@@ -152,6 +154,27 @@ static inline int16 saturate_adderr(int16, int);
 static const ColorRGB palette_fixed8[];
 static const ColorRGB palette_vga16[];
 
+// デコードの資源制限。
+// 巨大な画像 (や悪意のある画像) を真に受けてデコードすると、
+// image_reduct() で縮小する前に何百 MB も確保しようとして、
+// メモリの少ない機種ではプロセスごと死んでしまう。
+// そのため各ローダはヘッダを読んで大きさが分かった時点で
+// image_limit_check() を呼んで、超えていればデコードせずに失敗する。
+// 縮小デコードが出来るローダは image_limit_shift() で縮小率を決める。
+static struct image_limit image_limit = {
+#if defined(SLOW_ARCH)
+	.max_pixels = 16 * 1024 * 1024,
+	.max_memory = 8 * 1024 * 1024,
+	.max_frames = 100,
+#else
+	.max_pixels = 100 * 1000 * 1000,
+	.max_memory = 512 * 1024 * 1024,
+	.max_frames = 1000,
+#endif
+};
+static struct image_limit_stat image_limit_stat;
+static pthread_mutex_t image_limit_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 // opt を初期化する。
 void
 image_opt_init(struct image_opt *opt)
@@ -166,6 +189,98 @@ image_opt_init(struct image_opt *opt)
 	opt->suppress_palette = false;
 }
 
+// デコードの資源制限を lim に設定する。
+// ローダが動いていない間 (起動時) に呼ぶこと。
+void
+image_set_limit(const struct image_limit *lim)
+{
+	image_limit = *lim;
+}
+
+// 現在のデコードの資源制限を *lim にコピーする。
+void
+image_get_limit(struct image_limit *lim)
+{
+	*lim = image_limit;
+}
+
+// 資源制限の統計情報を *stat にコピーする。
+void
+image_get_limit_stat(struct image_limit_stat *stat)
+{
+	pthread_mutex_lock(&image_limit_mtx);
+	memcpy(stat, &image_limit_stat, sizeof(*stat));
+	pthread_mutex_unlock(&image_limit_mtx);
+}
+
+// width x height で frames フレームある画像のデコードに memsize バイト
+// 必要な場合に、資源制限に収まっているかを調べる。
+// 収まっていれば true を返す。
+// 超えていれば errno を EFBIG にして false を返す。
+// ローダはヘッダを読んで大きさが分かった時点 (大きなバッファを確保する前)
+// でこれを呼ぶこと。
+bool
+image_limit_check(uint width, uint height, uint frames, uint64 memsize,
+	const struct diag *diag)
+{
+	uint64 pixels = (uint64)width * height;
+	bool rv = false;
+
+	pthread_mutex_lock(&image_limit_mtx);
+	image_limit_stat.checked++;
+	if (image_limit.max_pixels != 0 && pixels > image_limit.max_pixels) {
+		image_limit_stat.over_pixels++;
+		Debug(diag, "%s: %ux%u exceeds max pixels %u", __func__,
+			width, height, image_limit.max_pixels);
+	} else if (image_limit.max_memory != 0 && memsize > image_limit.max_memory) {
+		image_limit_stat.over_memory++;
+		Debug(diag, "%s: %ux%u needs %" PRIu64 " bytes, exceeds %u", __func__,
+			width, height, memsize, image_limit.max_memory);
+	} else if (image_limit.max_frames != 0 && frames > image_limit.max_frames) {
+		image_limit_stat.over_frames++;
+		Debug(diag, "%s: %u frames exceeds %u", __func__,
+			frames, image_limit.max_frames);
+	} else {
+		rv = true;
+	}
+	pthread_mutex_unlock(&image_limit_mtx);
+
+	if (rv == false) {
+		errno = EFBIG;
+	}
+	return rv;
+}
+
+// 縮小デコードが出来るローダ用。
+// 1ピクセル bytepp バイトで width x height の画像を、縦横 1/2^n に
+// 縮小してデコードする場合に資源制限に収まる minshift 以上の最小の n を
+// 返す。minshift はローダがもともと (表示サイズから) 使うつもりの縮小率。
+// maxshift までで収まらなければ maxshift を返す (この場合
+// image_limit_check() で失敗するはず)。
+uint
+image_limit_shift(uint width, uint height, uint bytepp,
+	uint minshift, uint maxshift)
+{
+	uint shift;
+
+	for (shift = minshift; shift < maxshift; shift++) {
+		uint64 pixels = (uint64)(width >> shift) * (height >> shift);
+		if ((image_limit.max_pixels == 0 ||
+		     pixels <= image_limit.max_pixels) &&
+		    (image_limit.max_memory == 0 ||
+		     pixels * bytepp <= image_limit.max_memory))
+		{
+			break;
+		}
+	}
+	if (shift > minshift) {
+		pthread_mutex_lock(&image_limit_mtx);
+		image_limit_stat.reduced++;
+		pthread_mutex_unlock(&image_limit_mtx);
+	}
+	return shift;
+}
+
 // (引数の) 文字列から ColorMode を返す。
 // エラーなら COLOR_MODE_NONE を返す。
 ColorMode
@@ -237,6 +352,8 @@ image_create(uint width_, uint height_, uint format_)
 
 	img->width = width_;
 	img->height = height_;
+	img->orig_width = width_;
+	img->orig_height = height_;
 	img->format = format_;
 	img->buf = malloc(image_get_stride(img) * img->height);
 	if (img->buf == NULL) {
@@ -824,6 +941,62 @@ rational_add(Rational *sr, const Rational *x)
 } while (0)
 
 
+//
+// 16bit 内部形式のままのリサイズ
+//
+
+// 16bit 内部形式の src 画像を (dst_width, dst_height) に縮小した、
+// 同じ形式の新しい image を作成して返す。減色はしない。
+// 画素は平均するだけで、過半数が透明なら透明とする。
+struct image *
+image_resize16(const struct image *src, uint dst_width, uint dst_height)
+{
+	struct image *dst;
+
+	assert(src->format == IMAGE_FMT_ARGB16);
+
+	dst = image_create(dst_width, dst_height, IMAGE_FMT_ARGB16);
+	if (dst == NULL) {
+		return NULL;
+	}
+	dst->has_alpha = src->has_alpha;
+
+	RESIZE_INIT(dst_width, dst_height, src);
+	const uint16 *s16 = (const uint16 *)src->buf;
+	uint16 *d16 = (uint16 *)dst->buf;
+	for (uint y = 0; y < dst_height; y++) {
+		RESIZE_STEP(sy0, sy1, ry, ystep);
+		RESIZE_RESET_X();
+		for (uint x = 0; x < dst_width; x++) {
+			RESIZE_STEP(sx0, sx1, rx, xstep);
+
+			uint r = 0;
+			uint g = 0;
+			uint b = 0;
+			uint a = 0;
+			for (uint sy = sy0; sy < sy1; sy++) {
+				const uint16 *s = &s16[sy * src->width + sx0];
+				for (uint sx = sx0; sx < sx1; sx++) {
+					uint16 v = *s++;
+					a +=  (v >> 15);
+					r += ((v >> 10) & 0x1f);
+					g += ((v >>  5) & 0x1f);
+					b += ( v        & 0x1f);
+				}
+			}
+			uint area = (sy1 - sy0) * (sx1 - sx0);
+			uint16 v = ((r / area) << 10) | ((g / area) << 5) | (b / area);
+			if (a > area / 2) {
+				v |= 0x8000;
+			}
+			*d16++ = v;
+		}
+	}
+
+	return dst;
+}
+
+
 //
 // 減色 & リサイズ
 //
@@ -226,6 +226,11 @@ struct image
 	uint height;	// ピクセル高さ
 	uint format;	// 形式 (IMAGE_FMT_*)
 
+	// 元画像の大きさ。ローダが縮小してデコードした場合は width、height
+	// より大きい。image_create() は width、height と同じにする。
+	uint orig_width;
+	uint orig_height;
+
 	// この画像が透過ピクセルを持つ場合 true。
 	// アルファチャンネルを持つ画像形式かではなく透過ピクセルを持つ画像か。
 	// ただし実際に全数調査するか、入力形式から推定するだけかはある。
@@ -262,6 +267,22 @@ typedef struct image_read_hint_ {
 	uint page;
 } image_read_hint;
 
+// デコードの資源制限。0 なら制限しない。
+struct image_limit {
+	uint max_pixels;		// 1フレームの最大ピクセル数
+	uint max_memory;		// デコードに使う最大メモリ [byte]
+	uint max_frames;		// 最大フレーム数
+};
+
+// 資源制限の統計情報。
+struct image_limit_stat {
+	uint64 checked;			// 調べた画像数
+	uint64 reduced;			// 制限のため縮小デコードした数
+	uint64 over_pixels;		// ピクセル数超過で拒否した数
+	uint64 over_memory;		// メモリ超過で拒否した数
+	uint64 over_frames;		// フレーム数超過で拒否した数
+};
+
 struct image_opt {
 	// 減色
 	ReductorMethod method;
@@ -286,9 +307,13 @@ struct image_opt {
 // image.c
 extern void image_opt_init(struct image_opt *);
 extern ColorMode image_parse_color(const char *);
+extern void image_set_limit(const struct image_limit *);
+extern void image_get_limit(struct image_limit *);
+extern void image_get_limit_stat(struct image_limit_stat *);
 extern int  image_match(struct pstream *, const struct diag *);
 extern struct image *image_read(struct pstream *, int,
 	const image_read_hint *, const struct diag *);
+extern struct image *image_create(uint, uint, uint);
 extern void image_free(struct image *);
 extern uint image_get_bytepp(const struct image *);
 extern uint image_get_stride(const struct image *);
@@ -296,6 +321,7 @@ extern void image_get_preferred_size(uint, uint, ResizeAxis,
 	uint, uint, uint *, uint *);
 extern char **image_get_loaderinfo(void);
 extern void image_convert_to16(struct image *);
+extern struct image *image_resize16(const struct image *, uint, uint);
 extern struct image *image_reduct(struct image *, uint, uint,
 	const struct image_opt *, const struct diag *);
 
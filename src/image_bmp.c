@@ -245,6 +245,11 @@ image_bmp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	fseek(fp, offbits, SEEK_SET);
 
 	// 直接内部形式にする。
+	if (image_limit_check(bmp->width, bmp->height, 1,
+		(uint64)bmp->width * bmp->height * 2, diag) == false)
+	{
+		return NULL;
+	}
 	bmp->img = image_create(bmp->width, bmp->height, IMAGE_FMT_ARGB16);
 	if (bmp->img == NULL) {
 		return NULL;
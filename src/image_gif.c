@@ -31,8 +31,11 @@
 #include "common.h"
 #include "image_priv.h"
 #include <err.h>
+#include <errno.h>
 #include <gif_lib.h>
+#include <stdlib.h>
 
+static bool gif_slurp(GifFileType *, int, bool *, const struct diag *);
 static struct image *image_gif_static(GifFileType *, int, const struct diag *);
 static struct image *image_gif_multi(GifFileType *, int, const struct diag *);
 static int gif_read(GifFileType *, GifByteType *, int);
@@ -70,6 +73,7 @@ image_gif_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	struct image *img;
 	int errcode;
 	int transparent_color;
+	bool more;
 
 	img = NULL;
 
@@ -80,18 +84,22 @@ image_gif_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		return NULL;
 	}
 
-	// 展開。
-	errcode = DGifSlurp(gif);
-	if (errcode != GIF_OK) {
-		warnx("%s: DGifSlurp failed: %s", __func__, GifErrorString(gif->Error));
+	int page = hint->page;
+
+	// 展開。必要なページまでを、資源制限を調べながら展開する。
+	errno = 0;
+	if (gif_slurp(gif, page, &more, diag) == false) {
+		if (errno != EFBIG) {
+			warnx("%s: gif_slurp failed: %s", __func__,
+				GifErrorString(gif->Error));
+		}
 		goto done;
 	}
 
-	int page = hint->page;
-
 	if (diag_get_level(diag) >= 1) {
-		diag_print(diag, "%s: frame_count=%u bgcolor=%d global_colormap=%s",
-			__func__, gif->ImageCount, gif->SBackGroundColor,
+		diag_print(diag, "%s: frame_count=%u%s bgcolor=%d global_colormap=%s",
+			__func__, gif->ImageCount, (more ? "+" : ""),
+			gif->SBackGroundColor,
 			(gif->SColorMap ? "yes" : "no"));
 		for (uint i = 0; i < gif->ImageCount; i++) {
 			DGifSavedExtensionToGCB(gif, i, &gcb);
@@ -115,7 +123,7 @@ image_gif_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	DGifSavedExtensionToGCB(gif, page, &gcb);
 	transparent_color = gcb.TransparentColor;
 
-	if (gif->ImageCount == 1 || transparent_color < 0) {
+	if ((gif->ImageCount == 1 && more == false) || transparent_color < 0) {
 		img = image_gif_static(gif, page, diag);
 	} else {
 		img = image_gif_multi(gif, page, diag);
@@ -126,6 +134,135 @@ image_gif_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	return img;
 }
 
+// DGifSlurp() の代わり。
+// DGifSlurp() は全フレームを展開してから返ってくるので、フレーム数や
+// メモリの資源制限を調べる前に確保しきってしまう。そこでページ page
+// までだけを、1フレームずつ確保する前に資源制限を調べながら展開する。
+// page より後ろにもフレームがあれば *morep を true にする (後ろの
+// フレームは読まない)。
+// 成功すれば true を返す。
+// 資源制限を超えれば errno を EFBIG にして false を返す。
+// それ以外で失敗すれば gif->Error をセットして false を返す。
+static bool
+gif_slurp(GifFileType *gif, int page, bool *morep, const struct diag *diag)
+{
+	// インタレースの各パスの開始行と間隔。
+	static const int ilace_offset[] = { 0, 4, 2, 1 };
+	static const int ilace_jump[]   = { 8, 8, 4, 2 };
+	GifRecordType type;
+	GifByteType *ext;
+	int extcode;
+	uint width  = gif->SWidth;
+	uint height = gif->SHeight;
+
+	// 展開先 (ARGB32) の分。
+	uint64 memsize = (uint64)width * height * 4;
+
+	*morep = false;
+	do {
+		if (DGifGetRecordType(gif, &type) == GIF_ERROR) {
+			return false;
+		}
+
+		switch (type) {
+		 case IMAGE_DESC_RECORD_TYPE:
+		 {
+			if (gif->ImageCount > page) {
+				// 必要なページまでは展開したので、ここで終わり。
+				*morep = true;
+				return true;
+			}
+			if (DGifGetImageDesc(gif) == GIF_ERROR) {
+				return false;
+			}
+			SavedImage *sp = &gif->SavedImages[gif->ImageCount - 1];
+			int fw = sp->ImageDesc.Width;
+			int fh = sp->ImageDesc.Height;
+			if (fw <= 0 || fh <= 0) {
+				gif->Error = D_GIF_ERR_DATA_TOO_BIG;
+				return false;
+			}
+
+			// このフレームを確保する前に、ここまでのフレーム数と
+			// メモリで調べる。
+			memsize += (uint64)fw * fh;
+			if (image_limit_check(width, height, gif->ImageCount, memsize,
+				diag) == false)
+			{
+				return false;
+			}
+
+			sp->RasterBits = malloc((size_t)fw * fh);
+			if (sp->RasterBits == NULL) {
+				gif->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+				return false;
+			}
+			if (sp->ImageDesc.Interlace) {
+				for (uint i = 0; i < countof(ilace_offset); i++) {
+					for (int y = ilace_offset[i]; y < fh; y += ilace_jump[i]) {
+						if (DGifGetLine(gif, sp->RasterBits + y * fw, fw)
+							== GIF_ERROR)
+						{
+							return false;
+						}
+					}
+				}
+			} else {
+				if (DGifGetLine(gif, sp->RasterBits, fw * fh) == GIF_ERROR) {
+					return false;
+				}
+			}
+
+			// ここまでに読んだ拡張ブロックはこのフレームのもの。
+			sp->ExtensionBlocks = gif->ExtensionBlocks;
+			sp->ExtensionBlockCount = gif->ExtensionBlockCount;
+			gif->ExtensionBlocks = NULL;
+			gif->ExtensionBlockCount = 0;
+			break;
+		 }
+
+		 case EXTENSION_RECORD_TYPE:
+			if (DGifGetExtension(gif, &extcode, &ext) == GIF_ERROR) {
+				return false;
+			}
+			if (ext != NULL) {
+				if (GifAddExtensionBlock(&gif->ExtensionBlockCount,
+					&gif->ExtensionBlocks, extcode, ext[0], &ext[1])
+					== GIF_ERROR)
+				{
+					gif->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+					return false;
+				}
+			}
+			for (;;) {
+				if (DGifGetExtensionNext(gif, &ext) == GIF_ERROR) {
+					return false;
+				}
+				if (ext == NULL) {
+					break;
+				}
+				if (GifAddExtensionBlock(&gif->ExtensionBlockCount,
+					&gif->ExtensionBlocks, CONTINUE_EXT_FUNC_CODE,
+					ext[0], &ext[1]) == GIF_ERROR)
+				{
+					gif->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+					return false;
+				}
+			}
+			break;
+
+		 default:
+			break;
+		}
+	} while (type != TERMINATE_RECORD_TYPE);
+
+	if (gif->ImageCount == 0) {
+		gif->Error = D_GIF_ERR_NO_IMAG_DSCR;
+		return false;
+	}
+	return true;
+}
+
 // GIF 画像が1ページだけの構成か、
 // 複数ページ構成であっても指定のページに透過色がない場合。
 static struct image *
@@ -298,6 +298,11 @@ ico_read_bmp(FILE *fp, const struct icodir *dir, const struct diag *diag)
 		}
 	}
 
+	if (image_limit_check(bmp->width, bmp->height, 1,
+		(uint64)bmp->width * bmp->height * 2, diag) == false)
+	{
+		return NULL;
+	}
 	bmp->img = image_create(bmp->width, bmp->height, IMAGE_FMT_ARGB16);
 	if (bmp->img == NULL) {
 		return NULL;
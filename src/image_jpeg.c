@@ -40,14 +40,14 @@
 struct my_jpeg_error_mgr {
 	struct jpeg_error_mgr mgr;
 	jmp_buf jmp;
+	// エラーメッセージ。スレッドごとに持つ。
+	char msgbuf[JMSG_LENGTH_MAX];
 };
 
 static void print_marker(jpeg_saved_marker_ptr, const char *,
 	const struct diag *);
 static void my_error_exit(j_common_ptr);
-static const char *colorspace2str(J_COLOR_SPACE);
-
-static char my_msgbuf[JMSG_LENGTH_MAX];
+static const char *colorspace2str(char *, size_t, J_COLOR_SPACE);
 
 bool
 image_jpeg_match(FILE *fp, const struct diag *diag)
@@ -80,6 +80,7 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	uint stride;
 	uint color_space;
 	int scale;
+	char csbuf[16];
 
 	memset(UNVOLATILE(&jinfo), 0, sizeof(jinfo));
 	memset(&jerr, 0, sizeof(jerr));
@@ -90,7 +91,7 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 
 	// libjpeg 内でエラーが起きたら大域ジャンプで戻ってくる…。
 	if (setjmp(jerr.jmp)) {
-		warnx("libjpeg: %s", my_msgbuf);
+		warnx("libjpeg: %s", jerr.msgbuf);
 		free(UNVOLATILE(img));
 		img = NULL;
 		goto done;
@@ -112,7 +113,8 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	height = jinfo.image_height;
 	color_space =jinfo.jpeg_color_space;
 	Debug(diag, "%s: color_space=%s num_components=%u", __func__,
-		colorspace2str(color_space), jinfo.num_components);
+		colorspace2str(csbuf, sizeof(csbuf), color_space),
+		jinfo.num_components);
 
 	if (__predict_false(diag_get_level(diag) >= 1)) {
 		// 一部のマーカーを表示。
@@ -155,6 +157,16 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			}
 		}
 
+	}
+
+	// 資源制限に収まらなければさらに縮小する。
+	// 有効なスケールは 1/8 までなので、それでも収まらなければ諦める。
+	int limit_scale = image_limit_shift(width, height, 3, MAX(scale, 0), 3);
+	if (limit_scale > 0) {
+		scale = limit_scale;
+	}
+
+	if (scale >= 0) {
 		// スケールを指定。
 		jinfo.scale_num = 1;
 		jinfo.scale_denom = 1U << scale;
@@ -163,7 +175,7 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	jpeg_start_decompress(UNVOLATILE(&jinfo));
 	if (jinfo.out_color_space != color_space) {
 		Debug(diag, "%s: filtered color_space=%s", __func__,
-			colorspace2str(jinfo.out_color_space));
+			colorspace2str(csbuf, sizeof(csbuf), jinfo.out_color_space));
 	}
 	if (scale >= 0) {
 		Debug(diag, "%s: OrigSize=(%u, %u) scale=1/%u", __func__,
@@ -174,11 +186,20 @@ image_jpeg_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 	width  = jinfo.output_width;
 	height = jinfo.output_height;
 
+	if (image_limit_check(width, height, 1, (uint64)width * height * 3, diag)
+		== false)
+	{
+		goto done;
+	}
+
 	img = image_create(width, height, IMAGE_FMT_RGB24);
 	if (img == NULL) {
 		warn("%s: image_create failed", __func__);
 		goto done;
 	}
+	// 縮小してデコードしたなら元の大きさを覚えておく。
+	img->orig_width  = jinfo.image_width;
+	img->orig_height = jinfo.image_height;
 	stride = image_get_stride(UNVOLATILE(img));
 
 	// データの読み込み。
@@ -263,13 +284,14 @@ static void
 my_error_exit(j_common_ptr jinfo)
 {
 	struct my_jpeg_error_mgr *err = (struct my_jpeg_error_mgr *)jinfo->err;
-	(*jinfo->err->format_message)(jinfo, my_msgbuf);
+	(*jinfo->err->format_message)(jinfo, err->msgbuf);
 	longjmp(err->jmp, 1);
 }
 
 // JPEG の color_space のデバッグ表示用。
+// 名前のない値は呼び出し側の buf に書き込んでそれを返す。
 static const char *
-colorspace2str(J_COLOR_SPACE c)
+colorspace2str(char *buf, size_t bufsize, J_COLOR_SPACE c)
 {
 	static const char * const names[] = {
 		"Unknown",
@@ -283,8 +305,7 @@ colorspace2str(J_COLOR_SPACE c)
 	};
 
 	if (c >= countof(names)) {
-		static char buf[16];
-		snprintf(buf, sizeof(buf), "%d(?)", c);
+		snprintf(buf, bufsize, "%d(?)", c);
 		return buf;
 	}
 	return names[c];
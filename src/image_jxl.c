@@ -131,6 +131,15 @@ image_jxl_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			Debug(diag, "%s: have_preview=%u have_animation=%u", __func__,
 				info.have_preview,
 				info.have_animation);
+
+			// image と、デコーダ内部の作業バッファ (float x 3ch くらい)。
+			uint channels = (info.alpha_bits ? 4 : 3);
+			if (image_limit_check(info.xsize, info.ysize, 1,
+				(uint64)info.xsize * info.ysize * (channels + 12), diag)
+				== false)
+			{
+				break;
+			}
 			continue;
 		}
 
@@ -219,6 +219,13 @@ image_mag_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			start_x, start_y, end_x, end_y);
 	}
 
+	// 中間 VRAM (1ピクセル 1バイト以下) と ARGB16 の image。
+	if (image_limit_check(width, height, 1, (uint64)width * height * 3, diag)
+		== false)
+	{
+		return NULL;
+	}
+
 	// 続いてパレットブロック。
 	if (mag_read_palette(ctx) == false) {
 		warn("%s: fread(palette) failed", __func__);
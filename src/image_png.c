@@ -32,7 +32,7 @@
 #include "image_priv.h"
 #include <png.h>
 
-static const char *colortype2str(int type);
+static const char *colortype2str(char *, size_t, int);
 
 bool
 image_png_match(FILE *fp, const struct diag *diag)
@@ -67,6 +67,7 @@ image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 	int filter_type;
 	int channels;
 	uint stride;
+	char ctbuf[16];
 	volatile uint8 **lines;
 	volatile struct image *img;
 
@@ -101,7 +102,7 @@ image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 		"%s: IHDR width=%d height=%d interlace=%d compress=%d filter=%d",
 		__func__, width, height, interlace_type, compression_type, filter_type);
 	Debug(diag, "%s: IHDR colortype=%s bitdepth=%d%s",
-		__func__, colortype2str(color_type), bitdepth,
+		__func__, colortype2str(ctbuf, sizeof(ctbuf), color_type), bitdepth,
 		png_get_valid(png, info, PNG_INFO_tRNS) ? " tRNS" : "");
 
 	// color_type によっていろいろ設定が必要。
@@ -136,7 +137,14 @@ image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 	channels = png_get_channels(png, info);
 
 	Debug(diag, "%s: Filt colortype=%s bitdepth=%d",
-		__func__, colortype2str(color_type), bitdepth);
+		__func__, colortype2str(ctbuf, sizeof(ctbuf), color_type), bitdepth);
+
+	if (image_limit_check(width, height, 1,
+		(uint64)width * height * channels + sizeof(char *) * height, diag)
+		== false)
+	{
+		goto done;
+	}
 
 	// スキャンラインメモリのポインタ配列。
 	lines = malloc(sizeof(char *) * height);
@@ -169,11 +177,10 @@ image_png_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 }
 
 // PNG の color type のデバッグ表示用。
+// 知らない値なら buf (bufsize バイト) に書き込んでそれを返す。
 static const char *
-colortype2str(int type)
+colortype2str(char *buf, size_t bufsize, int type)
 {
-	static char buf[16];
-
 	switch (type) {
 	 case PNG_COLOR_TYPE_GRAY:
 		return "Gray";
@@ -186,7 +193,7 @@ colortype2str(int type)
 	 case PNG_COLOR_TYPE_GRAY_ALPHA:
 		return "GrayA";
 	 default:
-		snprintf(buf, sizeof(buf), "%d(?)", type);
+		snprintf(buf, bufsize, "%d(?)", type);
 		return buf;
 	}
 }
@@ -554,6 +554,13 @@ parse_pnm_header(struct pnmctx *pnm, const struct diag *diag)
 	pnm->height = (uint)height;
 	pnm->maxval = (uint)maxval;
 
+	// どの形式も ARGB16 で展開する。
+	if (image_limit_check(pnm->width, pnm->height, 1,
+		(uint64)pnm->width * pnm->height * 2, diag) == false)
+	{
+		return -1;
+	}
+
 	return pnmtype;
 }
 
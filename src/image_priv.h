@@ -73,7 +73,8 @@
 #endif
 
 // image.c
-extern struct image *image_create(uint, uint, uint);
+extern bool image_limit_check(uint, uint, uint, uint64, const struct diag *);
+extern uint image_limit_shift(uint, uint, uint, uint, uint);
 
 // image_*.c
 typedef bool (*image_match_t)(FILE *, const struct diag *);
@@ -103,6 +103,12 @@ image_stb_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 	if (nch != 3 && nch != 4) {
 		nch = 3;
 	}
+	// stb_image の展開先と image とで2倍必要。
+	if (image_limit_check(width, height, 1, (uint64)width * height * nch * 2,
+		diag) == false)
+	{
+		return NULL;
+	}
 	data = stbi_load_from_file(fp, &width, &height, &nch, nch);
 	if (data == NULL) {
 		return NULL;
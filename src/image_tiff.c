@@ -41,7 +41,7 @@ static toff_t   tiff_seek(thandle_t, toff_t, int);
 static int      tiff_close(thandle_t);
 static toff_t   tiff_size(thandle_t);
 static void     tiff_null_error_handler(const char *, const char *, va_list);
-static const char *photometric2str(uint16_t);
+static const char *photometric2str(char *, size_t, uint16_t);
 
 bool
 image_tiff_match(FILE *fp, const struct diag *diag)
@@ -81,6 +81,7 @@ image_tiff_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 	uint16_t bits_per_sample;
 	uint16_t samples_per_pixel;
 	uint16_t photo_metric;
+	char pmbuf[16];
 
 	tiff = TIFFClientOpen("<input>", "r", fp,
 		tiff_read,
@@ -100,7 +101,7 @@ image_tiff_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 	TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel);
 	TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photo_metric);
 	Debug(diag, "%s: PhotoMetric=%s BitsPerSample=%u SamplesPerPixel=%u",
-		__func__, photometric2str(photo_metric),
+		__func__, photometric2str(pmbuf, sizeof(pmbuf), photo_metric),
 		bits_per_sample, samples_per_pixel);
 
 	// 雑。
@@ -111,6 +112,13 @@ image_tiff_read(FILE *fp, const image_read_hint *dummy, const struct diag *diag)
 		fmt = IMAGE_FMT_RGB24;
 	}
 
+	img = NULL;
+	if (image_limit_check(width, height, 1,
+		(uint64)width * height * (fmt == IMAGE_FMT_ARGB32 ? 4 : 3), diag)
+		== false)
+	{
+		goto done;
+	}
 	img = image_create(width, height, fmt);
 	if (img == NULL) {
 		goto done;
@@ -179,8 +187,9 @@ tiff_null_error_handler(const char *module, const char * fmt, va_list ap)
 }
 
 // TIFF の PhotoMetric のデバッグ表示用。
+// 範囲外の値は数値を buf に書いて返す。
 static const char *
-photometric2str(uint16_t val)
+photometric2str(char *buf, size_t bufsize, uint16_t val)
 {
 	static const char * const names[] = {
 		"WhiteIsZero",
@@ -193,8 +202,7 @@ photometric2str(uint16_t val)
 	if (val < countof(names)) {
 		return names[val];
 	} else {
-		static char buf[16];
-		snprintf(buf, sizeof(buf), "0x%x(?)", val);
+		snprintf(buf, bufsize, "0x%x(?)", val);
 		return buf;
 	}
 }
@@ -165,8 +165,6 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		uint8 *outbuf;
 		int timestamp;
 
-		img = image_create(width, height, IMAGE_FMT_ARGB32);
-
 		// ファイル全体を読み込む。
 		if (read_all(&filebuf, &filelen, fp, filesize, diag) == false) {
 			warnx("%s: read_all failed", __func__);
@@ -191,6 +189,18 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			errx(1, "%s: No page found: %u", __func__, hint->page);
 		}
 
+		// image と、デコーダ内部のキャンバス 2枚分と、ファイル全体。
+		if (image_limit_check(width, height, total_pages,
+			(uint64)width * height * 4 * 3 + filesize, diag) == false)
+		{
+			goto abort_anime;
+		}
+		img = image_create(width, height, IMAGE_FMT_ARGB32);
+		if (img == NULL) {
+			warn("%s: image_create failed", __func__);
+			goto abort_anime;
+		}
+
 		dec = WebPAnimDecoderNew(&data, &opt);
 		if (dec == NULL) {
 			warnx("%s: WebpAnimDecoderNew() failed", __func__);
@@ -224,7 +234,17 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		// アルファチャンネルがあるとインクリメンタル処理できないっぽい?
 		Debug(diag, "%s: use RGBA decoder", __func__);
 
+		// image と RGBA 出力バッファと、ファイル全体。
+		if (image_limit_check(width, height, 1,
+			(uint64)width * height * 4 * 2 + filesize, diag) == false)
+		{
+			goto abort;
+		}
 		img = image_create(width, height, IMAGE_FMT_ARGB32);
+		if (img == NULL) {
+			warn("%s: image_create failed", __func__);
+			goto abort;
+		}
 
 		// ファイル全体を読み込む。
 		if (read_all(&filebuf, &filelen, fp, filesize, diag) == false) {
@@ -255,7 +275,17 @@ image_webp_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 		// インクリメンタル処理が出来る。
 		Debug(diag, "%s: use incremental RGB decoder", __func__);
 
+		// image とデコーダ内部の RGB バッファ。
+		if (image_limit_check(width, height, 1,
+			(uint64)width * height * 3 * 2, diag) == false)
+		{
+			goto abort;
+		}
 		img = image_create(width, height, IMAGE_FMT_RGB24);
+		if (img == NULL) {
+			warn("%s: image_create failed", __func__);
+			goto abort;
+		}
 
 		WebPIDecoder *idec = WebPINewDecoder(NULL);
 		if (idec == NULL) {
@@ -157,6 +157,12 @@ image_ypic_read(FILE *fp, const image_read_hint *hint, const struct diag *diag)
 			t, ctx->width, ctx->height, ncolors);
 	}
 
+	if (image_limit_check(ctx->width, ctx->height, 1,
+		(uint64)ctx->width * ctx->height * 2, diag) == false)
+	{
+		return NULL;
+	}
+
 	// 256色以下ならパレット。
 	if (ctx->colorbits <= 8) {
 		uint16 palbuf[ncolors];
@@ -35,8 +35,7 @@
 #include <errno.h>
 #include <string.h>
 
-#define TOKEN_SIZE_INIT	(500)	// 初期トークン数
-#define TOKEN_SIZE_INC	(100)	// 1回の増分
+#define TOKEN_SIZE_INIT	(500)	// 初期トークン数 (足りなければ倍々で増やす)
 
 struct json
 {
@@ -143,7 +142,7 @@ json_parse(struct json *js, string *str)
 
 		// 足りなければトークンを増やす。
 		// jsmn_parse() は jsmn_init() しなければ前回の続きから処理する。
-		uint newcap = js->tokencap + TOKEN_SIZE_INC;
+		uint newcap = js->tokencap * 2;
 		void *newbuf = realloc(js->token, newcap * sizeof(jsmntok_t));
 		if (newbuf == NULL) {
 			Debug(js->diag, "%s: realloc(%zu): %s", __func__,
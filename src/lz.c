@@ -0,0 +1,215 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 簡易 LZ 圧縮
+//
+
+// o SIXEL キャッシュの圧縮用。展開が遅マシンでも速いことを優先して、
+//   LZ4 のブロック形式と同じ考え方の簡単な形式にする (互換性はない)。
+// o シーケンスは、トークン (上位 4bit がリテラル長、下位 4bit が
+//   一致長 - 4、どちらも 15 なら後ろに 255 が続く限り加算するバイトが
+//   続く)、リテラル、一致位置までの距離 (2バイト LE) の順。
+// o 最後のシーケンスはリテラルのみで、入力の終わりで終わる。
+// o 1回に扱うのは 64KB 未満まで。大きなデータは呼び出し側で
+//   ブロックに分けること。
+
+#include "common.h"
+#include <string.h>
+
+#define LZ_HASH_BITS	(12)
+#define LZ_MINMATCH		(4)
+
+static bool lz_put_len(uint8 *, uint, uint *, uint);
+
+// src (長さ srclen、65535 バイトまで) を圧縮して dst (大きさ dstsize) に
+// 書き出す。
+// 圧縮後の長さを返す。dstsize に収まらなければ 0 を返す。
+uint
+lz_compress(const uint8 *src, uint srclen, uint8 *dst, uint dstsize)
+{
+	uint16 table[1U << LZ_HASH_BITS];	// 位置 + 1 (0 なら空き)
+	uint ip = 0;
+	uint op = 0;
+	uint anchor = 0;
+	uint litlen;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MINMATCH <= srclen) {
+		uint32 v;
+		uint32 r;
+		memcpy(&v, src + ip, sizeof(v));
+		uint h = (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+		uint ref = table[h];
+		table[h] = ip + 1;
+		if (ref == 0) {
+			ip++;
+			continue;
+		}
+		ref--;
+		memcpy(&r, src + ref, sizeof(r));
+		if (r != v) {
+			ip++;
+			continue;
+		}
+
+		uint mlen = LZ_MINMATCH;
+		while (ip + mlen < srclen && src[ref + mlen] == src[ip + mlen]) {
+			mlen++;
+		}
+
+		// シーケンスを出力。
+		litlen = ip - anchor;
+		if (op >= dstsize) {
+			return 0;
+		}
+		dst[op++] = (MIN(litlen, 15) << 4) | MIN(mlen - LZ_MINMATCH, 15);
+		if (litlen >= 15 && lz_put_len(dst, dstsize, &op, litlen - 15) == false)
+		{
+			return 0;
+		}
+		if (litlen + 2 > dstsize - op) {
+			return 0;
+		}
+		memcpy(dst + op, src + anchor, litlen);
+		op += litlen;
+		uint off = ip - ref;
+		dst[op++] = off & 0xff;
+		dst[op++] = off >> 8;
+		if (mlen - LZ_MINMATCH >= 15 &&
+			lz_put_len(dst, dstsize, &op, mlen - LZ_MINMATCH - 15) == false)
+		{
+			return 0;
+		}
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	// 残りはリテラルのみ。
+	litlen = srclen - anchor;
+	if (op >= dstsize) {
+		return 0;
+	}
+	dst[op++] = MIN(litlen, 15) << 4;
+	if (litlen >= 15 && lz_put_len(dst, dstsize, &op, litlen - 15) == false) {
+		return 0;
+	}
+	if (litlen > dstsize - op) {
+		return 0;
+	}
+	memcpy(dst + op, src + anchor, litlen);
+	op += litlen;
+
+	return op;
+}
+
+// 長さの延長部分 len を dst[*op] 以降に書き出す。
+// dstsize に収まらなければ false を返す。
+static bool
+lz_put_len(uint8 *dst, uint dstsize, uint *op, uint len)
+{
+	for (;;) {
+		if (*op >= dstsize) {
+			return false;
+		}
+		if (len < 255) {
+			dst[(*op)++] = len;
+			return true;
+		}
+		dst[(*op)++] = 255;
+		len -= 255;
+	}
+}
+
+// lz_compress() で圧縮した src (長さ srclen) を dst (大きさ dstsize) に
+// 展開する。
+// 展開後の長さを返す。データが壊れているか dstsize に収まらなければ
+// -1 を返す。
+int
+lz_decompress(const uint8 *src, uint srclen, uint8 *dst, uint dstsize)
+{
+	uint ip = 0;
+	uint op = 0;
+
+	while (ip < srclen) {
+		uint token = src[ip++];
+		uint8 b;
+
+		// リテラル。
+		uint len = token >> 4;
+		if (len == 15) {
+			do {
+				if (ip >= srclen) {
+					return -1;
+				}
+				b = src[ip++];
+				len += b;
+			} while (b == 255);
+		}
+		if (len > srclen - ip || len > dstsize - op) {
+			return -1;
+		}
+		memcpy(dst + op, src + ip, len);
+		ip += len;
+		op += len;
+		if (ip == srclen) {
+			break;
+		}
+
+		// 一致。
+		if (srclen - ip < 2) {
+			return -1;
+		}
+		uint off = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		len = (token & 15) + LZ_MINMATCH;
+		if ((token & 15) == 15) {
+			do {
+				if (ip >= srclen) {
+					return -1;
+				}
+				b = src[ip++];
+				len += b;
+			} while (b == 255);
+		}
+		if (off == 0 || off > op || len > dstsize - op) {
+			return -1;
+		}
+		if (off >= len) {
+			memcpy(dst + op, dst + op - off, len);
+		} else {
+			// 重なっている場合は先頭から 1バイトずつ。
+			for (uint i = 0; i < len; i++) {
+				dst[op + i] = dst[op - off + i];
+			}
+		}
+		op += len;
+	}
+
+	return op;
+}
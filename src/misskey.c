@@ -29,14 +29,58 @@
 //
 
 #include "sayaka.h"
+#include "image.h"
 #include "ngword.h"
 #include <err.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+// 受信キューに溜められるメッセージ数の上限。
+// これを超えると古いものから捨てる。
+#if defined(SLOW_ARCH)
+#define RECV_QUEUE_MAX	(100)
+#else
+#define RECV_QUEUE_MAX	(1000)
+#endif
+
+// 表示が遅れた時の追いつきモード。
+// 受信キューの滞留数か、表示しようとしているメッセージの待ち時間 [msec]
+// のどちらかがしきい値を超えたら、画像を簡略化して表示する。
+// 元に戻すのは滞留数が CATCHUP_RESUME_DEPTH 以下に追いついてから。
+#if defined(SLOW_ARCH)
+#define CATCHUP_BLURHASH_DEPTH	(10)
+#define CATCHUP_TEXT_DEPTH		(50)
+#else
+#define CATCHUP_BLURHASH_DEPTH	(20)
+#define CATCHUP_TEXT_DEPTH		(100)
+#endif
+#define CATCHUP_BLURHASH_AGE	(30 * 1000)
+#define CATCHUP_TEXT_AGE		(120 * 1000)
+#define CATCHUP_RESUME_DEPTH	(1)
+
+// 画像の表示方法。
+enum {
+	RENDER_FULL,		// 通常どおり
+	RENDER_BLURHASH,	// 画像をダウンロードせず Blurhash で表示する
+	RENDER_TEXT,		// 画像を表示せずファイルタイプのみ表示する
+	RENDER_MAX,
+};
+
+// 受信キューの先頭から何ノート先まで画像を先読みするか。
+#define PREFETCH_NOTES	(4)
+
+// 遅延表示の画像が残っている間、次のメッセージを待つ間隔 [msec]。
+#define DEFER_POLL_MSEC	(100)
+
+// キャッシュ作成モードの経過表示の間隔 [msec]。
+#define WARM_REPORT_MSEC	(1000)
+
 // ユーザ名。毎回このセットが必要なので。
 typedef struct misskey_user_ {
 	ustring *name;		// "name"、名前を表示用に加工したもの (NULL でない)
@@ -44,18 +88,41 @@ typedef struct misskey_user_ {
 	string *instance;	// "instance/name"、インスタンス名 (なければ NULL)
 } misskey_user;
 
+// 添付画像の表示パラメータ。
+struct photo {
+	char img_file[PATH_MAX];	// キャッシュファイル名
+	char urlbuf[256];			// Blurhash の場合の URL の置き場
+	const char *img_url;
+	uint width;
+	uint height;
+	bool shade;
+	const char *filetype_msg;	// 画像を表示しない場合のメッセージ
+};
+
 struct context;
 
 static bool misskey_init(void);
 static bool misskey_stream(struct wsclient *, bool);
+static void *misskey_recv_thread(void *);
 static void misskey_recv_cb(const string *);
 static void misskey_message(string *);
+static void misskey_update_render_mode(uint, uint32);
+static void misskey_prefetch_queue(void);
+static void misskey_prefetch(const struct json *);
+static void misskey_prefetch_note(const struct json *, int);
+static void misskey_warm_report(uint64, uint, const struct timespec *,
+	bool);
 static int  misskey_show_note(const struct json *, int);
 static int  misskey_show_announcement(const struct json *, int);
 static int  misskey_show_notification(const struct json *, int);
 static void misskey_show_icon(const struct json *, int, const string *);
 static bool misskey_show_photo(const struct json *, int, int);
+static bool misskey_get_photo(const struct json *, int, struct photo *);
+static bool misskey_check_budget(const struct json *, int, const char *);
+static void misskey_get_blurhash(const struct json *, int, const char *,
+	struct photo *);
 static void misskey_print_filetype(const struct json *, int, const char *);
+static void make_icon_filename(char *, uint, const string *, const char *);
 static void make_cache_filename(char *, uint, const char *);
 static ustring *misskey_display_text(const struct json *, int, const char *);
 static ustring *misskey_display_name(const struct json *, int, const char *);
@@ -74,12 +141,40 @@ static string *misskey_format_renote_count(const struct json *, int);
 static string *misskey_format_reaction_count(const struct json *, int);
 static ustring *misskey_format_renote_owner(const struct json *, int);
 static misskey_user *misskey_get_user(const struct json *, int);
+static string *misskey_get_userid(const struct json *, int);
 static void misskey_free_user(misskey_user *);
 static int misskey_ngword_match_text(const string *, const misskey_user *);
 static int misskey_show_ng(int, const struct json *, int, const misskey_user *);
 
 static struct json *global_js;
 
+// 先読み用。global_js とは別に必要。
+static struct json *prefetch_js;
+
+// 先読みを済ませた受信キューのメッセージの通し番号。
+static uint64 prefetch_seq;
+
+// 現在の画像の表示方法。
+static uint render_mode;
+
+// 画像を遅延表示するか。ストリーム接続中のみ有効。
+static bool defer_image;
+
+// 表示方法ごとに表示したメッセージ数。
+static uint64 render_count[RENDER_MAX];
+
+static const char * const render_mode_names[RENDER_MAX] = {
+	"full",
+	"blurhash",
+	"text",
+};
+
+// 受信スレッドから表示側へのキュー。ストリーム接続中のみ有効。
+static struct msgqueue *recv_queue;
+
+// 受信スレッドの終了理由。wsclient_process() の戻り値 (0 なら EOF)。
+static int recv_result;
+
 // サーバ接続とローカル再生との共通の初期化。
 static bool
 misskey_init(void)
@@ -89,6 +184,21 @@ misskey_init(void)
 		return false;
 	}
 
+	// 画像取得の接続を使い回す。
+	if (opt_show_image && opt_keepalive_image > 0) {
+		httpclient_pool_init(opt_keepalive_image * 1000);
+	}
+
+	// 画像の通信量の予算。
+	budget_init(netopt_image.max_length, opt_max_image_rate);
+
+	// 画像の先読み。
+	if (opt_show_image && opt_image_workers > 0) {
+		if (fetchpool_init()) {
+			prefetch_js = json_create(diag_json);
+		}
+	}
+
 	return true;
 }
 
@@ -96,6 +206,9 @@ static void
 misskey_cleanup(void)
 {
 	json_destroy(global_js);
+	json_destroy(prefetch_js);
+	prefetch_js = NULL;
+	httpclient_pool_cleanup();
 }
 
 void
@@ -127,6 +240,111 @@ cmd_misskey_play(const char *infile)
 	misskey_cleanup();
 }
 
+// 録画ファイル infile のノートで使う画像をすべてキャッシュに作成する。
+// 表示はしない。取得は先読みワーカーで並列に行い、同時に依頼するのは
+// ワーカー数の 2倍まで (fetchpool_drain() の上限も超えないこと)。
+void
+cmd_misskey_warm(const char *infile)
+{
+	struct timespec start;
+	struct timespec now;
+	uint64 last_msec;
+	uint64 nnotes;
+	uint pending;
+	uint limit;
+	string *s;
+	FILE *fp;
+
+	misskey_init();
+	if (fetchpool_enabled() == false) {
+		errx(1, "--warm-cache needs --image-workers");
+	}
+	// fetchpool_drain() はこれより多くは待たずに時間切れで戻ってくるので、
+	// それ以上を指定すると依頼が溜まり続けて断られるようになる。
+	limit = MIN(opt_image_workers * 2, FETCHPOOL_MAX_JOBS / 2);
+
+	if (infile == NULL) {
+		fp = stdin;
+	} else {
+		fp = fopen(infile, "r");
+		if (fp == NULL) {
+			err(1, "%s", infile);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_msec = timespec_to_msec(&start);
+	nnotes = 0;
+	for (;;) {
+		// 依頼が溜まっていれば減るまで待つ。
+		while ((pending = fetchpool_drain(limit, WARM_REPORT_MSEC)) > limit) {
+			misskey_warm_report(nnotes, pending, &start, false);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_to_msec(&now) - last_msec >= WARM_REPORT_MSEC) {
+			misskey_warm_report(nnotes, pending, &start, false);
+			last_msec = timespec_to_msec(&now);
+		}
+
+		s = string_fgets(fp);
+		if (s == NULL) {
+			break;
+		}
+		if (json_parse(global_js, s) >= 0) {
+			misskey_prefetch(global_js);
+		}
+		nnotes++;
+		string_free(s);
+	}
+
+	// 残りの完了を待つ。
+	while ((pending = fetchpool_drain(0, WARM_REPORT_MSEC)) > 0) {
+		misskey_warm_report(nnotes, pending, &start, false);
+	}
+	misskey_warm_report(nnotes, 0, &start, true);
+
+	if (infile != NULL) {
+		fclose(fp);
+	}
+
+	misskey_cleanup();
+}
+
+// キャッシュ作成モードの経過を標準エラー出力に表示する。
+// nnotes は読んだノート数、pending は処理待ちと処理中の画像数。
+// 途中経過は端末の時だけ同じ行に上書きする。last なら最後の集計を表示する。
+static void
+misskey_warm_report(uint64 nnotes, uint pending, const struct timespec *start,
+	bool last)
+{
+	struct fetchpool_stat pst;
+	struct budget_stat bst;
+	struct timespec now;
+	bool is_tty = (isatty(STDERR_FILENO) != 0);
+
+	if (last == false && is_tty == false) {
+		return;
+	}
+
+	fetchpool_get_stat(&pst);
+	budget_get_stat(&bst);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64 msec = timespec_to_msec(&now) - timespec_to_msec(start);
+	float sec = (float)MAX(msec, 1) / 1000;
+	uint64 done = pst.requested - pst.failed - pending;
+	// 一杯で断られたものも作れなかったので失敗に数える。
+	uint64 failed = pst.failed + pst.rejected;
+
+	fprintf(stderr, "%s%" PRIu64 " notes, %" PRIu64 " images"
+		" (%" PRIu64 " failed, %u pending), %" PRIu64 " KB in %.1f sec"
+		" (%.1f images/sec, %.1f KB/sec)%s",
+		(is_tty ? "\r" : ""),
+		nnotes, done, failed, pending, bst.bytes / 1024, sec,
+		(float)done / sec, (float)bst.bytes / 1024 / sec,
+		(last ? "\n" : ""));
+	fflush(stderr);
+}
+
 // token はトークン文字列を指定。トークンなしなら NULL を指定する。
 void
 cmd_misskey_stream(const char *server, bool home, const char *token)
@@ -176,6 +394,7 @@ cmd_misskey_stream(const char *server, bool home, const char *token)
 		}
 
 		wsclient_init(ws, misskey_recv_cb);
+		wsclient_set_pong_timeout(ws, opt_pong_timeout * 1000);
 
 		// 応答コード 101 が成功。
 		int code = wsclient_connect(ws, string_get(url), &netopt_main);
@@ -206,6 +425,11 @@ cmd_misskey_stream(const char *server, bool home, const char *token)
 		}
 		retry_count = 0;
 
+		// 画像キャッシュの掃除はつながってから裏で行う。
+		if (opt_show_image) {
+			cache_janitor_start();
+		}
+
 		// メイン処理。
 		if (misskey_stream(ws, home) == true) {
 			status = CLOSED;
@@ -261,24 +485,233 @@ misskey_stream(struct wsclient *ws, bool home)
 		}
 	}
 
-	// あとは受信。メッセージが出来ると misskey_recv_cb() が呼ばれる。
+	// 受信 (フレームの受信、PING/PONG、テキストの組み立て) は別スレッドで
+	// 行い、メッセージが出来ると misskey_recv_cb() がキューに積む。
+	// こちらはキューから取り出して表示するだけ。表示がどれだけ遅くても
+	// 受信側は止まらないので、キープアライブが遅れて切断されることはない。
+	recv_queue = msgqueue_create(RECV_QUEUE_MAX);
+	if (recv_queue == NULL) {
+		warn("%s: msgqueue_create failed", __func__);
+		return false;
+	}
+
+	// シグナルはすべてこちら (表示側) のスレッドで受けたいので、
+	// 受信スレッドにはブロックしたシグナルマスクを継承させる。
+	sigset_t newmask;
+	sigset_t oldmask;
+	sigfillset(&newmask);
+	pthread_sigmask(SIG_SETMASK, &newmask, &oldmask);
+	pthread_t recv_thread;
+	int r = pthread_create(&recv_thread, NULL, misskey_recv_thread, ws);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if (r != 0) {
+		errno = r;
+		warn("%s: pthread_create failed", __func__);
+		msgqueue_destroy(recv_queue);
+		recv_queue = NULL;
+		return false;
+	}
+
+	// 受信側が閉じるまで表示する。
+	// 表示する前に後続のノートの画像の先読みを依頼しておく。
+	// 表示が遅れていれば画像を簡略化して追いつく。
+	// 遅延表示の画像があれば、次のメッセージを待つ間にも描画する。
+	string *msg;
+	uint32 age;
+	prefetch_seq = 0;
+	defer_image = image_slot_available();
 	for (;;) {
-		int r = wsclient_process(ws);
-		if (__predict_false(r <= 0)) {
-			if (r < 0) {
-				warn("%s: wsclient_process failed", __func__);
-				break;
-			} else {
-				// EOF
-				return true;
-			}
+		while (image_slot_pending() &&
+		       msgqueue_wait(recv_queue, DEFER_POLL_MSEC) == false) {
+			image_slot_paint();
+		}
+		msg = msgqueue_pop(recv_queue, &age);
+		if (msg == NULL) {
+			break;
+		}
+		image_slot_paint();
+		misskey_update_render_mode(msgqueue_get_count(recv_queue), age);
+		misskey_prefetch_queue();
+		misskey_message(msg);
+		render_count[render_mode]++;
+		string_free(msg);
+	}
+	image_slot_clear();
+	defer_image = false;
+	render_mode = RENDER_FULL;
+
+	pthread_join(recv_thread, NULL);
+
+	if (__predict_false(diag_get_level(diag_net) >= 1)) {
+		struct msgqueue_stat stat;
+		msgqueue_get_stat(recv_queue, &stat);
+		diag_print(diag_net, "%s: queue recv=%" PRIu64 " shown=%" PRIu64
+			" dropped=%" PRIu64 " max_depth=%u", __func__,
+			stat.pushed, stat.popped, stat.dropped, stat.max_depth);
+		diag_print(diag_net, "%s: rendered full=%" PRIu64 " blurhash=%" PRIu64
+			" text=%" PRIu64, __func__,
+			render_count[RENDER_FULL], render_count[RENDER_BLURHASH],
+			render_count[RENDER_TEXT]);
+		struct wsclient_stat wst;
+		wsclient_get_stat(ws, &wst);
+		diag_print(diag_net, "%s: wakeups=%" PRIu64 " frames=%" PRIu64
+			" max_frames/wakeup=%u", __func__,
+			wst.wakeups, wst.frames, wst.max_frames);
+		diag_print(diag_net, "%s: messages inplace=%" PRIu64
+			" assembled=%" PRIu64, __func__,
+			wst.inplace_msgs, wst.assembled_msgs);
+		diag_print(diag_net, "%s: ping=%" PRIu64 " pong=%" PRIu64
+			" timeout=%" PRIu64 " max_gap=%u msec", __func__,
+			wst.pings, wst.pongs, wst.pong_timeouts, wst.max_gap_msec);
+		if (wst.pongs > 0) {
+			uint avg = wst.rtt_total_usec / wst.pongs;
+			diag_print(diag_net, "%s: ping rtt min/avg/max="
+				"%u.%03u/%u.%03u/%u.%03u msec", __func__,
+				wst.rtt_min_usec / 1000, wst.rtt_min_usec % 1000,
+				avg / 1000, avg % 1000,
+				wst.rtt_max_usec / 1000, wst.rtt_max_usec % 1000);
+		}
+		if (wst.deflate_msgs > 0) {
+			diag_print(diag_net, "%s: deflate messages=%" PRIu64
+				" compressed=%" PRIu64 " inflated=%" PRIu64 " (%u%%)",
+				__func__, wst.deflate_msgs, wst.deflate_in, wst.deflate_out,
+				(uint)(wst.deflate_in * 100 / MAX(wst.deflate_out, 1)));
+		}
+		struct net_stat nst;
+		net_get_stat(&nst);
+		diag_print(diag_net, "%s: tls handshake full=%" PRIu64
+			" resumed=%" PRIu64, __func__, nst.tls_full, nst.tls_resumed);
+		diag_print(diag_net, "%s: dns hit=%" PRIu64 " negative=%" PRIu64
+			" miss=%" PRIu64 " timeout=%" PRIu64, __func__,
+			nst.dns_hit, nst.dns_negative, nst.dns_miss, nst.dns_timeout);
+		if (nst.read_timeout > 0) {
+			diag_print(diag_net, "%s: read deadline exceeded=%" PRIu64,
+				__func__, nst.read_timeout);
+		}
+		if (opt_show_image && opt_keepalive_image > 0) {
+			struct httpclient_stat hst;
+			httpclient_get_stat(&hst);
+			diag_print(diag_net, "%s: image connection new=%" PRIu64
+				" reused=%" PRIu64 " pooled=%" PRIu64 " expired=%" PRIu64
+				" closed=%" PRIu64 " evicted=%" PRIu64 " retried=%" PRIu64,
+				__func__, hst.connected, hst.reused, hst.pooled, hst.expired,
+				hst.closed, hst.evicted, hst.retried);
+		}
+		if (opt_show_image) {
+			struct image_limit_stat ist;
+			image_get_limit_stat(&ist);
+			diag_print(diag_net, "%s: decode checked=%" PRIu64
+				" reduced=%" PRIu64 " over_pixels=%" PRIu64
+				" over_memory=%" PRIu64 " over_frames=%" PRIu64, __func__,
+				ist.checked, ist.reduced, ist.over_pixels, ist.over_memory,
+				ist.over_frames);
+		}
+		if (opt_show_image && (netopt_image.max_length > 0 ||
+			opt_max_image_rate > 0))
+		{
+			struct budget_stat bst;
+			budget_get_stat(&bst);
+			diag_print(diag_net, "%s: image budget allowed=%" PRIu64
+				" over_size=%" PRIu64 " over_rate=%" PRIu64
+				" bytes=%" PRIu64, __func__,
+				bst.allowed, bst.over_size, bst.over_rate, bst.bytes);
+		}
+		if (opt_show_image) {
+			struct negcache_stat ngst;
+			negcache_get_stat(&ngst);
+			diag_print(diag_net, "%s: negcache failures=%" PRIu64
+				" host_failures=%" PRIu64 " host_blocks=%" PRIu64
+				" skipped_url=%" PRIu64 " skipped_host=%" PRIu64, __func__,
+				ngst.url_failures, ngst.host_failures, ngst.host_blocks,
+				ngst.skipped_url, ngst.skipped_host);
+		}
+	}
+	if (__predict_false(diag_get_level(diag_image) >= 1) && opt_show_image) {
+		struct cache_stat cst;
+		cache_get_stat(&cst);
+		diag_print(diag_image, "%s: cache lookups=%" PRIu64 " hits=%" PRIu64
+			" puts=%" PRIu64 "(%" PRIu64 " bytes) resets=%" PRIu64
+			" count=%u lock_waits=%" PRIu64 " lock_shared=%" PRIu64,
+			__func__,
+			cst.lookups, cst.hits, cst.puts, cst.put_bytes, cst.resets,
+			cst.count, cst.lock_waits, cst.lock_shared);
+		diag_print(diag_image, "%s: cache janitor expired=%" PRIu64
+			" evicted=%" PRIu64 " compactions=%" PRIu64
+			"(%" PRIu64 " bytes) legacy_removed=%" PRIu64, __func__,
+			cst.expired, cst.evicted, cst.compactions, cst.reclaimed,
+			cst.legacy_removed);
+
+		struct hotcache_stat hst;
+		hotcache_get_stat(&hst);
+		diag_print(diag_image, "%s: icon cache lookups=%" PRIu64
+			" hits=%" PRIu64 "(%u%%) loads=%" PRIu64 " evicted=%" PRIu64
+			" resident=%" PRIu64 " bytes count=%u", __func__,
+			hst.lookups, hst.hits,
+			(uint)(hst.lookups ? hst.hits * 100 / hst.lookups : 0),
+			hst.loads, hst.evicted, hst.bytes, hst.count);
+
+		struct sixel_pack_stat zst;
+		sixel_get_pack_stat(&zst);
+		diag_print(diag_image, "%s: cache compression packed=%" PRIu64
+			" raw=%" PRIu64 " bytes packed=%" PRIu64 " bytes(%u%%)"
+			" unpacked=%" PRIu64, __func__,
+			zst.packed, zst.raw_bytes, zst.packed_bytes,
+			(uint)(zst.raw_bytes ? zst.packed_bytes * 100 / zst.raw_bytes : 0),
+			zst.unpacked);
+	}
+	if (__predict_false(diag_get_level(diag_image) >= 1) &&
+		fetchpool_enabled())
+	{
+		struct fetchpool_stat pst;
+		fetchpool_get_stat(&pst);
+		diag_print(diag_image, "%s: prefetch requested=%" PRIu64
+			" ready=%" PRIu64 " waited=%" PRIu64 "(%" PRIu64 " msec)"
+			" self=%" PRIu64 " failed=%" PRIu64
+			" rejected=%" PRIu64 " forgotten=%" PRIu64, __func__,
+			pst.requested, pst.ready, pst.waited, pst.wait_msec,
+			pst.self, pst.failed, pst.rejected, pst.forgotten);
+	}
+	msgqueue_destroy(recv_queue);
+	recv_queue = NULL;
+
+	// EOF なら相手からのクローズ。
+	return (recv_result == 0);
+}
+
+// 受信スレッド。
+// 終了理由は recv_result に置いてから終了する。
+static void *
+misskey_recv_thread(void *arg)
+{
+	struct wsclient *ws = (struct wsclient *)arg;
+	int r;
+
+	do {
+		r = wsclient_process(ws);
+	} while (__predict_true(r > 0));
+
+	if (r < 0) {
+		if (errno == ETIMEDOUT) {
+			// PONG が返ってこなかった。接続が死んでいるだけなので
+			// 相手からのクローズと同じく、すぐに再接続する。
+			Debug(diag_net, "%s: No PONG from server, reconnecting",
+				__func__);
+			r = 0;
+		} else {
+			warn("%s: wsclient_process failed", __func__);
 		}
 	}
+	recv_result = r;
 
-	return false;
+	// 表示側に終了を通知。
+	msgqueue_close(recv_queue);
+	return NULL;
 }
 
 // サーバから1メッセージ (以上?)を受信したコールバック。
+// 受信スレッドから呼ばれる。
+// msg は wsclient の受信バッファを直接指していることがあるので、
+// 書き換えたり戻った後まで保持したりしないこと。
 static void
 misskey_recv_cb(const string *msg)
 {
@@ -292,7 +725,16 @@ misskey_recv_cb(const string *msg)
 		}
 	}
 
-	misskey_message(UNCONST(msg));
+	// 表示側へ。溢れたら一番古いものが捨てられる。
+	string *dup = string_dup(msg);
+	if (dup == NULL) {
+		Debug(diag_net, "%s: string_dup failed", __func__);
+		return;
+	}
+	if (msgqueue_push(recv_queue, dup) == false) {
+		Debug(diag_net, "%s: queue is full, the oldest message dropped",
+			__func__);
+	}
 }
 
 // 1メッセージの処理。ここからストリーミングとローカル再生共通。
@@ -312,6 +754,11 @@ misskey_message(string *jsonstr)
 		json_jsmndump(js);
 	}
 
+	// このメッセージで使う画像を並行して取得しておく。
+	if (prefetch_js) {
+		misskey_prefetch(js);
+	}
+
 	// ストリームから来る JSON は以下のような構造。
 	// {
 	//   "type":"channel", "body":{
@@ -411,7 +858,7 @@ misskey_message(string *jsonstr)
 
  done:
 	if (crlf > 0) {
-		printf("\n");
+		print_newline();
 	}
 	return;
 
@@ -419,12 +866,171 @@ misskey_message(string *jsonstr)
 	if (iobj == 0) {
 		if (type == NULL || type[0] == '\0') {
 			printf("No message type?\n");
+			cursor_moved(1);
 		} else {
 			printf("Unknown message type /%s\n", type);
+			cursor_moved(1);
 		}
 	} else {
 		const char *ptype = json_obj_find_cstr(js, 0, "type");
 		printf("Unknown message type /%s/%s\n", ptype, type);
+		cursor_moved(1);
+	}
+}
+
+// これから表示するメッセージの画像の表示方法を決める。
+// depth はまだ受信キューに残っている数、
+// age はこれから表示するメッセージの待ち時間 [msec]。
+static void
+misskey_update_render_mode(uint depth, uint32 age)
+{
+	uint mode;
+
+	if (depth >= CATCHUP_TEXT_DEPTH || age >= CATCHUP_TEXT_AGE) {
+		mode = RENDER_TEXT;
+	} else if (depth >= CATCHUP_BLURHASH_DEPTH || age >= CATCHUP_BLURHASH_AGE) {
+		mode = RENDER_BLURHASH;
+	} else {
+		mode = RENDER_FULL;
+	}
+
+	// 簡略化はすぐ行うが、戻すのは追いついてから。
+	// しきい値付近で行ったり来たりしないように。
+	if (mode < render_mode && depth > CATCHUP_RESUME_DEPTH) {
+		return;
+	}
+
+	if (mode != render_mode) {
+		Debug(diag_net, "%s: %s -> %s (depth=%u age=%u msec)", __func__,
+			render_mode_names[render_mode], render_mode_names[mode],
+			depth, age);
+		render_mode = mode;
+	}
+}
+
+// 受信キューの先頭から PREFETCH_NOTES 個のメッセージの画像の先読みを
+// 依頼する。一度依頼したメッセージは飛ばす。
+static void
+misskey_prefetch_queue(void)
+{
+	if (prefetch_js == NULL) {
+		return;
+	}
+
+	for (uint i = 0; i < PREFETCH_NOTES; i++) {
+		uint64 seq;
+		string *msg = msgqueue_peek(recv_queue, i, &seq);
+		if (msg == NULL) {
+			break;
+		}
+		if (seq > prefetch_seq) {
+			if (json_parse(prefetch_js, msg) >= 0) {
+				misskey_prefetch(prefetch_js);
+			}
+			prefetch_seq = seq;
+		}
+		string_free(msg);
+	}
+}
+
+// js のメッセージで表示する画像の先読みを依頼する。
+// 構造のたどり方は misskey_message() と同じ。
+static void
+misskey_prefetch(const struct json *js)
+{
+	int iobj = json_obj_find_obj(js, 0, "body");
+	if (iobj < 0) {
+		return;
+	}
+	const char *type = json_obj_find_cstr(js, 0, "type");
+	if (type == NULL || strcmp(type, "channel") != 0) {
+		return;
+	}
+
+	int ibody = json_obj_find_obj(js, iobj, "body");
+	if (ibody < 0) {
+		return;
+	}
+	type = json_obj_find_cstr(js, iobj, "type");
+	if (type == NULL) {
+		return;
+	}
+	if (strcmp(type, "note") == 0) {
+		misskey_prefetch_note(js, ibody);
+	} else if (strcmp(type, "notification") == 0) {
+		// リアクション通知はノートを表示する。
+		const char *ntype = json_obj_find_cstr(js, ibody, "type");
+		if (ntype && strcmp(ntype, "reaction") == 0) {
+			int inote = json_obj_find_obj(js, ibody, "note");
+			if (inote >= 0) {
+				misskey_prefetch_note(js, inote);
+			}
+		}
+	}
+}
+
+// 1ノートで表示する画像 (アイコンと添付画像) の先読みを依頼する。
+// 判定は misskey_show_note() に準じるが、NG ワードまでは見ない
+// (表示しなかった分は取得が無駄になるだけ)。
+static void
+misskey_prefetch_note(const struct json *js, int inote)
+{
+	const char *c_text = json_obj_find_cstr(js, inote, "text");
+	int icw = json_obj_find(js, inote, "cw");
+	if (icw >= 0 && json_is_str(js, icw) == false) {
+		icw = -1;
+	}
+	int ifiles = json_obj_find(js, inote, "files");
+	if (ifiles >= 0) {
+		if (json_is_array(js, ifiles) == false || json_get_size(js, ifiles) < 1)
+		{
+			ifiles = -1;
+		}
+	}
+	int irenote = json_obj_find_obj(js, inote, "renote");
+
+	if (c_text == NULL && icw < 0 && ifiles < 0 && irenote >= 0) {
+		// リノート。
+		misskey_prefetch_note(js, irenote);
+		return;
+	}
+
+	if (opt_nsfw == NSFW_HIDE && ifiles >= 0) {
+		JSON_ARRAY_FOR(ifile, js, ifiles) {
+			if (json_obj_find_bool(js, ifile, "isSensitive")) {
+				return;
+			}
+		}
+	}
+
+	// アイコン。
+	// Blurhash は取得に失敗した時の代替なのでここでは扱わない。
+	int iuser = json_obj_find_obj(js, inote, "user");
+	if (iuser >= 0 && !opt_force_blurhash && render_mode == RENDER_FULL) {
+		const char *avatar_url = json_obj_find_cstr(js, iuser, "avatarUrl");
+		if (avatar_url) {
+			char filename[PATH_MAX];
+			string *userid = misskey_get_userid(js, iuser);
+			make_icon_filename(filename, sizeof(filename), userid, avatar_url);
+			fetchpool_request(filename, avatar_url, iconsize, iconsize, false);
+			string_free(userid);
+		}
+	}
+
+	// 添付画像。
+	if ((icw < 0 || opt_show_cw) && ifiles >= 0) {
+		JSON_ARRAY_FOR(ifile, js, ifiles) {
+			struct photo photo;
+			if (misskey_get_photo(js, ifile, &photo)) {
+				fetchpool_request(photo.img_file, photo.img_url,
+					photo.width, photo.height, photo.shade);
+			}
+		}
+	}
+
+	// 引用部分。
+	if (irenote >= 0) {
+		misskey_prefetch_note(js, irenote);
 	}
 }
 
@@ -481,7 +1087,7 @@ misskey_show_note(const struct json *js, int inote)
 			ustring *rnowner = misskey_format_renote_owner(js, inote);
 			ustring_append_ustring_style(rnline, rnowner, STYLE_RENOTE);
 			iprint(rnline);
-			printf("\n");
+			print_newline();
 			ustring_free(rnowner);
 			ustring_free(rnline);
 		}
@@ -598,9 +1204,9 @@ misskey_show_note(const struct json *js, int inote)
 	misskey_show_icon(js, iuser, user->id);
 
 	iprint(headline);
-	printf("\n");
+	print_newline();
 	iprint(textline);
-	printf("\n");
+	print_newline();
 
 	// これらは本文付随なので CW 以降を表示する時だけ表示する。
 	if (cw == NULL || opt_show_cw) {
@@ -626,7 +1232,7 @@ misskey_show_note(const struct json *js, int inote)
 				if (pollline) {
 					ustring_append_utf8(pollline, string_get(pollstr));
 					iprint(pollline);
-					printf("\n");
+					print_newline();
 					ustring_free(pollline);
 				}
 				string_free(pollstr);
@@ -653,7 +1259,7 @@ misskey_show_note(const struct json *js, int inote)
 	ustring_append_ascii_style(footline, string_get(reactmsg), STYLE_REACTION);
 
 	iprint(footline);
-	printf("\n");
+	print_newline();
 	crlf = 1;
 
 	ustring_free(footline);
@@ -680,7 +1286,7 @@ misskey_show_announcement(const struct json *js, int inote)
 
 	ustring_append_ascii_style(line, "announcement", STYLE_USERNAME);
 	iprint(line);
-	printf("\n");
+	print_newline();
 
 	const char *title = json_obj_find_cstr(js, inote, "title");
 	const char *text  = json_obj_find_cstr(js, inote, "text");
@@ -698,7 +1304,7 @@ misskey_show_announcement(const struct json *js, int inote)
 		string_free(unescape_text);
 	}
 	iprint(line);
-	printf("\n");
+	print_newline();
 
 	const char *imageUrl = json_obj_find_cstr(js, inote, "imageUrl");
 	if (imageUrl) {
@@ -725,7 +1331,7 @@ misskey_show_announcement(const struct json *js, int inote)
 		ustring_clear(line);
 		ustring_append_ascii_style(line, string_get(time), STYLE_TIME);
 		iprint(line);
-		printf("\n");
+		print_newline();
 		string_free(time);
 	}
 
@@ -764,6 +1370,7 @@ misskey_show_notification(const struct json *js, int ibody)
 	int itype = json_obj_find(js, ibody, "type");
 	if (itype < 0) {
 		printf("notification but has no type?\n");
+		cursor_moved(1);
 		return 0;
 	}
 	const char *type = json_get_cstr(js, itype);
@@ -772,6 +1379,7 @@ misskey_show_notification(const struct json *js, int ibody)
 		int inote = json_obj_find_obj(js, ibody, "note");
 		if (inote < 0) {
 			printf("notification/reaction but has no note?\n");
+			cursor_moved(1);
 			return 0;
 		}
 		misskey_show_note(js, inote);
@@ -795,7 +1403,7 @@ misskey_show_notification(const struct json *js, int ibody)
 		}
 		ustring_append_ascii(u, style_end(STYLE_REACTION));
 		iprint(u);
-		printf("\n");
+		print_newline();
 		ustring_free(u);
 		misskey_free_user(user);
 		string_free(time);
@@ -820,11 +1428,11 @@ misskey_show_notification(const struct json *js, int ibody)
 				STYLE_USERNAME);
 		}
 		iprint(u);
-		printf("\n");
+		print_newline();
 		ustring_clear(u);
 		ustring_append_ascii_style(u, string_get(time), STYLE_TIME);
 		iprint(u);
-		printf("\n");
+		print_newline();
 		ustring_free(u);
 		misskey_free_user(user);
 		string_free(time);
@@ -843,11 +1451,11 @@ misskey_show_notification(const struct json *js, int ibody)
 		ustring_append_utf8_style(u, achieve, STYLE_USERNAME);
 		ustring_append_unichar(u, '\"');
 		iprint(u);
-		printf("\n");
+		print_newline();
 		ustring_clear(u);
 		ustring_append_ascii_style(u, string_get(time), STYLE_TIME);
 		iprint(u);
-		printf("\n");
+		print_newline();
 		ustring_free(u);
 		string_free(time);
 		return 1;
@@ -867,6 +1475,7 @@ misskey_show_notification(const struct json *js, int ibody)
 	}
 
 	printf("Unknown notification type \"%s\"\n", type);
+	cursor_moved(1);
 	return 0;
 }
 
@@ -882,38 +1491,47 @@ misskey_show_icon(const struct json *js, int iuser, const string *userid)
 		// カーソル位置を保存する
 		// (スクロールするとカーソル位置復元時に位置が合わない)
 		printf("\n\n\n" CSI "3A" ESC "7");
+		cursor_moved(3);
+		cursor_moved(-3);
 
 		// インデント。
 		if (indent_depth > 0) {
 			print_indent(indent_depth);
 		}
 	}
+	uint64 saved_row = cursor_row;
 
 	bool shown = false;
-	if (__predict_true(opt_show_image)) {
+	if (__predict_true(opt_show_image) && render_mode != RENDER_TEXT) {
 		char filename[PATH_MAX];
+		char bh_filename[PATH_MAX];
+		char bh_url[256];
 		const char *avatar_url = json_obj_find_cstr(js, iuser, "avatarUrl");
-		if (avatar_url && userid && !opt_force_blurhash) {
-			// URL の FNV1 ハッシュをキャッシュのキーにする。
-			// Misskey の画像 URL は長いのと URL がネストした構造を
-			// しているので単純に一部を切り出して使う方法は無理。
-			snprintf(filename, sizeof(filename), "icon-%s-%u-%s-%08x",
-				colorname, fontheight,
-				string_get(userid), hash_fnv1a(avatar_url));
-			shown = show_image(filename, avatar_url, iconsize, iconsize,
-				false, -1);
+		const char *avatar_blurhash =
+			json_obj_find_cstr(js, iuser, "avatarBlurhash");
+		if (avatar_blurhash) {
+			make_icon_filename(bh_filename, sizeof(bh_filename), userid,
+				avatar_blurhash);
+			snprintf(bh_url, sizeof(bh_url), "blurhash://%s", avatar_blurhash);
+		}
+
+		if (avatar_url && userid && !opt_force_blurhash &&
+			render_mode == RENDER_FULL)
+		{
+			make_icon_filename(filename, sizeof(filename), userid, avatar_url);
+			if (defer_image && avatar_blurhash && fetchpool_busy(filename)) {
+				// 取得中なら Blurhash を表示しておいて後で差し替える。
+				shown = show_image_deferred(filename, bh_filename, bh_url,
+					iconsize, iconsize, false, -1);
+			} else {
+				shown = show_image(filename, avatar_url, iconsize, iconsize,
+					false, -1);
+			}
 		}
 
 		if (shown == false) {
-			const char *avatar_blurhash =
-				json_obj_find_cstr(js, iuser, "avatarBlurhash");
 			if (avatar_blurhash) {
-				char url[256];
-				snprintf(filename, sizeof(filename), "icon-%s-%u-%s-%08x",
-					colorname, fontheight,
-					string_get(userid), hash_fnv1a(avatar_blurhash));
-				snprintf(url, sizeof(url), "blurhash://%s", avatar_blurhash);
-				shown = show_image(filename, url, iconsize, iconsize,
+				shown = show_image(bh_filename, bh_url, iconsize, iconsize,
 					false, -1);
 			}
 		}
@@ -928,6 +1546,7 @@ misskey_show_icon(const struct json *js, int iuser, const string *userid)
 				// カーソル位置復元前にカーソル上移動x3を行う。
 				CSI "3A" ESC "8"
 			);
+			cursor_row = saved_row;
 		}
 	} else {
 		// アイコンを表示してない場合はここで代替アイコンを表示。
@@ -962,78 +1581,169 @@ misskey_show_icon(const struct json *js, int iuser, const string *userid)
 static bool
 misskey_show_photo(const struct json *js, int ifile, int index)
 {
-	char img_file[PATH_MAX];
-	char urlbuf[256];
-	const char *filetype_msg = "";
-	const char *img_url;
-	uint width = 0;
-	uint height = 0;
-	bool shade = false;
+	struct photo photo;
 	bool shown = false;
 
-	if (opt_show_image) {
-		bool isSensitive = json_obj_find_bool(js, ifile, "isSensitive");
-		if ((!isSensitive || opt_nsfw == NSFW_SHOW) && !opt_force_blurhash) {
-			// 元画像を表示。thumbnailUrl を使う。
-			img_url = json_obj_find_cstr(js, ifile, "thumbnailUrl");
-			if (img_url == NULL || img_url[0] == '\0') {
-				// なければ、ファイルタイプだけでも表示しとく?
-				goto next;
-			}
-			width  = imagesize;
-			height = imagesize;
-		} else {
-			// Blurhash を表示。
+	photo.filetype_msg = "";
+	if (opt_show_image && render_mode != RENDER_TEXT) {
+		if (misskey_get_photo(js, ifile, &photo)) {
 			const char *blurhash = json_obj_find_cstr(js, ifile, "blurhash");
-			if (blurhash == NULL || blurhash[0] == '\0' ||
-				opt_nsfw == NSFW_ALT)
+			if (defer_image && photo.shade == false &&
+				strncmp(photo.img_url, "blurhash://", 11) != 0 &&
+				blurhash && blurhash[0] != '\0' &&
+				fetchpool_busy(photo.img_file))
 			{
-				// 画像でないなど Blurhash がない、あるいは --nsfw=alt なら、
-				// ファイルタイプだけでも表示しておくか。
-				filetype_msg = " [NSFW]";
-				goto next;
-			}
-			int iproperties = json_obj_find_obj(js, ifile, "properties");
-			if (iproperties >= 0) {
-				width  = json_obj_find_int(js, iproperties, "width");
-				height = json_obj_find_int(js, iproperties, "height");
-
-				// 原寸のアスペクト比を維持したまま長辺が imagesize になる
-				// ようにする。
-				// image_reduct() には入力画像サイズとしてこのサイズを、
-				// 出力画像サイズも同じサイズを指定することで等倍で動作させる。
-				if (width > height) {
-					height = height * imagesize / width;
-					width = imagesize;
-				} else {
-					width = width * imagesize / height;
-					height = imagesize;
+				// 取得中なら Blurhash を表示しておいて後で差し替える。
+				struct photo ph;
+				misskey_get_blurhash(js, ifile, blurhash, &ph);
+				shown = show_image_deferred(photo.img_file, ph.img_file,
+					ph.img_url, ph.width, ph.height, false, index);
+			} else {
+				shown = show_image(photo.img_file, photo.img_url,
+					photo.width, photo.height, photo.shade, index);
+				if (shown == false && blurhash && blurhash[0] != '\0' &&
+					strncmp(photo.img_url, "blurhash://", 11) != 0)
+				{
+					// 取得できなかったら (時間切れなど) Blurhash で代用する。
+					struct photo ph;
+					misskey_get_blurhash(js, ifile, blurhash, &ph);
+					shown = show_image(ph.img_file, ph.img_url,
+						ph.width, ph.height, photo.shade, index);
 				}
 			}
-			if (width < 1) {
-				width = imagesize;
-			}
-			if (height < 1) {
-				height = imagesize;
-			}
-			snprintf(urlbuf, sizeof(urlbuf), "blurhash://%s", blurhash);
-			img_url = urlbuf;
-
-			if (isSensitive && opt_nsfw != NSFW_SHOW) {
-				shade = true;
-			}
 		}
-		make_cache_filename(img_file, sizeof(img_file), img_url);
-		shown = show_image(img_file, img_url, width, height, shade, index);
 	}
 
- next:
 	if (shown == false) {
-		misskey_print_filetype(js, ifile, filetype_msg);
+		misskey_print_filetype(js, ifile, photo.filetype_msg);
 	}
 	return shown;
 }
 
+// 添付ファイル ifile を画像として表示する場合のパラメータを *photo に
+// 書き出して true を返す。
+// 画像として表示しない場合は photo->filetype_msg だけを書き出して
+// false を返す。
+static bool
+misskey_get_photo(const struct json *js, int ifile, struct photo *photo)
+{
+	bool over_budget = false;
+
+	photo->filetype_msg = "";
+	photo->shade = false;
+
+	bool isSensitive = json_obj_find_bool(js, ifile, "isSensitive");
+	if ((!isSensitive || opt_nsfw == NSFW_SHOW) && !opt_force_blurhash &&
+		render_mode == RENDER_FULL)
+	{
+		// 元画像を表示。thumbnailUrl を使う。
+		photo->img_url = json_obj_find_cstr(js, ifile, "thumbnailUrl");
+		if (photo->img_url == NULL || photo->img_url[0] == '\0') {
+			// なければ、ファイルタイプだけでも表示しとく?
+			return false;
+		}
+		photo->width  = imagesize;
+		photo->height = imagesize;
+		make_cache_filename(photo->img_file, sizeof(photo->img_file),
+			photo->img_url);
+		if (misskey_check_budget(js, ifile, photo->img_file)) {
+			return true;
+		}
+		// 予算を超えるなら Blurhash にする。
+		over_budget = true;
+	}
+
+	{
+		// Blurhash を表示。
+		// 追いつきモードや予算超過で Blurhash にしているだけなら
+		// NSFW 扱いではない。
+		bool nsfw = (isSensitive ||
+			(render_mode == RENDER_FULL && over_budget == false));
+		const char *blurhash = json_obj_find_cstr(js, ifile, "blurhash");
+		if (blurhash == NULL || blurhash[0] == '\0' ||
+			(nsfw && opt_nsfw == NSFW_ALT))
+		{
+			// 画像でないなど Blurhash がない、あるいは --nsfw=alt なら、
+			// ファイルタイプだけでも表示しておくか。
+			if (nsfw) {
+				photo->filetype_msg = " [NSFW]";
+			}
+			return false;
+		}
+		misskey_get_blurhash(js, ifile, blurhash, photo);
+
+		if (isSensitive && opt_nsfw != NSFW_SHOW) {
+			photo->shade = true;
+		}
+	}
+	return true;
+}
+
+// 添付ファイル ifile の画像 (キャッシュファイル名 img_file) を
+// ダウンロードしてよければ true を返す。通信量の予算を超えるなら false。
+// キャッシュにあるか取得中のものは予算とは関係ないので true を返す。
+static bool
+misskey_check_budget(const struct json *js, int ifile, const char *img_file)
+{
+	if (cache_lookup(img_file, NULL) || fetchpool_busy(img_file)) {
+		return true;
+	}
+
+	// size がなければ (0 なら) 不明扱い。
+	int size = json_obj_find_int(js, ifile, "size");
+	if (size < 0) {
+		size = 0;
+	}
+	if (budget_allow(size) == false) {
+		Debug(diag_image, "%s: %s: over budget (size=%d)", __func__,
+			img_file, size);
+		return false;
+	}
+	return true;
+}
+
+// 添付ファイル ifile の Blurhash 文字列 blurhash を表示する場合の
+// パラメータを *photo に書き出す。shade と filetype_msg は変更しない。
+static void
+misskey_get_blurhash(const struct json *js, int ifile, const char *blurhash,
+	struct photo *photo)
+{
+	uint width = 0;
+	uint height = 0;
+
+	int iproperties = json_obj_find_obj(js, ifile, "properties");
+	if (iproperties >= 0) {
+		width  = json_obj_find_int(js, iproperties, "width");
+		height = json_obj_find_int(js, iproperties, "height");
+
+		// 原寸のアスペクト比を維持したまま長辺が imagesize になる
+		// ようにする。
+		// image_reduct() には入力画像サイズとしてこのサイズを、
+		// 出力画像サイズも同じサイズを指定することで等倍で動作させる。
+		if (width > height) {
+			height = height * imagesize / width;
+			width = imagesize;
+		} else {
+			width = width * imagesize / height;
+			height = imagesize;
+		}
+	}
+	if (width < 1) {
+		width = imagesize;
+	}
+	if (height < 1) {
+		height = imagesize;
+	}
+	snprintf(photo->urlbuf, sizeof(photo->urlbuf), "blurhash://%s",
+		blurhash);
+	photo->img_url = photo->urlbuf;
+
+	photo->width = width;
+	photo->height = height;
+	make_cache_filename(photo->img_file, sizeof(photo->img_file),
+		photo->img_url);
+}
+
 // 改行してファイルタイプだけを出力する。
 static void
 misskey_print_filetype(const struct json *js, int ifile, const char *msg)
@@ -1055,6 +1765,20 @@ misskey_print_filetype(const struct json *js, int ifile, const char *msg)
 	printf("\r");
 	print_indent(indent_depth + 1);
 	printf("(%s)%s\n", type, msg);
+	cursor_moved(1);
+}
+
+// アイコンのキャッシュファイル名を作成して返す。
+// "icon-<color>-<fontheight>-<userid>-<hash>"(.sixel)
+// key (画像 URL か Blurhash 文字列) の FNV1 ハッシュをキャッシュのキーにする。
+// Misskey の画像 URL は長いのと URL がネストした構造をしているので
+// 単純に一部を切り出して使う方法は無理。
+static void
+make_icon_filename(char *filename, uint bufsize, const string *userid,
+	const char *key)
+{
+	snprintf(filename, bufsize, "icon-%s-%u-%s-%08x",
+		colorname, fontheight, string_get(userid), hash_fnv1a(key));
 }
 
 // 画像 URL からキャッシュファイル名を作成して返す。
@@ -1686,7 +2410,6 @@ misskey_get_user(const struct json *js, int inote)
 	if (iuser >= 0) {
 		const char *c_name     = json_obj_find_cstr(js, iuser, "name");
 		const char *c_username = json_obj_find_cstr(js, iuser, "username");
-		const char *c_host     = json_obj_find_cstr(js, iuser, "host");
 
 		// ユーザ名 は name だが、空なら username を使う仕様のようだ。
 		if (c_name && c_name[0] != '\0') {
@@ -1701,12 +2424,8 @@ misskey_get_user(const struct json *js, int inote)
 		}
 
 		// @アカウント名 [ @外部ホスト名 ]
-		string_append_char(user->id, '@');
-		string_append_cstr(user->id, c_username);
-		if (c_host) {
-			string_append_char(user->id, '@');
-			string_append_cstr(user->id, c_host);
-		}
+		string_free(user->id);
+		user->id = misskey_get_userid(js, iuser);
 
 		// インスタンス名
 		int iinstance = json_obj_find_obj(js, iuser, "instance");
@@ -1721,6 +2440,24 @@ misskey_get_user(const struct json *js, int inote)
 	return user;
 }
 
+// ユーザ iuser のアカウント名 "@username[@host]" を返す。
+static string *
+misskey_get_userid(const struct json *js, int iuser)
+{
+	string *id = string_init();
+
+	const char *c_username = json_obj_find_cstr(js, iuser, "username");
+	const char *c_host     = json_obj_find_cstr(js, iuser, "host");
+
+	string_append_char(id, '@');
+	string_append_cstr(id, c_username);
+	if (c_host) {
+		string_append_char(id, '@');
+		string_append_cstr(id, c_host);
+	}
+	return id;
+}
+
 static void
 misskey_free_user(misskey_user *user)
 {
@@ -1796,11 +2533,11 @@ misskey_show_ng(int ngid, const struct json *js, int inote,
 	ustring_append_utf8_style(footline, string_get(ngtext), STYLE_NG);
 
 	iprint(headline);
-	printf("\n");
+	print_newline();
 	iprint(footline);
-	printf("\n");
+	print_newline();
 
-	printf("\n");
+	print_newline();
 
 	string_free(time);
 	ustring_free(headline);
@@ -0,0 +1,257 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 受信スレッドと表示スレッドの間のメッセージキュー
+//
+
+// o 受信側 (WebSocket) は表示側がどれだけ遅くても止まってはいけない。
+//   止まると PING/PONG が遅れてサーバから切断される。
+// o なのでキューは有限長とし、溢れたら古いほうから捨てる。
+//   表示が追いついていない時点で古いメッセージの価値は低いため。
+// o 取り出し側はキューが空なら追加されるか閉じられるまで待つ。
+
+#include "sayaka.h"
+#include <pthread.h>
+#include <string.h>
+
+struct msgqueue_entry {
+	string *msg;
+	uint64 seq;			// 通し番号 (1 から)
+	uint64 recv_msec;	// 追加された時刻 (CLOCK_MONOTONIC)
+};
+
+struct msgqueue {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+
+	// リングバッファ。
+	struct msgqueue_entry *ring;
+	uint capacity;		// ring の要素数
+	uint head;			// 次に取り出す位置
+	uint count;			// 現在の要素数
+
+	bool closed;		// 追加側が閉じた
+
+	struct msgqueue_stat stat;
+};
+
+// 最大 capacity 個のメッセージを保持するキューを作成する。
+// 失敗すれば NULL を返す。
+struct msgqueue *
+msgqueue_create(uint capacity)
+{
+	struct msgqueue *q;
+
+	assert(capacity > 0);
+
+	q = calloc(1, sizeof(*q));
+	if (q == NULL) {
+		return NULL;
+	}
+	q->ring = calloc(capacity, sizeof(q->ring[0]));
+	if (q->ring == NULL) {
+		free(q);
+		return NULL;
+	}
+	q->capacity = capacity;
+
+	pthread_mutex_init(&q->mtx, NULL);
+	pthread_cond_init(&q->cv, NULL);
+
+	return q;
+}
+
+// q を解放する。残っているメッセージも解放する。
+// q が NULL なら何もしない。
+void
+msgqueue_destroy(struct msgqueue *q)
+{
+	if (q) {
+		for (uint i = 0; i < q->count; i++) {
+			string_free(q->ring[(q->head + i) % q->capacity].msg);
+		}
+		free(q->ring);
+		pthread_cond_destroy(&q->cv);
+		pthread_mutex_destroy(&q->mtx);
+		free(q);
+	}
+}
+
+// msg をキューの末尾に追加する。msg の所有権はキューに移る。
+// キューが一杯なら一番古いメッセージを捨ててから追加する。
+// 捨てたものがあれば false を返す。
+bool
+msgqueue_push(struct msgqueue *q, string *msg)
+{
+	struct timespec now;
+	bool rv = true;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&q->mtx);
+
+	if (q->count == q->capacity) {
+		string_free(q->ring[q->head].msg);
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+		q->stat.dropped++;
+		rv = false;
+	}
+
+	struct msgqueue_entry *e = &q->ring[(q->head + q->count) % q->capacity];
+	e->msg = msg;
+	q->count++;
+	q->stat.pushed++;
+	e->seq = q->stat.pushed;
+	e->recv_msec = timespec_to_msec(&now);
+	if (q->count > q->stat.max_depth) {
+		q->stat.max_depth = q->count;
+	}
+
+	pthread_cond_signal(&q->cv);
+	pthread_mutex_unlock(&q->mtx);
+
+	return rv;
+}
+
+// キューの先頭からメッセージを取り出して返す。
+// キューが空なら追加されるか閉じられるまで待つ。
+// 閉じられていてかつ空なら NULL を返す。
+// agep が NULL でなければ、このメッセージがキューに追加されてから
+// 取り出されるまでの時間 [msec] を *agep に返す。
+// 受け取ったメッセージは呼び出し側で解放すること。
+string *
+msgqueue_pop(struct msgqueue *q, uint32 *agep)
+{
+	string *msg = NULL;
+
+	pthread_mutex_lock(&q->mtx);
+
+	while (q->count == 0 && q->closed == false) {
+		pthread_cond_wait(&q->cv, &q->mtx);
+	}
+	if (q->count > 0) {
+		msg = q->ring[q->head].msg;
+		q->ring[q->head].msg = NULL;
+		if (agep) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			*agep = timespec_to_msec(&now) - q->ring[q->head].recv_msec;
+		}
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+		q->stat.popped++;
+	}
+
+	pthread_mutex_unlock(&q->mtx);
+
+	return msg;
+}
+
+// 先頭から n 番目 (0 なら次に取り出されるもの) のメッセージの複製を返す。
+// seqp が NULL でなければ、そのメッセージの通し番号を *seqp に返す。
+// 通し番号は追加順に 1 から振られるので、先読みを重複させないために使える。
+// n 番目のメッセージがなければ NULL を返す。待つことはしない。
+// 返したメッセージは呼び出し側で解放すること。
+string *
+msgqueue_peek(struct msgqueue *q, uint n, uint64 *seqp)
+{
+	string *msg = NULL;
+
+	pthread_mutex_lock(&q->mtx);
+
+	if (n < q->count) {
+		const struct msgqueue_entry *e = &q->ring[(q->head + n) % q->capacity];
+		msg = string_dup(e->msg);
+		if (seqp) {
+			*seqp = e->seq;
+		}
+	}
+
+	pthread_mutex_unlock(&q->mtx);
+
+	return msg;
+}
+
+// キューにメッセージが来るか閉じられるまで、最大 msec ミリ秒待つ。
+// メッセージがあるか閉じられていれば true、タイムアウトなら false を返す。
+bool
+msgqueue_wait(struct msgqueue *q, uint msec)
+{
+	struct timespec abstime;
+	bool rv;
+
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_sec += msec / 1000;
+	abstime.tv_nsec += (msec % 1000) * 1000000;
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&q->mtx);
+	while (q->count == 0 && q->closed == false) {
+		if (pthread_cond_timedwait(&q->cv, &q->mtx, &abstime) != 0) {
+			break;
+		}
+	}
+	rv = (q->count > 0 || q->closed);
+	pthread_mutex_unlock(&q->mtx);
+
+	return rv;
+}
+
+// 追加側がこれ以上追加しないことを通知する。
+// 取り出し側は残っているメッセージを取り出し終えると NULL を受け取る。
+void
+msgqueue_close(struct msgqueue *q)
+{
+	pthread_mutex_lock(&q->mtx);
+	q->closed = true;
+	pthread_cond_broadcast(&q->cv);
+	pthread_mutex_unlock(&q->mtx);
+}
+
+// 現在キューに溜まっているメッセージ数を返す。
+uint
+msgqueue_get_count(struct msgqueue *q)
+{
+	pthread_mutex_lock(&q->mtx);
+	uint count = q->count;
+	pthread_mutex_unlock(&q->mtx);
+
+	return count;
+}
+
+// 統計情報を *stat にコピーする。
+void
+msgqueue_get_stat(struct msgqueue *q, struct msgqueue_stat *stat)
+{
+	pthread_mutex_lock(&q->mtx);
+	memcpy(stat, &q->stat, sizeof(*stat));
+	pthread_mutex_unlock(&q->mtx);
+}
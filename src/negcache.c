@@ -0,0 +1,262 @@
+/* vi:set ts=4: */
+/*
+ * Copyright (C) 2026 Tetsuya Isaki
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// 画像取得の失敗の記録 (ネガティブキャッシュ)
+//
+
+// o リモートのインスタンスが落ちていると、そこのユーザのノートが来る
+//   たびに同じアイコンやサムネイルの URL に接続しに行って、毎回
+//   タイムアウトまで待たされる。そこで失敗した URL とホストを覚えておき、
+//   しばらくは取得せずにすぐ Blurhash などに切り替える。
+// o URL は、失敗の種類によらずしばらく (4xx やデコードできないものは
+//   長め、一時的かも知れないものは短め) 取得しない。
+// o ホストは、接続できない、タイムアウト、5xx が続いたら止める。
+//   止める時間は続けて失敗するたびに倍にして (上限あり)、
+//   1回でも成功したら元に戻す。4xx やデコードの失敗はホストは
+//   生きているので数えない。
+// o どちらも固定の大きさの表で、一杯なら期限が一番近いものを捨てる。
+//   キーは文字列ではなくハッシュで持つ (衝突しても取得しないのが
+//   少し長引くだけ)。
+// o 表示スレッドからも先読みワーカーからも呼ばれる。
+
+#include "sayaka.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(SLOW_ARCH)
+#define NEGCACHE_URLS	(64)
+#define NEGCACHE_HOSTS	(16)
+#else
+#define NEGCACHE_URLS	(512)
+#define NEGCACHE_HOSTS	(64)
+#endif
+
+// URL を取得しない時間 [sec]。
+#define NEGCACHE_URL_TTL		(10 * 60)	// 4xx、デコードできないなど
+#define NEGCACHE_URL_TTL_SHORT	(60)		// 接続できない、5xx など
+
+// ホストを止めるまでの連続失敗回数と、止める時間 [sec]。
+#define NEGCACHE_HOST_THRESHOLD	(2)
+#define NEGCACHE_HOST_MIN		(30)
+#define NEGCACHE_HOST_MAX		(30 * 60)
+
+struct negcache_url {
+	uint64 hash;		// URL のハッシュ (0 なら空き)
+	uint64 expire;		// この時刻 [sec] まで取得しない
+};
+
+struct negcache_host {
+	uint64 hash;		// ホスト名のハッシュ (0 なら空き)
+	uint64 expire;		// この時刻 [sec] まで取得しない
+	uint failures;		// 連続した失敗回数
+};
+
+static uint64 negcache_host_hash(const char *);
+static uint64 negcache_now_sec(void);
+
+static pthread_mutex_t negcache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct negcache_url urls[NEGCACHE_URLS];
+static struct negcache_host hosts[NEGCACHE_HOSTS];
+static struct negcache_stat negcache_stat;
+
+// url を取得してよければ true を返す。
+// url かそのホストが最近失敗していれば false を返す。
+bool
+negcache_allow(const char *url)
+{
+	uint64 uhash = hash_fnv1a64(url);
+	uint64 hhash = negcache_host_hash(url);
+	uint64 now = negcache_now_sec();
+	bool rv = true;
+
+	pthread_mutex_lock(&negcache_mtx);
+	for (uint i = 0; i < NEGCACHE_URLS; i++) {
+		if (urls[i].hash == uhash && now < urls[i].expire) {
+			negcache_stat.skipped_url++;
+			rv = false;
+			goto done;
+		}
+	}
+	for (uint i = 0; i < NEGCACHE_HOSTS; i++) {
+		if (hosts[i].hash == hhash && now < hosts[i].expire) {
+			negcache_stat.skipped_host++;
+			rv = false;
+			goto done;
+		}
+	}
+ done:
+	pthread_mutex_unlock(&negcache_mtx);
+
+	return rv;
+}
+
+// url の取得に失敗したことを記録する。
+// host_down が true なら、ホスト側の問題 (接続できない、タイムアウト、
+// 5xx) として、ホストの失敗としても数える。
+void
+negcache_fail(const char *url, bool host_down)
+{
+	uint64 uhash = hash_fnv1a64(url);
+	uint64 now = negcache_now_sec();
+	uint i;
+	uint victim;
+
+	pthread_mutex_lock(&negcache_mtx);
+
+	// 同じ URL か空きか期限切れか、なければ期限が一番近いものを使う。
+	victim = 0;
+	for (i = 0; i < NEGCACHE_URLS; i++) {
+		if (urls[i].hash == uhash || urls[i].expire <= now) {
+			victim = i;
+			break;
+		}
+		if (urls[i].expire < urls[victim].expire) {
+			victim = i;
+		}
+	}
+	urls[victim].hash = uhash;
+	urls[victim].expire = now +
+		(host_down ? NEGCACHE_URL_TTL_SHORT : NEGCACHE_URL_TTL);
+	negcache_stat.url_failures++;
+
+	if (host_down) {
+		uint64 hhash = negcache_host_hash(url);
+		struct negcache_host *h = NULL;
+
+		victim = 0;
+		for (i = 0; i < NEGCACHE_HOSTS; i++) {
+			if (hosts[i].hash == hhash) {
+				h = &hosts[i];
+				break;
+			}
+			if (hosts[i].hash == 0 ||
+				(hosts[victim].hash != 0 &&
+				 hosts[i].expire < hosts[victim].expire))
+			{
+				victim = i;
+			}
+		}
+		if (h == NULL) {
+			h = &hosts[victim];
+			h->hash = hhash;
+			h->expire = 0;
+			h->failures = 0;
+		}
+		h->failures++;
+		negcache_stat.host_failures++;
+
+		// 続けて失敗したらしばらく止める。止めるたびに倍にする。
+		if (h->failures >= NEGCACHE_HOST_THRESHOLD) {
+			uint n = MIN(h->failures - NEGCACHE_HOST_THRESHOLD, 16);
+			uint64 sec = MIN((uint64)NEGCACHE_HOST_MIN << n,
+				NEGCACHE_HOST_MAX);
+			h->expire = now + sec;
+			negcache_stat.host_blocks++;
+			Debug(diag_net, "%s: %s: host blocked for %" PRIu64 " sec",
+				__func__, url, sec);
+		}
+	}
+
+	pthread_mutex_unlock(&negcache_mtx);
+}
+
+// url の取得に成功したことを記録する。
+// そのホストの連続失敗回数を元に戻す。
+void
+negcache_success(const char *url)
+{
+	uint64 hhash = negcache_host_hash(url);
+
+	pthread_mutex_lock(&negcache_mtx);
+	for (uint i = 0; i < NEGCACHE_HOSTS; i++) {
+		if (hosts[i].hash == hhash) {
+			memset(&hosts[i], 0, sizeof(hosts[i]));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&negcache_mtx);
+}
+
+// 取得の失敗を、ホスト側の問題として数えるべきなら true を返す。
+// code は httpclient_connect() の戻り値、error はその時の errno。
+// too_large は大きすぎて断ったか、expired は時間切れになったか。
+// ホスト側の問題とするのは、接続できない (名前解決、TCP、TLS)、
+// 時間切れ、5xx の場合。大きすぎるものや 4xx、URL が不正なものは
+// この URL だけの問題なので、ホストは止めない (同じホストの他の画像は
+// 取得できるはず)。
+bool
+negcache_is_host_failure(int code, int error, bool too_large, bool expired)
+{
+	if (too_large || error == EFBIG) {
+		return false;
+	}
+	if (expired) {
+		return true;
+	}
+	if (code == -1) {
+		return (error != EPROTONOSUPPORT && error != EINVAL);
+	}
+	return (code >= 500);
+}
+
+// 統計情報を *stat にコピーする。
+void
+negcache_get_stat(struct negcache_stat *stat)
+{
+	pthread_mutex_lock(&negcache_mtx);
+	memcpy(stat, &negcache_stat, sizeof(*stat));
+	pthread_mutex_unlock(&negcache_mtx);
+}
+
+// url のホスト部分 ("scheme://" の後ろから次の '/' まで) のハッシュを返す。
+static uint64
+negcache_host_hash(const char *url)
+{
+	char host[256];
+	const char *s;
+	uint len;
+
+	s = strstr(url, "://");
+	s = (s != NULL) ? s + 3 : url;
+	len = strcspn(s, "/?#");
+	len = MIN(len, sizeof(host) - 1);
+	memcpy(host, s, len);
+	host[len] = '\0';
+
+	return hash_fnv1a64(host);
+}
+
+// 現在時刻 (CLOCK_MONOTONIC) を秒で返す。
+static uint64
+negcache_now_sec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
@@ -31,6 +31,9 @@
 #include "common.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
@@ -60,12 +63,17 @@ struct net {
 
 	int sock;
 #if defined(HAVE_OPENSSL)
-	SSL_CTX *ctx;
 	SSL *ssl;
+	char *sess_key;		// セッションキャッシュのキー
 #endif
 
 	const struct diag *diag;
 
+	// 受信の期限 (CLOCK_MONOTONIC [usec])。0 なら期限なし。
+	// 期限があれば受信のたびにソケットの SO_RCVTIMEO を残り時間にする。
+	uint64 deadline_usec;
+	bool rcvtimeo;			// SO_RCVTIMEO を設定してある
+
 	// 行単位受信用の受信バッファ。
 	// バッファにあればこちらから優先して読み出す。
 	// バッファが空で行単位受信でない場合はここを経由しなくてよい。
@@ -74,6 +82,7 @@ struct net {
 	char buf[1024];
 };
 
+static bool net_apply_deadline(struct net *);
 static void sock_cleanup(struct net *);
 static int  sock_connect(struct net *, const char *, const char *,
 	const struct net_opt *);
@@ -87,11 +96,83 @@ static int  tls_connect(struct net *, const char *, const char *,
 	const struct net_opt *);
 static int  tls_read(struct net *, void *, int);
 static int  tls_write(struct net *, const void *, int);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+static long tls_bio_cb(BIO *, int, const char *, size_t, int, long, int,
+	size_t *);
+#endif
 static void tls_shutdown_half(struct net *);
 static void tls_close(struct net *);
+static void tls_init(void);
+static SSL_CTX *tls_get_ctx(bool);
+static int  tls_new_session_cb(SSL *, SSL_SESSION *);
+static SSL_SESSION *tls_session_get(const char *);
+
+// SSL_CTX はプロセスで共有する。
+// [0] が通常用、[1] が --ciphers=RSA 用。
+static SSL_CTX *tls_ctx[2];
+static pthread_once_t tls_once = PTHREAD_ONCE_INIT;
+static int tls_ex_index = -1;
+
+// クライアント側のセッションキャッシュ。
+// 接続先 (とオプション) ごとに最新のセッションを1つだけ覚えておき、
+// 次回の接続でセッション再開 (resumption) に使う。
+struct tls_session {
+	char *key;
+	SSL_SESSION *sess;
+};
+#define TLS_SESSION_MAX	(16)
+static struct tls_session tls_sessions[TLS_SESSION_MAX];
+static uint tls_session_next;	// 次に上書きする位置
+static pthread_mutex_t tls_session_mtx = PTHREAD_MUTEX_INITIALIZER;
 #endif
-static int  socket_connect(const char *, const char *, const struct net_opt *);
+static pthread_mutex_t net_stat_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct net_stat net_stat;
+static int  socket_connect(const char *, const char *, const struct net_opt *,
+	const struct diag *);
 static int  socket_setblock(int, bool);
+static uint he_sort_addrs(const struct addrinfo *, const struct addrinfo **,
+	uint);
+static int  dns_lookup(const char *, const char *, int, uint64,
+	const struct diag *, struct addrinfo **);
+static void *dns_thread(void *);
+static struct addrinfo *dns_copy_addrinfo(const struct addrinfo *);
+static void dns_free_addrinfo(struct addrinfo *);
+
+// Happy Eyeballs の接続試行の間隔と、試すアドレスの最大数。
+#define HE_ATTEMPT_DELAY_MSEC	(250)
+#define HE_MAX_ADDRS			(16)
+
+// 名前解決のキャッシュ。
+// getaddrinfo(3) は TTL を返してくれないので、有効期限は固定。
+// 見付からなかった (NXDOMAIN など) という結果も短時間だけ覚えておく。
+// 画像の取得先は連合先の任意のホストなので、エントリ数には上限を設け、
+// 追加する時に期限切れのものを捨てる。それでも一杯なら期限が一番近い
+// ものを捨てる。解決中か結果を待っている人がいるエントリは捨てない。
+struct dns_entry {
+	struct dns_entry *next;
+	char *host;
+	char *serv;
+	int family;				// PF_INET, PF_INET6, PF_UNSPEC
+	bool resolving;			// 解決中
+	uint waiters;			// 結果を待っているスレッド数
+	int error;				// getaddrinfo() の戻り値
+	struct addrinfo *ai;	// 結果 (error == 0 の時のみ)
+	uint64 expire_msec;		// 有効期限 (CLOCK_MONOTONIC)
+};
+#define DNS_TTL_MSEC			(300 * 1000)
+#define DNS_NEGATIVE_TTL_MSEC	(30 * 1000)
+#if defined(SLOW_ARCH)
+#define DNS_MAX_ENTRIES			(16)
+#else
+#define DNS_MAX_ENTRIES			(64)
+#endif
+static struct dns_entry *dns_head;
+static uint dns_count;
+static pthread_mutex_t dns_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cv = PTHREAD_COND_INITIALIZER;
+
+static void dns_make_room(uint64);
+static void dns_entry_free(struct dns_entry *);
 
 //
 // URL パーサ
@@ -276,6 +357,8 @@ net_opt_init(struct net_opt *opt)
 	opt->address_family = 0;
 	opt->use_rsa_only = false;
 	opt->timeout_msec = 0;
+	opt->deadline_msec = 0;
+	opt->max_length = 0;
 }
 
 // net コンテキストを作成する。
@@ -425,10 +508,72 @@ net_read(struct net *net, void *dst, uint dstsize)
 		return copylen;
 	}
 
+	if (net->deadline_usec != 0 && net_apply_deadline(net) == false) {
+		return -1;
+	}
 	int n = net->f_read(net, dst, dstsize);
+	if (n < 0 && net->deadline_usec != 0 && errno == EAGAIN) {
+		// SO_RCVTIMEO による中断 (EWOULDBLOCK も同値)。
+		Debug(diag, "%s: deadline exceeded while reading", __func__);
+		pthread_mutex_lock(&net_stat_mtx);
+		net_stat.read_timeout++;
+		pthread_mutex_unlock(&net_stat_mtx);
+		errno = ETIMEDOUT;
+	}
 	return n;
 }
 
+// 受信の期限を CLOCK_MONOTONIC の usec で設定する。0 なら期限をなくす。
+// 期限を過ぎると net_read() は ETIMEDOUT で -1 を返す。
+// 接続前に設定しておけば TLS のハンドシェイクにも適用される。
+void
+net_set_deadline(struct net *net, uint64 deadline_usec)
+{
+	assert(net);
+
+	net->deadline_usec = deadline_usec;
+	if (deadline_usec == 0 && net->rcvtimeo) {
+		struct timeval tv;
+		memset(&tv, 0, sizeof(tv));
+		setsockopt(net->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		net->rcvtimeo = false;
+	}
+}
+
+// 受信の期限までの残り時間をソケットの受信タイムアウトに設定する。
+// すでに期限を過ぎていれば errno を ETIMEDOUT にして false を返す。
+static bool
+net_apply_deadline(struct net *net)
+{
+	struct timespec now;
+	struct timeval tv;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64 now_usec = timespec_to_usec(&now);
+	if (now_usec >= net->deadline_usec) {
+		Debug(net->diag, "%s: deadline exceeded", __func__);
+		pthread_mutex_lock(&net_stat_mtx);
+		net_stat.read_timeout++;
+		pthread_mutex_unlock(&net_stat_mtx);
+		errno = ETIMEDOUT;
+		return false;
+	}
+	if (net->sock < 0) {
+		return true;
+	}
+
+	uint64 remain_usec = net->deadline_usec - now_usec;
+	tv.tv_sec  = remain_usec / 1000000;
+	tv.tv_usec = remain_usec % 1000000;
+	if (setsockopt(net->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		Debug(net->diag, "%s: setsockopt(SO_RCVTIMEO): %s", __func__,
+			strerrno());
+		return false;
+	}
+	net->rcvtimeo = true;
+	return true;
+}
+
 int
 net_write(struct net *net, const void *src, uint srcsize)
 {
@@ -452,6 +597,62 @@ net_close(struct net *net)
 	net->f_close(net);
 }
 
+// 接続が再利用できる状態なら true を返す。
+// 受信バッファに読み残しがなく、ソケットに何も届いていない (EOF も
+// 届いていない) ことを調べる。
+bool
+net_is_idle(const struct net *net)
+{
+	struct pollfd pfd;
+
+	assert(net);
+
+	if (net->sock < 0 || net->bufpos != net->buflen) {
+		return false;
+	}
+#if defined(HAVE_OPENSSL)
+	if (net->ssl && SSL_pending(net->ssl) > 0) {
+		return false;
+	}
+#endif
+
+	pfd.fd = net->sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) != 0) {
+		return false;
+	}
+	return true;
+}
+
+// ソケットを待たずに読み出せるデータがあれば true を返す。
+// 受信バッファの読み残しと、TLS 層が復号済みで抱えている分を調べる。
+// これらはソケットの select(2) では検出できない。
+bool
+net_pending(const struct net *net)
+{
+	assert(net);
+
+	if (net->bufpos != net->buflen) {
+		return true;
+	}
+#if defined(HAVE_OPENSSL)
+	if (net->ssl && SSL_pending(net->ssl) > 0) {
+		return true;
+	}
+#endif
+	return false;
+}
+
+// 統計情報を *stat にコピーする。
+void
+net_get_stat(struct net_stat *stat)
+{
+	pthread_mutex_lock(&net_stat_mtx);
+	memcpy(stat, &net_stat, sizeof(*stat));
+	pthread_mutex_unlock(&net_stat_mtx);
+}
+
 // 生ソケットを取得する。
 int
 net_get_fd(const struct net *net)
@@ -472,7 +673,7 @@ sock_connect(struct net *net, const char *host, const char *serv,
 	struct timespec start, end;
 
 	clock_gettime(CLOCK_MONOTONIC, &start);
-	net->sock = socket_connect(host, serv, opt);
+	net->sock = socket_connect(host, serv, opt, net->diag);
 	if (net->sock < 0) {
 		return -1;
 	}
@@ -523,53 +724,178 @@ sock_cleanup(struct net *net)
 // TLS
 //
 
-// 失敗すると errno をセットして -1 を返す仕様だが、
-// OpenSSL のライブラリが何を返すかいまいち分からない。orz
-static int
-tls_connect(struct net *net, const char *host, const char *serv,
-	const struct net_opt *opt)
+// OpenSSL の初期化。一度だけ呼ばれる。
+static void
+tls_init(void)
 {
-	struct timespec start, end;
-	const struct diag *diag = net->diag;
+	SSL_load_error_strings();
+	SSL_library_init();
+
+	// SSL から net を引くため。
+	tls_ex_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+// 共有の SSL_CTX を返す。なければ作成する。
+// rsa_only なら --ciphers=RSA 用のものを返す。
+// 作成できなければ NULL を返す。
+static SSL_CTX *
+tls_get_ctx(bool rsa_only)
+{
+	static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+	SSL_CTX *ctx;
 	int r;
 
-	static bool initialized = false;
-	if (initialized == false) {
-		SSL_load_error_strings();
-		SSL_library_init();
-		initialized = true;
+	pthread_once(&tls_once, tls_init);
+
+	pthread_mutex_lock(&mtx);
+	ctx = tls_ctx[rsa_only];
+	if (ctx) {
+		goto done;
 	}
 
-	net->ctx = SSL_CTX_new(TLS_client_method());
-	if (net->ctx == NULL) {
-		Debug(diag, "%s: SSL_CTX_new failed", __func__);
-		return -1;
+	ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == NULL) {
+		goto done;
 	}
 
 	// SSL_read/write() の WANT_READ/WRITE を向こうで処理してもらう。
-	SSL_CTX_set_mode(net->ctx, SSL_MODE_AUTO_RETRY);
+	SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
+
+	// セッションは自前で接続先ごとに覚えておく。
+	// (OpenSSL 内部のキャッシュはクライアント側では引いてくれない)
+	SSL_CTX_set_session_cache_mode(ctx,
+		SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_new_session_cb);
 
-	if (opt->use_rsa_only) {
+	if (rsa_only) {
 		// RSA 指定なら TLSv1.2 以下を強制する。
 		// (TLSv1.3 ではそもそも RSA128-SHA とかの指定自体が存在しない)
-		SSL_CTX_set_max_proto_version(net->ctx, TLS1_2_VERSION);
+		SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
 
-		r = SSL_CTX_set_cipher_list(net->ctx, "AES128-SHA");
+		r = SSL_CTX_set_cipher_list(ctx, "AES128-SHA");
 		if (r != 1) {
 			ERR_print_errors_fp(stderr);
-			return -1;
+			SSL_CTX_free(ctx);
+			ctx = NULL;
+			goto done;
+		}
+	}
+	tls_ctx[rsa_only] = ctx;
+
+ done:
+	pthread_mutex_unlock(&mtx);
+	return ctx;
+}
+
+// 新しいセッションが出来た時に OpenSSL から呼ばれる。
+// TLSv1.3 ではハンドシェイク後に届くセッションチケットごとに呼ばれる。
+// 接続先ごとに最新のものだけを覚えておく。
+// 1 を返すとセッションの参照はこちらが持つことになる。
+static int
+tls_new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	const struct net *net = SSL_get_ex_data(ssl, tls_ex_index);
+	struct tls_session *ts;
+	SSL_SESSION *old = NULL;
+
+	if (net == NULL || net->sess_key == NULL) {
+		return 0;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (SSL_SESSION_is_resumable(sess) == 0) {
+		return 0;
+	}
+#endif
+
+	pthread_mutex_lock(&tls_session_mtx);
+	ts = NULL;
+	for (uint i = 0; i < countof(tls_sessions); i++) {
+		if (tls_sessions[i].key &&
+			strcmp(tls_sessions[i].key, net->sess_key) == 0)
+		{
+			ts = &tls_sessions[i];
+			break;
 		}
 	}
+	if (ts == NULL) {
+		// なければ古いほうから順に上書き。
+		ts = &tls_sessions[tls_session_next];
+		tls_session_next = (tls_session_next + 1) % countof(tls_sessions);
+		free(ts->key);
+		ts->key = strdup(net->sess_key);
+	}
+	old = ts->sess;
+	ts->sess = sess;
+	pthread_mutex_unlock(&tls_session_mtx);
 
-	net->ssl = SSL_new(net->ctx);
+	if (old) {
+		SSL_SESSION_free(old);
+	}
+	Trace(net->diag, "%s: session saved for %s", __func__, net->sess_key);
+	return 1;
+}
+
+// key に対応するセッションがあれば参照を増やして返す。
+// 返されたセッションは SSL_SESSION_free() すること。
+// なければ NULL を返す。
+static SSL_SESSION *
+tls_session_get(const char *key)
+{
+	SSL_SESSION *sess = NULL;
+
+	pthread_mutex_lock(&tls_session_mtx);
+	for (uint i = 0; i < countof(tls_sessions); i++) {
+		if (tls_sessions[i].key && strcmp(tls_sessions[i].key, key) == 0) {
+			sess = tls_sessions[i].sess;
+			if (sess) {
+				SSL_SESSION_up_ref(sess);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tls_session_mtx);
+
+	return sess;
+}
+
+// 失敗すると errno をセットして -1 を返す仕様だが、
+// OpenSSL のライブラリが何を返すかいまいち分からない。orz
+static int
+tls_connect(struct net *net, const char *host, const char *serv,
+	const struct net_opt *opt)
+{
+	struct timespec start, end;
+	const struct diag *diag = net->diag;
+	char keybuf[256];
+	int r;
+
+	SSL_CTX *ctx = tls_get_ctx(opt->use_rsa_only);
+	if (ctx == NULL) {
+		Debug(diag, "%s: SSL_CTX_new failed", __func__);
+		return -1;
+	}
+
+	net->ssl = SSL_new(ctx);
 	if (net->ssl == NULL) {
 		Debug(diag, "%s: SSL_new failed", __func__);
 		return -1;
 	}
 
+	// 前回のセッションがあれば再開を試みる。
+	// 暗号スイートの指定が違うと再開できないので、キーに含めておく。
+	snprintf(keybuf, sizeof(keybuf), "%s:%s%s", host, serv,
+		(opt->use_rsa_only ? "/rsa" : ""));
+	net->sess_key = strdup(keybuf);
+	SSL_set_ex_data(net->ssl, tls_ex_index, net);
+	SSL_SESSION *prev = tls_session_get(keybuf);
+	if (prev) {
+		SSL_set_session(net->ssl, prev);
+		SSL_SESSION_free(prev);
+	}
+
 	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	net->sock = socket_connect(host, serv, opt);
+	net->sock = socket_connect(host, serv, opt, net->diag);
 	if (net->sock == -1) {
 		Debug(diag, "%s: %s:%s failed: %s", __func__, host, serv, strerrno());
 		return -1;
@@ -581,17 +907,40 @@ tls_connect(struct net *net, const char *host, const char *serv,
 		return -1;
 	}
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	// SSL_read() や SSL_connect() の中で recv(2) するたびに期限を適用する。
+	BIO *rbio = SSL_get_rbio(net->ssl);
+	BIO_set_callback_ex(rbio, tls_bio_cb);
+	BIO_set_callback_arg(rbio, (char *)net);
+#endif
+
 	r = SSL_set_tlsext_host_name(net->ssl, UNCONST(host));
 	if (r != 1) {
 		ERR_print_errors_fp(stderr);
 		return -1;
 	}
 
+	// ハンドシェイクの受信にも期限を適用する。
+	if (net->deadline_usec != 0 && net_apply_deadline(net) == false) {
+		return -1;
+	}
 	if (SSL_connect(net->ssl) < 1) {
 		Debug(diag, "%s: SSL_connect failed", __func__);
+		if (net->deadline_usec != 0 && errno == EAGAIN) {
+			errno = ETIMEDOUT;
+		}
 		return -1;
 	}
 
+	bool resumed = SSL_session_reused(net->ssl);
+	pthread_mutex_lock(&net_stat_mtx);
+	if (resumed) {
+		net_stat.tls_resumed++;
+	} else {
+		net_stat.tls_full++;
+	}
+	pthread_mutex_unlock(&net_stat_mtx);
+
 	// 接続できたらログ。
 	if (__predict_false(diag_get_level(diag) >= 1)) {
 		clock_gettime(CLOCK_MONOTONIC, &end);
@@ -616,12 +965,36 @@ tls_connect(struct net *net, const char *host, const char *serv,
 		const char *cipher_name = SSL_CIPHER_get_name(ssl_cipher);
 
 		uint32 msec = timespec_to_msec(&end) - timespec_to_msec(&start);
-		diag_print(diag, "Connected %s %s (%u msec)", ver, cipher_name, msec);
+		diag_print(diag, "Connected %s %s %s (%u msec)", ver, cipher_name,
+			(resumed ? "resumed" : "full"), msec);
 	}
 
 	return 0;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+// ソケット BIO の操作の前後に OpenSSL から呼ばれる。
+// SSL_MODE_AUTO_RETRY では SSL_read() 1回の中で recv(2) が何度も呼ばれ
+// うるので、SSL_read() の前に一度 SO_RCVTIMEO を設定するだけでは、少しずつ
+// 届く相手に対してそのたびに残り時間をまるごと待ってしまう。
+// そのため recv(2) の直前ごとに残り時間を設定し直す。
+// 期限を過ぎていれば (errno を ETIMEDOUT にして) 読み込みを失敗させる。
+static long
+tls_bio_cb(BIO *bio, int oper, const char *argp, size_t len, int argi,
+	long argl, int ret, size_t *processed)
+{
+	if (oper == BIO_CB_READ) {
+		struct net *net = (struct net *)BIO_get_callback_arg(bio);
+		if (net && net->deadline_usec != 0 &&
+			net_apply_deadline(net) == false)
+		{
+			return -1;
+		}
+	}
+	return ret;
+}
+#endif
+
 static int
 tls_read(struct net *net, void *dst, int dstsize)
 {
@@ -639,7 +1012,10 @@ tls_read(struct net *net, void *dst, int dstsize)
 		}
 		Verbose(diag, "%s r=%zd, SSL_error=%d errno=%d", __func__,
 			r, error, errno);
-		if (error != SSL_ERROR_SYSCALL) {
+		if (error == SSL_ERROR_WANT_READ) {
+			// SO_RCVTIMEO による中断。
+			errno = EAGAIN;
+		} else if (error != SSL_ERROR_SYSCALL) {
 			// とりあえず何かにしておく。
 			errno = EIO;
 		}
@@ -704,10 +1080,8 @@ tls_cleanup(struct net *net)
 		SSL_free(net->ssl);
 		net->ssl = NULL;
 	}
-	if (net->ctx) {
-		SSL_CTX_free(net->ctx);
-		net->ctx = NULL;
-	}
+	free(net->sess_key);
+	net->sess_key = NULL;
 }
 
 #endif // HAVE_OPENSSL
@@ -716,106 +1090,164 @@ tls_cleanup(struct net *net)
 // 下請け。
 // hostname:servname に TCP で接続しそのソケットを返す。
 // 失敗すれば errno をセットして -1 を返す。
+//
+// 複数のアドレスがある場合は Happy Eyeballs (RFC 8305) の要領で、
+// IPv6/IPv4 を交互に並べ、前の接続試行の完了を待たずに
+// HE_ATTEMPT_DELAY_MSEC ごとに次の試行を開始する
+// (前の試行が失敗すればすぐに次を開始する)。
+// 最初に接続できたものを採用し、残りは閉じる。
 static int
 socket_connect(const char *hostname, const char *servname,
-	const struct net_opt *opt)
+	const struct net_opt *opt, const struct diag *diag)
 {
-	struct timeval tv;
-	struct timeval *tvp;
+	const struct addrinfo *addrs[HE_MAX_ADDRS];
+	struct pollfd pfds[HE_MAX_ADDRS];
+	uint attempt[HE_MAX_ADDRS];	// pfds[i] が何番目のアドレスか
 	struct timespec now;
-	struct addrinfo hints;
-	struct addrinfo *ai;
 	struct addrinfo *ailist;
+	uint64 now_usec;
 	uint64 end_usec = 0;
-	fd_set wfds;
+	uint64 next_usec = 0;
+	uint naddrs;
+	uint next;			// 次に試すアドレス
+	uint npfds;
+	uint active;		// 接続試行中の数
+	int last_errno;
 	int fd;
-	int r;
 
-	if (__predict_false(opt->timeout_msec == 0)) {
-		tvp = NULL;
-	} else {
-		tvp = &tv;
+	if (opt->timeout_msec != 0) {
 		clock_gettime(CLOCK_MONOTONIC, &now);
 		end_usec = timespec_to_usec(&now) + (opt->timeout_msec * 1000);
 	}
 
-	memset(&hints, 0, sizeof(hints));
+	int family;
 	switch (opt->address_family) {
 	 case 4:
-		hints.ai_family = PF_INET;
+		family = PF_INET;
 		break;
 	 case 6:
-		hints.ai_family = PF_INET6;
+		family = PF_INET6;
 		break;
 	 default:
-		hints.ai_family = PF_UNSPEC;
+		family = PF_UNSPEC;
 		break;
 	}
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
 
-	if (getaddrinfo(hostname, servname, &hints, &ailist) != 0) {
+	// 名前解決もタイムアウトに含める。
+	if (dns_lookup(hostname, servname, family, end_usec, diag, &ailist) != 0) {
 		return -1;
 	}
+	naddrs = he_sort_addrs(ailist, addrs, countof(addrs));
 
 	fd = -1;
-	for (ai = ailist; ai != NULL; ai = ai->ai_next) {
-		int val;
-		socklen_t vallen = sizeof(val);
+	next = 0;
+	npfds = 0;
+	active = 0;
+	last_errno = ECONNREFUSED;
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		now_usec = timespec_to_usec(&now);
+		if (end_usec != 0 && now_usec >= end_usec) {
+			last_errno = ETIMEDOUT;
+			break;
+		}
 
-		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (fd < 0) {
+		// 次の試行を開始する時刻か、試行中のものがなければ開始。
+		if (next < naddrs && (active == 0 || now_usec >= next_usec)) {
+			const struct addrinfo *ai = addrs[next++];
+			int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (s < 0) {
+				last_errno = errno;
+				continue;
+			}
+			// ノンブロッキングなので connect() は EINPROGRESS を返す。
+			if (socket_setblock(s, false) < 0) {
+				last_errno = errno;
+				close(s);
+				continue;
+			}
+			if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0) {
+				fd = s;
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				last_errno = errno;
+				close(s);
+				continue;
+			}
+			Trace(diag, "%s: attempt #%u started", __func__, next);
+			pfds[npfds].fd = s;
+			pfds[npfds].events = POLLOUT;
+			pfds[npfds].revents = 0;
+			attempt[npfds] = next;
+			npfds++;
+			active++;
+			next_usec = now_usec + HE_ATTEMPT_DELAY_MSEC * 1000;
 			continue;
 		}
-
-		// ここでノンブロックに設定。
-		if (socket_setblock(fd, false) < 0) {
-			goto abort_continue;
+		if (active == 0) {
+			// すべて失敗した。
+			break;
 		}
 
-		// ノンブロッキングなので connect() は EINPROGRESS を返す。
-		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
-			break;
+		// 次の試行開始か、全体のタイムアウトまで待つ。
+		int timeout = -1;
+		if (next < naddrs) {
+			timeout = (next_usec - now_usec + 999) / 1000;
 		}
-		if (errno != EINPROGRESS) {
-			goto abort_continue;
+		if (end_usec != 0) {
+			int t = (end_usec - now_usec + 999) / 1000;
+			if (timeout < 0 || t < timeout) {
+				timeout = t;
+			}
 		}
-
-		if (tvp != NULL) {
-			clock_gettime(CLOCK_MONOTONIC, &now);
-			uint64 now_usec = timespec_to_usec(&now);
-			if (now_usec >= end_usec) {
-				errno = ETIMEDOUT;
-				return -1;
+		int r = poll(pfds, npfds, timeout);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
-			uint64 timeout_usec = end_usec - now_usec;
-			tv.tv_sec  = timeout_usec / 1000000;
-			tv.tv_usec = timeout_usec % 1000000;
+			last_errno = errno;
+			break;
 		}
-		FD_ZERO(&wfds);
-		FD_SET(fd, &wfds);
-		r = select(fd + 1, NULL, &wfds, NULL, tvp);
-		if (r <= 0) {
-			goto abort_continue;
+		for (uint i = 0; i < npfds; i++) {
+			if (pfds[i].fd < 0 || pfds[i].revents == 0) {
+				continue;
+			}
+			int val = -1;
+			socklen_t vallen = sizeof(val);
+			getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &val, &vallen);
+			if (val == 0) {
+				// 接続成功。
+				fd = pfds[i].fd;
+				pfds[i].fd = -1;
+				Trace(diag, "%s: attempt #%u won (of %u)", __func__,
+					attempt[i], naddrs);
+				break;
+			}
+			// この試行は失敗したので、すぐに次を開始する。
+			Trace(diag, "%s: attempt #%u failed: %s", __func__,
+				attempt[i], strerror(val));
+			last_errno = val;
+			close(pfds[i].fd);
+			pfds[i].fd = -1;
+			active--;
+			next_usec = now_usec;
 		}
-
-		val = -1;
-		getsockopt(fd, SOL_SOCKET, SO_ERROR, &val, &vallen);
-		if (val != 0) {
-			goto abort_continue;
+		if (fd >= 0) {
+			break;
 		}
+	}
 
-		// ここまで来れば接続成功。
-		break;
-
- abort_continue:
-		close(fd);
-		fd = -1;
+	// 残りの試行は取り消す。
+	for (uint i = 0; i < npfds; i++) {
+		if (pfds[i].fd >= 0) {
+			close(pfds[i].fd);
+		}
 	}
-	freeaddrinfo(ailist);
+	dns_free_addrinfo(ailist);
 
-	// 一応。
 	if (fd < 0) {
+		errno = last_errno;
 		return -1;
 	}
 
@@ -828,6 +1260,50 @@ socket_connect(const char *hostname, const char *servname,
 	return fd;
 }
 
+// 下請け。
+// ailist のアドレスを接続を試す順に並べて addrs[] に最大 size 個返す。
+// getaddrinfo() が返す順序 (RFC 6724) の先頭のアドレスファミリから始めて、
+// 異なるアドレスファミリを交互に並べる (RFC 8305 4章)。
+// 戻り値は addrs[] に格納した個数。
+static uint
+he_sort_addrs(const struct addrinfo *ailist, const struct addrinfo **addrs,
+	uint size)
+{
+	const struct addrinfo *first[2];	// [0] が先頭のファミリ、[1] がそれ以外
+	const struct addrinfo *ai;
+	uint n = 0;
+
+	if (ailist == NULL) {
+		return 0;
+	}
+
+	first[0] = ailist;
+	first[1] = NULL;
+	for (ai = ailist; ai; ai = ai->ai_next) {
+		if (ai->ai_family != ailist->ai_family) {
+			first[1] = ai;
+			break;
+		}
+	}
+
+	// 各ファミリのリストを交互に辿る。
+	for (uint turn = 0; n < size && (first[0] || first[1]); turn ^= 1) {
+		ai = first[turn];
+		if (ai == NULL) {
+			continue;
+		}
+		addrs[n++] = ai;
+		// 同じ側の次のアドレスを探す。
+		for (ai = ai->ai_next; ai; ai = ai->ai_next) {
+			if ((ai->ai_family == ailist->ai_family) == (turn == 0)) {
+				break;
+			}
+		}
+		first[turn] = ai;
+	}
+	return n;
+}
+
 // 下請け。
 // ソケット fd のブロッキングモードを変更する。
 // blocking = true ならブロッキングモード、
@@ -855,3 +1331,284 @@ socket_setblock(int fd, bool blocking)
 
 	return 0;
 }
+
+
+//
+// 名前解決
+//
+
+// hostname:servname を名前解決して、結果を *resp に返す。
+// family は PF_INET, PF_INET6, PF_UNSPEC のいずれか。
+// 成功すれば 0 を返す。*resp は dns_free_addrinfo() で解放すること。
+// 失敗すれば errno をセットして -1 を返す。
+// end_usec (CLOCK_MONOTONIC) が 0 でなければ、その時刻までに解決
+// できなければ ETIMEDOUT で諦める。解決自体は裏で続けるので、
+// 結果はキャッシュされて次回以降に使われる。
+static int
+dns_lookup(const char *hostname, const char *servname, int family,
+	uint64 end_usec, const struct diag *diag, struct addrinfo **resp)
+{
+	struct dns_entry *e;
+	struct timespec now;
+	uint64 now_msec;
+	int rv = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_msec = timespec_to_msec(&now);
+
+	pthread_mutex_lock(&dns_mtx);
+
+	for (e = dns_head; e; e = e->next) {
+		if (e->family == family &&
+			strcmp(e->host, hostname) == 0 &&
+			strcmp(e->serv, servname) == 0)
+		{
+			break;
+		}
+	}
+
+	if (e && e->resolving == false && now_msec < e->expire_msec) {
+		// キャッシュが有効。
+		pthread_mutex_lock(&net_stat_mtx);
+		if (e->error == 0) {
+			net_stat.dns_hit++;
+		} else {
+			net_stat.dns_negative++;
+		}
+		pthread_mutex_unlock(&net_stat_mtx);
+		Trace(diag, "%s: %s:%s cache hit%s", __func__, hostname, servname,
+			(e->error == 0 ? "" : " (negative)"));
+	} else {
+		if (e == NULL) {
+			// 一杯なら空ける。空けられなくても (全部使用中なら)
+			// 使用中のものは長くは残らないので、一時的に超えてもよい。
+			if (dns_count >= DNS_MAX_ENTRIES) {
+				dns_make_room(now_msec);
+			}
+			e = calloc(1, sizeof(*e));
+			if (e == NULL) {
+				goto done;
+			}
+			e->host = strdup(hostname);
+			e->serv = strdup(servname);
+			if (e->host == NULL || e->serv == NULL) {
+				free(e->host);
+				free(e->serv);
+				free(e);
+				goto done;
+			}
+			e->family = family;
+			e->next = dns_head;
+			dns_head = e;
+			dns_count++;
+		}
+		if (e->resolving == false) {
+			// 解決用のスレッドを起こす。
+			// シグナルは呼び出し元のスレッドで受けたいのですべてブロック。
+			pthread_mutex_lock(&net_stat_mtx);
+			net_stat.dns_miss++;
+			pthread_mutex_unlock(&net_stat_mtx);
+			Trace(diag, "%s: %s:%s cache miss", __func__, hostname, servname);
+
+			sigset_t newmask;
+			sigset_t oldmask;
+			pthread_t th;
+			sigfillset(&newmask);
+			pthread_sigmask(SIG_SETMASK, &newmask, &oldmask);
+			e->resolving = true;
+			int r = pthread_create(&th, NULL, dns_thread, e);
+			pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+			if (r != 0) {
+				e->resolving = false;
+				errno = r;
+				goto done;
+			}
+			pthread_detach(th);
+		} else {
+			// 他のスレッドが解決中なのでその結果を待つ。
+			Trace(diag, "%s: %s:%s waiting for another lookup", __func__,
+				hostname, servname);
+		}
+
+		// 解決を待つ。待っている間は e を捨てられないようにしておく。
+		e->waiters++;
+		while (e->resolving) {
+			if (end_usec == 0) {
+				pthread_cond_wait(&dns_cv, &dns_mtx);
+			} else {
+				struct timespec abstime;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				uint64 now_usec = timespec_to_usec(&now);
+				if (now_usec >= end_usec) {
+					break;
+				}
+				// pthread_cond_timedwait() は CLOCK_REALTIME。
+				uint64 wait_usec = end_usec - now_usec;
+				clock_gettime(CLOCK_REALTIME, &abstime);
+				abstime.tv_sec  += wait_usec / 1000000;
+				abstime.tv_nsec += (wait_usec % 1000000) * 1000;
+				if (abstime.tv_nsec >= 1000000000) {
+					abstime.tv_sec++;
+					abstime.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&dns_cv, &dns_mtx, &abstime);
+			}
+		}
+		e->waiters--;
+		if (e->resolving) {
+			pthread_mutex_lock(&net_stat_mtx);
+			net_stat.dns_timeout++;
+			pthread_mutex_unlock(&net_stat_mtx);
+			Debug(diag, "%s: %s:%s timed out", __func__, hostname, servname);
+			errno = ETIMEDOUT;
+			goto done;
+		}
+	}
+
+	if (e->error != 0) {
+		Debug(diag, "%s: %s:%s: %s", __func__, hostname, servname,
+			gai_strerror(e->error));
+		errno = ENOENT;
+		goto done;
+	}
+	*resp = dns_copy_addrinfo(e->ai);
+	if (*resp == NULL) {
+		goto done;
+	}
+	rv = 0;
+
+ done:
+	pthread_mutex_unlock(&dns_mtx);
+	return rv;
+}
+
+// 名前解決のキャッシュに 1つ空きを作る。
+// 期限切れのエントリをすべて捨て、それでも一杯なら期限が一番近い
+// エントリを捨てる。解決中か待っている人がいるエントリは捨てない。
+// dns_mtx を保持した状態で呼ぶこと。
+static void
+dns_make_room(uint64 now_msec)
+{
+	struct dns_entry **prevp;
+	struct dns_entry **victimp;
+	struct dns_entry *e;
+
+	victimp = NULL;
+	for (prevp = &dns_head; (e = *prevp) != NULL; ) {
+		if (e->resolving || e->waiters != 0) {
+			prevp = &e->next;
+			continue;
+		}
+		if (e->expire_msec <= now_msec) {
+			*prevp = e->next;
+			dns_entry_free(e);
+			continue;
+		}
+		if (victimp == NULL || e->expire_msec < (*victimp)->expire_msec) {
+			victimp = prevp;
+		}
+		prevp = &e->next;
+	}
+
+	if (dns_count >= DNS_MAX_ENTRIES && victimp != NULL) {
+		e = *victimp;
+		*victimp = e->next;
+		dns_entry_free(e);
+	}
+}
+
+// リストから外したエントリ e を解放する。
+// dns_mtx を保持した状態で呼ぶこと。
+static void
+dns_entry_free(struct dns_entry *e)
+{
+	if (e->ai) {
+		freeaddrinfo(e->ai);
+	}
+	free(e->host);
+	free(e->serv);
+	free(e);
+	dns_count--;
+}
+
+// 名前解決スレッド。
+// 結果を e に書き込んで待っている人を起こす。
+// e は解決中は解放されないので、ロックなしで host などを参照してよい。
+static void *
+dns_thread(void *arg)
+{
+	struct dns_entry *e = (struct dns_entry *)arg;
+	struct addrinfo hints;
+	struct addrinfo *ai = NULL;
+	struct timespec now;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = e->family;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	int r = getaddrinfo(e->host, e->serv, &hints, &ai);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64 now_msec = timespec_to_msec(&now);
+
+	pthread_mutex_lock(&dns_mtx);
+	if (e->ai) {
+		freeaddrinfo(e->ai);
+		e->ai = NULL;
+	}
+	e->error = r;
+	if (r == 0) {
+		e->ai = ai;
+		e->expire_msec = now_msec + DNS_TTL_MSEC;
+	} else if (r == EAI_AGAIN || r == EAI_SYSTEM || r == EAI_MEMORY) {
+		// 一時的なエラーは覚えておかない。
+		e->expire_msec = now_msec;
+	} else {
+		e->expire_msec = now_msec + DNS_NEGATIVE_TTL_MSEC;
+	}
+	e->resolving = false;
+	pthread_cond_broadcast(&dns_cv);
+	pthread_mutex_unlock(&dns_mtx);
+
+	return NULL;
+}
+
+// addrinfo のリスト src を複製して返す (ai_canonname は複製しない)。
+// 返したリストは dns_free_addrinfo() で解放すること。
+// 失敗すれば errno をセットして NULL を返す。
+static struct addrinfo *
+dns_copy_addrinfo(const struct addrinfo *src)
+{
+	struct addrinfo *head = NULL;
+	struct addrinfo **tail = &head;
+
+	for (; src; src = src->ai_next) {
+		struct addrinfo *ai = malloc(sizeof(*ai) + src->ai_addrlen);
+		if (ai == NULL) {
+			dns_free_addrinfo(head);
+			return NULL;
+		}
+		memcpy(ai, src, sizeof(*ai));
+		ai->ai_canonname = NULL;
+		ai->ai_addr = (struct sockaddr *)(ai + 1);
+		memcpy(ai->ai_addr, src->ai_addr, src->ai_addrlen);
+		ai->ai_next = NULL;
+		*tail = ai;
+		tail = &ai->ai_next;
+	}
+	if (head == NULL) {
+		errno = ENOENT;
+	}
+	return head;
+}
+
+// dns_copy_addrinfo() で作成したリストを解放する。
+static void
+dns_free_addrinfo(struct addrinfo *ai)
+{
+	while (ai) {
+		struct addrinfo *next = ai->ai_next;
+		free(ai);
+		ai = next;
+	}
+}
@@ -32,9 +32,14 @@
 #include "image.h"
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#if defined(HAVE_BSD_BSD_H)
+#include <bsd/stdio.h>
+#endif
 
 // 色定数
 #define BOLD		"1"
@@ -57,10 +62,118 @@
 // ヘッダの依存関係を減らすため。
 extern struct image_opt imageopt;
 
+// SIXEL キャッシュを画面に出力する時のバッファサイズ。
+#define SIXEL_BUFSIZE	(4096)
+
+// 中間キャッシュ (デコードして縮小した画像) の長辺の上限 [pixel]。
+// 大きいフォントで表示する時の元画像になるので、画像の表示サイズより
+// 大きめにしておく。
+#if defined(SLOW_ARCH)
+#define RAWCACHE_SIZE	(160)
+#else
+#define RAWCACHE_SIZE	(256)
+#endif
+
+// 中間キャッシュのデータの先頭。この後ろに 16bit 内部形式の画素が続く。
+// 幅と高さはキャッシュの索引に記録される。
+struct rawcache_header {
+	uint8 magic[2];		// "R6"
+	uint8 flags;		// RAWCACHE_*
+	uint8 version;		// RAWCACHE_VERSION
+};
+// 1: ローダが縮小してデコードしたものは RAWCACHE_ORIGINAL にしない。
+//    (0 の頃のものは縮小してあっても ORIGINAL のことがあるので使わない)
+#define RAWCACHE_VERSION	(1)
+#define RAWCACHE_HAS_ALPHA	(0x01)	// 透過ピクセルを持つ
+#define RAWCACHE_ORIGINAL	(0x02)	// 縮小していない (元画像と同じ大きさ)
+
+// 圧縮した SIXEL キャッシュ (--compress-cache) のデータの先頭。
+// この後ろに、展開後 SIXEL_PACK_BLOCK バイトずつのブロックが続く。
+// ブロックは互いに独立なので、表示時はブロックごとに展開しながら
+// 出力でき、全体をメモリに展開する必要はない。
+// 圧縮していない SIXEL は ESC で始まるので、先頭で区別できる。
+struct sixel_pack_header {
+	uint8 magic[2];		// "LZ"
+	uint16 reserved;
+	uint32 rawlen;		// 展開後の長さ
+};
+
+// 圧縮した SIXEL キャッシュのブロックの先頭。この後ろに zlen バイトの
+// データが続く。zlen が rawlen と同じなら圧縮せずに置いてある。
+struct sixel_pack_block {
+	uint16 rawlen;		// 展開後の長さ
+	uint16 zlen;		// 圧縮後の長さ
+};
+#define SIXEL_PACK_BLOCK	(4096)
+
+// 圧縮した SIXEL キャッシュを先頭から読み出す状態。
+struct sixel_reader {
+	const struct cache_entry *e;
+	uint pos;			// 次に cache_read() で読む位置
+	uint rawlen;		// 展開後の長さ
+	uint head;			// buf の未処理データの先頭
+	uint tail;			// buf の未処理データの末尾
+	char buf[SIXEL_PACK_BLOCK * 2];
+};
+
+// キャッシュにない画像を、変換しながら画面に出力すると同時に
+// キャッシュ用にも書き出す (tee) ための状態。
+// 画像の大きさは SIXEL の先頭を見るまで分からないので、位置決めは
+// 最初の書き込みの時に行う。
+struct sixel_tee {
+	FILE *cfp;			// キャッシュ用の出力先
+	int index;			// show_image() の index
+	const char *real_file;	// show_image_common() の real_file
+	uint sx_width;		// SIXEL の大きさ (started の時のみ有効)
+	uint sx_height;
+	uint rows;			// この画像が占める文字数 (started の時のみ有効)
+	uint cols;
+	bool started;		// 画面に出力し始めたか
+	bool aborted;		// 出力し始めた後で変換に失敗したか
+	bool nocache;		// キャッシュ用の書き出しに失敗したか
+};
+
+// 遅延表示の画像枠。
+// 仮の画像を表示した位置を覚えておき、本来の画像の準備が出来たら
+// 同じ位置に上書きする。
+struct image_slot {
+	struct image_slot *next;
+
+	char *img_file;		// 本来の画像のキャッシュファイル名
+
+	uint64 row;			// 上端の行 (cursor_row での値)
+	uint col;			// 左端の桁
+	uint rows;			// 枠の行数
+	uint cols;			// 枠の桁数
+	uint screen_cols;	// 作成時の画面の大きさ
+	uint screen_rows;
+};
+
 static void make_esc(char *, const char *);
 static inline void make_indent(char *, int);
 static uint get_eaw_width(unichar c);
+static bool make_image_cache_common(const char *, const char *, uint, uint,
+	bool, struct sixel_tee *);
+static int  sixel_tee_write(void *, const char *, int);
+static void image_layout(uint, uint, int, const char *, uint *, uint *);
+static void image_layout_done(int, uint, uint);
+static bool show_image_common(const char *, const char *, uint, uint, bool,
+	int, const char *);
+static bool sixel_get_size(const char *, uint, uint *, uint *);
+static bool sixel_copy(const struct cache_entry *);
+static char *sixel_load(const struct cache_entry *, uint *);
+static char *sixel_pack(const char *, uint, uint *);
+static bool sixel_reader_init(struct sixel_reader *, const struct cache_entry *,
+	const char *, uint);
+static int  sixel_reader_read(struct sixel_reader *, char *);
+static bool sixel_reader_fill(struct sixel_reader *, uint);
+static void image_slot_add(const char *, uint, uint, uint);
+static int  image_slot_paint1(struct image_slot *);
+static void image_slot_free(struct image_slot *);
 static bool fetch_image(FILE *, const char *, uint, uint, bool);
+static string *rawcache_key(const char *);
+static struct image *rawcache_load(const char *, uint, uint);
+static void rawcache_save(const char *, const struct image *);
 
 uint image_count;				// この列に表示している画像の数
 uint image_next_cols;			// この列で次に表示する画像の位置(桁数)
@@ -71,6 +184,14 @@ uint opt_eaw_a;					// Ambiguous 文字の文字幅
 uint opt_eaw_n;					// Neutral 文字の文字幅
 bool opt_mathalpha;				// Mathematical AlphaNumeric を全角英数字に変換
 bool opt_nocombine;				// Combining Enclosing Keycap を合成しない
+bool opt_defer_image;			// 画像を遅延表示する
+uint64 cursor_row;				// カーソルのある行の通し番号
+static uint64 bottom_row;		// これまでに到達した一番下の行の通し番号
+static struct image_slot *slot_head;	// 遅延表示の画像枠のリスト
+
+// SIXEL キャッシュの圧縮の統計情報。ワーカーからも更新される。
+static pthread_mutex_t pack_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct sixel_pack_stat pack_stat;
 
 #define S2EBUFSIZE	(16)
 static char style2esc[STYLE_MAX][S2EBUFSIZE];
@@ -437,7 +558,16 @@ iprint(const ustring *src)
 	// 出力文字コードに変換。
 	string *outstr = ustring_to_string(utext2);
 	if (outstr) {
-		fputs(string_get(outstr), stdout);
+		const char *p = string_get(outstr);
+		fputs(p, stdout);
+		// 遅延表示のために改行を数えておく。
+		int lines = 0;
+		for (; *p; p++) {
+			if (*p == '\n') {
+				lines++;
+			}
+		}
+		cursor_moved(lines);
 		string_free(outstr);
 	}
 
@@ -484,6 +614,156 @@ get_eaw_width(unichar c)
 	}
 }
 
+// img_url から画像を取得して SIXEL に変換し、キャッシュに保存する。
+// img_file はキャッシュのキー (かつてのキャッシュファイル名)。
+// 引数は show_image() と同じ。画面には何も出力しない。
+// 表示スレッド以外 (fetchpool のワーカー) からも呼ばれる。
+// 保存できれば true を返す。
+// 失敗すればキャッシュには何も残さず、false を返す。
+bool
+make_image_cache(const char *img_file, const char *img_url,
+	uint width, uint height, bool shade)
+{
+	return make_image_cache_common(img_file, img_url, width, height, shade,
+		NULL);
+}
+
+// make_image_cache() の本体。
+// tee が NULL でなければ、変換しながら画面にも出力する (表示スレッドのみ)。
+// この場合、画面に出力し始めたかどうかは tee->started で分かる。
+// 出力し始めた後で変換に失敗したら、画面の SIXEL は中断して
+// tee->aborted をセットする。
+static bool
+make_image_cache_common(const char *img_file, const char *img_url,
+	uint width, uint height, bool shade, struct sixel_tee *tee)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	char *zbuf = NULL;
+	uint zlen = 0;
+	uint sx_width;
+	uint sx_height;
+	FILE *fp;
+	FILE *ofp;
+	bool rv;
+
+	// 同じキャッシュディレクトリを使う他のプロセスが同じ画像を取得中
+	// なら、終わるまで待ってその結果を使う。
+	if (cache_lock_key(img_url, img_file) == false) {
+		Debug(diag_image, "%s: %s: made by another process", __func__,
+			img_file);
+		return true;
+	}
+
+	// 一旦メモリ上に作ってから、まとめてパックファイルに追記する。
+	fp = open_memstream(&buf, &len);
+	if (fp == NULL) {
+		Debug(diag_image, "%s: open_memstream: %s", __func__, strerrno());
+		cache_unlock_key(img_url);
+		return false;
+	}
+
+	// 画面にも出力するなら、変換したそばから画面とメモリの両方に書き出す。
+	ofp = fp;
+	if (tee) {
+		tee->cfp = fp;
+		ofp = funopen(tee, NULL, sixel_tee_write, NULL, NULL);
+		if (ofp == NULL) {
+			Debug(diag_image, "%s: funopen: %s", __func__, strerrno());
+			fclose(fp);
+			free(buf);
+			cache_unlock_key(img_url);
+			return false;
+		}
+	}
+
+	rv = fetch_image(ofp, img_url, width, height, shade);
+	if (tee) {
+		if (fclose(ofp) != 0) {
+			rv = false;
+		}
+		if (tee->started) {
+			// 途中で失敗したら端末を SIXEL から戻しておく。
+			if (rv == false) {
+				image_sixel_abort(stdout);
+				tee->aborted = true;
+			}
+			in_sixel = false;
+		}
+		if (tee->nocache) {
+			rv = false;
+		}
+	}
+	if (fclose(fp) != 0) {
+		rv = false;
+	}
+	if (rv) {
+		if (sixel_get_size(buf, MIN(len, SIXEL_BUFSIZE), &sx_width, &sx_height)
+			== false)
+		{
+			Debug(diag_image, "%s: %s: could not read size in SIXEL",
+				__func__, img_file);
+			errno = EINVAL;
+			rv = false;
+		} else {
+			// 指定があれば圧縮して置く。小さくならなければそのまま。
+			if (opt_compress_cache) {
+				zbuf = sixel_pack(buf, len, &zlen);
+			}
+			if (cache_put(img_file, (zbuf ? zbuf : buf), (zbuf ? zlen : len),
+				sx_width, sx_height) == false)
+			{
+				Debug(diag_image, "%s: %s: cache_put: %s", __func__,
+					img_file, strerrno());
+				rv = false;
+			}
+			// 表示したのがアイコンなら、読み直さずにメモリ上にも置いておく。
+			if (tee && tee->started && tee->index < 0) {
+				hotcache_put(img_file, buf, len, sx_width, sx_height);
+			}
+		}
+	}
+	int saved_errno = errno;
+	cache_unlock_key(img_url);
+	free(zbuf);
+	free(buf);
+	errno = saved_errno;
+	return rv;
+}
+
+// make_image_cache_common() の tee の書き込み関数。
+// buf (長さ len) をキャッシュ用の出力先と画面の両方に書き出す。
+// 最初の書き込みで SIXEL の先頭から大きさを読んで位置決めする。
+// 大きさが読めなければ何も出力せず errno をセットして -1 を返す。
+static int
+sixel_tee_write(void *cookie, const char *buf, int len)
+{
+	struct sixel_tee *tee = cookie;
+
+	if (tee->started == false) {
+		if (sixel_get_size(buf, len, &tee->sx_width, &tee->sx_height)
+			== false)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		image_layout(tee->sx_width, tee->sx_height, tee->index,
+			tee->real_file, &tee->rows, &tee->cols);
+		tee->started = true;
+		in_sixel = true;
+	}
+
+	fwrite(buf, 1, len, stdout);
+	fflush(stdout);
+
+	// キャッシュに置けなくても表示は続ける。
+	if (tee->nocache == false && fwrite(buf, 1, len, tee->cfp) < (size_t)len) {
+		tee->nocache = true;
+	}
+
+	return len;
+}
+
 // 画像をキャッシュして表示する。
 // img_file はキャッシュディレクトリ内でのファイル名 (拡張子 .sixel なし)。
 // img_url は画像の URL。
@@ -496,76 +776,145 @@ bool
 show_image(const char *img_file, const char *img_url, uint width, uint height,
 	bool shade, int index)
 {
-	char cache_filename[PATH_MAX];
-	FILE *fp;
-	uint sx_width;
-	uint sx_height;
-	char buf[4096];
-	char *next;
-	struct stat st;
-	uint i;
-	uint n;
-	bool rv = false;
+	return show_image_common(img_file, img_url, width, height, shade, index,
+		NULL);
+}
+
+// 本来の画像 real_file (キャッシュファイル名) の代わりに、仮の画像
+// (Blurhash など) を表示する。仮の画像の引数は show_image() と同じ。
+// 本来の画像は準備が出来たら image_slot_paint() で同じ位置に上書きする。
+// 仮の画像を表示できれば true を返す。
+bool
+show_image_deferred(const char *real_file, const char *img_file,
+	const char *img_url, uint width, uint height, bool shade, int index)
+{
+	return show_image_common(img_file, img_url, width, height, shade, index,
+		real_file);
+}
+
+// show_image() の本体。
+// real_file が NULL でなければ、今表示した位置を real_file の遅延表示枠
+// として登録する。
+static bool
+show_image_common(const char *img_file, const char *img_url,
+	uint width, uint height, bool shade, int index, const char *real_file)
+{
+	const struct hotcache_entry *hot = NULL;
+	struct cache_entry e;
+	uint image_rows;
+	uint image_cols;
+	bool refetch;
 
-	snprintf(cache_filename, sizeof(cache_filename),
-		"%s/%s.sixel", cachedir, img_file);
-	Debug(diag_image, "cachefile=|%s|", cache_filename);
+	Debug(diag_image, "cachefile=|%s|", img_file);
 	Trace(diag_image, "img_url=|%s|", img_url);
 
-	if (opt_overwrite_cache) {
-		fp = NULL;
-	} else {
-		fp = fopen(cache_filename, "r");
+	// 先読みを依頼してあればその完了を待つ。
+	int r = fetchpool_wait(img_file);
+	if (r == 0) {
+		if (errno != 0) {
+			fprintf(stderr, "%s: fetch_image failed: %s\n", __func__,
+				strerrno());
+			image_slot_clear();
+		}
+		return false;
 	}
-	if (fp == NULL) {
-		// キャッシュファイルがないので、画像を取得してキャッシュに保存。
 
-		fp = fopen(cache_filename, "w+");
-		if (fp == NULL) {
-			fprintf(stderr, "%s: cache file '%s': %s\n", __func__,
-				cache_filename, strerrno());
-			return false;
-		}
+	refetch = (opt_overwrite_cache && r < 0);
 
-		if (fetch_image(fp, img_url, width, height, shade) == false) {
+	// アイコンは同じものを何度も表示するので、まずメモリ上を探す。
+	if (index < 0 && refetch == false) {
+		hot = hotcache_get(img_file);
+	}
+	if (hot == NULL && (refetch || cache_lookup(img_file, &e) == false)) {
+		// キャッシュにないので、画像を取得して変換しながら表示し、
+		// 同時にキャッシュに保存する。全部変換し終わるのを待たずに
+		// 表示し始められ、キャッシュから読み直す必要もない。
+		struct sixel_tee tee;
+		bool ok;
+
+		memset(&tee, 0, sizeof(tee));
+		tee.index = index;
+		tee.real_file = real_file;
+		errno = 0;
+		ok = make_image_cache_common(img_file, img_url, width, height, shade,
+			&tee);
+		if (tee.started) {
+			// 画面に出力し始めていれば、キャッシュに置けたかどうかに
+			// よらずここで表示は終わり。
+			if (tee.aborted) {
+				// 途中まで出力したので位置はもう分からない。
+				fprintf(stderr, "%s: fetch_image failed: %s\n", __func__,
+					strerrno());
+				image_slot_clear();
+			} else if (ok == false) {
+				Debug(diag_image, "%s: %s: not cached: %s", __func__,
+					img_file, strerrno());
+			}
+			image_layout_done(index, tee.rows, tee.cols);
+			return true;
+		}
+		if (ok == false) {
 			if (errno != 0) {
 				fprintf(stderr, "%s: fetch_image failed: %s\n", __func__,
 					strerrno());
+				image_slot_clear();
 			}
-			goto abort;
+			return false;
 		}
 
-		fseek(fp, 0, SEEK_SET);
+		// 他のプロセスが作ったものならキャッシュから表示する。
+		if (index < 0) {
+			hot = hotcache_get(img_file);
+		}
+		if (hot == NULL && cache_lookup(img_file, &e) == false) {
+			fprintf(stderr, "%s: %s: not found in cache\n", __func__,
+				img_file);
+			image_slot_clear();
+			return false;
+		}
 	}
-
-	// SIXEL の先頭付近から幅と高さを取得。
-
-	n = fread(buf, 1, sizeof(buf), fp);
-	if (n < 32) {
-		fprintf(stderr, "%s: %s: file too short(n=%u)\n", __func__,
-			cache_filename, n);
-		goto abort;
+	if (hot == NULL && index < 0) {
+		// アイコンならメモリ上にも置いておく。
+		// 置けなければこの回はディスクから出力すればよい。
+		uint len;
+		char *data = sixel_load(&e, &len);
+		if (data) {
+			hot = hotcache_put(img_file, data, len, e.width, e.height);
+			free(data);
+		}
 	}
-	// 先頭から少しのところに '"' <Pan> ';' <Pad> ';' <Ph> ';' <Pv>。
-	// Search '"'
-	for (i = 0; i < n && buf[i] != '\x22'; i++)
-		;
-	// Skip <Pan>
-	for (i++; i < n && buf[i] != ';'; i++)
-		;
-	// Skip <Pad>
-	for (i++; i < n && buf[i] != ';'; i++)
-		;
-	// Obtain <Ph>
-	i++;
-	sx_width = stou32def(&buf[i], -1, &next);
-	// Obtain <Pv>
-	sx_height = stou32def(next + 1, -1, NULL);
-	if ((int)sx_width < 0 || (int)sx_height < 0) {
-		Debug(diag_image, "%s: %s: could not read size in SIXEL",
-			__func__, cache_filename);
-		goto abort;
+
+	// 画像の大きさは索引にあるので SIXEL を読む必要はない。
+	if (hot) {
+		image_layout(hot->width, hot->height, index, real_file,
+			&image_rows, &image_cols);
+		in_sixel = true;
+		fwrite(hot->data, 1, hot->length, stdout);
+		fflush(stdout);
+		in_sixel = false;
+	} else {
+		image_layout(e.width, e.height, index, real_file,
+			&image_rows, &image_cols);
+		if (sixel_copy(&e) == false) {
+			// 途中まで出力したかも知れないので位置はもう分からない。
+			fprintf(stderr, "%s: %s: cache_read failed: %s\n", __func__,
+				img_file, strerrno());
+			image_slot_clear();
+		}
 	}
+	image_layout_done(index, image_rows, image_cols);
+
+	return true;
+}
+
+// 大きさ sx_width x sx_height の SIXEL 画像を出力する位置にカーソルを
+// 移動する。index、real_file は show_image_common() と同じ。
+// この画像が占める文字数を *rowsp、*colsp に書き戻す。
+static void
+image_layout(uint sx_width, uint sx_height, int index, const char *real_file,
+	uint *rowsp, uint *colsp)
+{
+	uint col;
 
 	// この画像が占める文字数。
 	uint image_rows = (sx_height + fontheight - 1) / fontheight;
@@ -573,6 +922,7 @@ show_image(const char *img_file, const char *img_url, uint width, uint height,
 
 	if (index < 0) {
 		// アイコンの場合は呼び出し側で実施。
+		col = indent_depth * indent_cols;
 	} else {
 		// 添付画像の場合、表示位置などを計算。
 
@@ -591,24 +941,29 @@ show_image(const char *img_file, const char *img_url, uint width, uint height,
 			if (image_count > 0) {
 				if (image_max_rows > 0 && diag_get_level(diag_image) == 0) {
 					printf(CSI "%uA", image_max_rows);
+					cursor_moved(-(int)image_max_rows);
 				}
 				if (image_next_cols > 0) {
 					printf(CSI "%uC", image_next_cols);
 				}
 			}
 		}
+		col = indent + image_next_cols;
 	}
 
-	// 最初の1回はすでに buf に入っているのでまず出力して、
-	// 次からは順次読みながら最後まで出力。
-	do {
-		in_sixel = true;
-		fwrite(buf, 1, n, stdout);
-		fflush(stdout);
-		in_sixel = false;
+	if (real_file) {
+		image_slot_add(real_file, col, image_rows, image_cols);
+	}
 
-		n = fread(buf, 1, sizeof(buf), fp);
-	} while (n > 0);
+	*rowsp = image_rows;
+	*colsp = image_cols;
+}
+
+// image_layout() の位置に SIXEL 画像を出力した後の処理。
+static void
+image_layout_done(int index, uint image_rows, uint image_cols)
+{
+	cursor_moved(image_rows);
 
 	if (index < 0) {
 		// アイコンの場合は呼び出し側で実施。
@@ -620,19 +975,466 @@ show_image(const char *img_file, const char *img_url, uint width, uint height,
 		// カーソル位置は同じ列に表示した画像の中で最長のものの下端に揃える
 		if (image_max_rows > image_rows) {
 			printf(CSI "%uB", image_max_rows - image_rows);
+			cursor_moved(image_max_rows - image_rows);
 		} else {
 			image_max_rows = image_rows;
 		}
 	}
+}
 
-	rv = true;
- abort:
-	fclose(fp);
-	// ファイルサイズ 0 なら消す。
-	if (lstat(cache_filename, &st) == 0 && st.st_size == 0) {
-		unlink(cache_filename);
+// SIXEL ファイルの先頭部分 buf (長さ n) から画像の幅と高さを取得する。
+// 取得できれば true を返す。
+static bool
+sixel_get_size(const char *buf, uint n, uint *widthp, uint *heightp)
+{
+	char *next;
+	uint i;
+
+	// 先頭から少しのところに '"' <Pan> ';' <Pad> ';' <Ph> ';' <Pv>。
+	// Search '"'
+	for (i = 0; i < n && buf[i] != '\x22'; i++)
+		;
+	// Skip <Pan>
+	for (i++; i < n && buf[i] != ';'; i++)
+		;
+	// Skip <Pad>
+	for (i++; i < n && buf[i] != ';'; i++)
+		;
+	// Obtain <Ph>
+	i++;
+	if (i >= n) {
+		return false;
+	}
+	*widthp = stou32def(&buf[i], -1, &next);
+	// Obtain <Pv>
+	*heightp = stou32def(next + 1, -1, NULL);
+	if ((int)*widthp < 0 || (int)*heightp < 0) {
+		return false;
+	}
+	return true;
+}
+
+// キャッシュのエントリ e の SIXEL を画面に出力する。
+// 圧縮されていればブロックごとに展開しながら出力する。
+// 圧縮されていなければ、先頭を出力した後の残りは stdio を経由せず
+// cache_send() で (できればカーネル内で) 直接端末に書き出す。
+// 最後まで出力できれば true を返す。
+// 読み込みに失敗すれば errno をセットして false を返す。
+static bool
+sixel_copy(const struct cache_entry *e)
+{
+	char buf[MAX(SIXEL_BUFSIZE, SIXEL_PACK_BLOCK)];
+	struct sixel_reader r;
+	bool ok;
+	int n;
+
+	// 先頭を読んだところで圧縮されているか分かる。
+	// ヘッダの照合もここで行われる。
+	n = cache_read(e, 0, buf, SIXEL_BUFSIZE);
+	if (n <= 0) {
+		return (n == 0);
+	}
+
+	if (sixel_reader_init(&r, e, buf, n)) {
+		while ((n = sixel_reader_read(&r, buf)) > 0) {
+			in_sixel = true;
+			fwrite(buf, 1, n, stdout);
+			fflush(stdout);
+			in_sixel = false;
+		}
+		return (n == 0);
+	}
+
+	in_sixel = true;
+	fwrite(buf, 1, n, stdout);
+	fflush(stdout);
+	ok = cache_send(e, n, STDOUT_FILENO);
+	in_sixel = false;
+	return ok;
+}
+
+// キャッシュのエントリ e の SIXEL をメモリに読み込む。
+// 圧縮されていれば展開する。
+// 成功すれば malloc した領域を返し、その長さを *lenp に書き戻す。
+// 失敗すれば errno をセットして NULL を返す。
+static char *
+sixel_load(const struct cache_entry *e, uint *lenp)
+{
+	char first[SIXEL_BUFSIZE];
+	struct sixel_reader r;
+	char *data;
+	uint len;
+	uint pos;
+	int n;
+
+	n = cache_read(e, 0, first, sizeof(first));
+	if (n <= 0) {
+		if (n == 0) {
+			errno = ESTALE;
+		}
+		return NULL;
+	}
+
+	if (sixel_reader_init(&r, e, first, n)) {
+		// ブロック単位で展開するので最後のブロックの分だけ余分に確保する。
+		len = r.rawlen;
+		data = malloc(len + SIXEL_PACK_BLOCK);
+		if (data == NULL) {
+			return NULL;
+		}
+		for (pos = 0; pos < len; pos += n) {
+			n = sixel_reader_read(&r, data + pos);
+			if (n <= 0) {
+				break;
+			}
+		}
+	} else {
+		len = e->length;
+		data = malloc(len);
+		if (data == NULL) {
+			return NULL;
+		}
+		memcpy(data, first, n);
+		for (pos = n; pos < len; pos += n) {
+			n = cache_read(e, pos, data + pos, len - pos);
+			if (n <= 0) {
+				break;
+			}
+		}
+	}
+	if (pos != len) {
+		if (n >= 0) {
+			errno = ESTALE;
+		}
+		free(data);
+		return NULL;
+	}
+
+	*lenp = len;
+	return data;
+}
+
+// SIXEL データ src (長さ srclen) をキャッシュに置く圧縮形式にする。
+// 成功すれば malloc した領域を返し、その長さを *dstlenp に書き戻す。
+// 小さくならなければ errno = 0 で、メモリが確保できなければ errno を
+// セットして、NULL を返す。
+static char *
+sixel_pack(const char *src, uint srclen, uint *dstlenp)
+{
+	struct sixel_pack_header hdr;
+	uint nblocks = (srclen + SIXEL_PACK_BLOCK - 1) / SIXEL_PACK_BLOCK;
+	uint dstsize = sizeof(hdr) + nblocks * sizeof(struct sixel_pack_block)
+		+ srclen;
+	uint op;
+	char *dst;
+
+	dst = malloc(dstsize);
+	if (dst == NULL) {
+		return NULL;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic[0] = 'L';
+	hdr.magic[1] = 'Z';
+	hdr.rawlen = srclen;
+	memcpy(dst, &hdr, sizeof(hdr));
+	op = sizeof(hdr);
+
+	for (uint ip = 0; ip < srclen; ip += SIXEL_PACK_BLOCK) {
+		struct sixel_pack_block blk;
+		blk.rawlen = MIN(srclen - ip, SIXEL_PACK_BLOCK);
+		op += sizeof(blk);
+		// 小さくならなければそのまま置く。
+		blk.zlen = lz_compress((const uint8 *)src + ip, blk.rawlen,
+			(uint8 *)dst + op, blk.rawlen - 1);
+		if (blk.zlen == 0) {
+			blk.zlen = blk.rawlen;
+			memcpy(dst + op, src + ip, blk.rawlen);
+		}
+		memcpy(dst + op - sizeof(blk), &blk, sizeof(blk));
+		op += blk.zlen;
+	}
+
+	if (op >= srclen) {
+		free(dst);
+		errno = 0;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pack_mtx);
+	pack_stat.packed++;
+	pack_stat.raw_bytes += srclen;
+	pack_stat.packed_bytes += op;
+	pthread_mutex_unlock(&pack_mtx);
+
+	*dstlenp = op;
+	return dst;
+}
+
+// エントリ e のデータの先頭 n バイトを first に読み込んだ状態から、
+// 圧縮された SIXEL を読み出す準備をする。
+// 圧縮されていれば true を返す。
+// そうでなければ false を返す (その場合 first がそのまま SIXEL)。
+static bool
+sixel_reader_init(struct sixel_reader *r, const struct cache_entry *e,
+	const char *first, uint n)
+{
+	struct sixel_pack_header hdr;
+
+	if (n < sizeof(hdr) || first[0] != 'L' || first[1] != 'Z') {
+		return false;
+	}
+	memcpy(&hdr, first, sizeof(hdr));
+
+	r->e = e;
+	r->rawlen = hdr.rawlen;
+	r->head = 0;
+	r->tail = MIN(n - sizeof(hdr), sizeof(r->buf));
+	memcpy(r->buf, first + sizeof(hdr), r->tail);
+	r->pos = sizeof(hdr) + r->tail;
+
+	pthread_mutex_lock(&pack_mtx);
+	pack_stat.unpacked++;
+	pthread_mutex_unlock(&pack_mtx);
+	return true;
+}
+
+// 次のブロックを展開して dst (SIXEL_PACK_BLOCK バイト以上) に書き出す。
+// 展開したバイト数を返す。データの終端なら 0 を返す。
+// 失敗すれば errno をセットして -1 を返す。
+static int
+sixel_reader_read(struct sixel_reader *r, char *dst)
+{
+	struct sixel_pack_block blk;
+
+	if (r->head == r->tail && r->pos >= r->e->length) {
+		return 0;
+	}
+
+	if (sixel_reader_fill(r, sizeof(blk)) == false) {
+		return -1;
+	}
+	memcpy(&blk, r->buf + r->head, sizeof(blk));
+	if (blk.rawlen > SIXEL_PACK_BLOCK || blk.zlen > blk.rawlen) {
+		Debug(diag_image, "%s: broken block at %u", __func__, r->pos);
+		errno = ESTALE;
+		return -1;
+	}
+	if (sixel_reader_fill(r, sizeof(blk) + blk.zlen) == false) {
+		return -1;
+	}
+	const char *src = r->buf + r->head + sizeof(blk);
+	r->head += sizeof(blk) + blk.zlen;
+
+	if (blk.zlen == blk.rawlen) {
+		memcpy(dst, src, blk.rawlen);
+	} else if (lz_decompress((const uint8 *)src, blk.zlen, (uint8 *)dst,
+		blk.rawlen) != blk.rawlen)
+	{
+		Debug(diag_image, "%s: broken block at %u", __func__, r->pos);
+		errno = ESTALE;
+		return -1;
+	}
+	return blk.rawlen;
+}
+
+// バッファに未処理のデータが need バイト以上あるようにする。
+// 読めなければ errno をセットして false を返す。
+static bool
+sixel_reader_fill(struct sixel_reader *r, uint need)
+{
+	if (r->tail - r->head >= need) {
+		return true;
+	}
+
+	memmove(r->buf, r->buf + r->head, r->tail - r->head);
+	r->tail -= r->head;
+	r->head = 0;
+	while (r->tail < need) {
+		int n = cache_read(r->e, r->pos, r->buf + r->tail,
+			sizeof(r->buf) - r->tail);
+		if (n <= 0) {
+			if (n == 0) {
+				errno = ESTALE;
+			}
+			return false;
+		}
+		r->pos += n;
+		r->tail += n;
+	}
+	return true;
+}
+
+// SIXEL キャッシュの圧縮の統計情報を *stat にコピーする。
+void
+sixel_get_pack_stat(struct sixel_pack_stat *stat)
+{
+	pthread_mutex_lock(&pack_mtx);
+	memcpy(stat, &pack_stat, sizeof(*stat));
+	pthread_mutex_unlock(&pack_mtx);
+}
+
+//
+// 遅延表示
+//
+
+// カーソルが n 行移動したことを記録する (負なら上方向)。
+// 改行や SIXEL の出力などで行が変わる時は必ず呼ぶこと。
+void
+cursor_moved(int n)
+{
+	cursor_row += n;
+	if ((int64)(cursor_row - bottom_row) > 0) {
+		bottom_row = cursor_row;
+	}
+}
+
+// 改行を出力する。
+void
+print_newline(void)
+{
+	putchar('\n');
+	cursor_moved(1);
+}
+
+// 遅延表示が使えるなら true を返す。
+// 画面の大きさが分かっていて、画像の先読みをしていることが条件。
+// デバッグ表示はカーソル位置を狂わせるので、その場合も使わない。
+bool
+image_slot_available(void)
+{
+	return (opt_defer_image &&
+		screen_cols > 0 && screen_rows > 0 &&
+		fetchpool_enabled() &&
+		diag_get_level(diag_image) == 0);
+}
+
+// 遅延表示の画像が残っていれば true を返す。
+bool
+image_slot_pending(void)
+{
+	return (slot_head != NULL);
+}
+
+// 現在のカーソル位置を基準に、遅延表示枠を追加する。
+// col は左端の桁、rows と cols は枠の大きさ (文字数)。
+static void
+image_slot_add(const char *real_file, uint col, uint rows, uint cols)
+{
+	struct image_slot *slot;
+
+	slot = calloc(1, sizeof(*slot));
+	if (slot == NULL) {
+		return;
+	}
+	slot->img_file = strdup(real_file);
+	if (slot->img_file == NULL) {
+		free(slot);
+		return;
+	}
+	slot->row = cursor_row;
+	slot->col = col;
+	slot->rows = rows;
+	slot->cols = cols;
+	slot->screen_cols = screen_cols;
+	slot->screen_rows = screen_rows;
+
+	// 末尾に繋ぐ。
+	struct image_slot **p;
+	for (p = &slot_head; *p; p = &(*p)->next)
+		;
+	*p = slot;
+}
+
+// 準備の出来た遅延表示の画像を、画面に残っていれば描画する。
+// 画面から流れてしまったものは諦める。
+// メッセージの表示と表示の合間に呼ぶこと。
+void
+image_slot_paint(void)
+{
+	struct image_slot **p = &slot_head;
+	struct image_slot *slot;
+
+	while ((slot = *p) != NULL) {
+		int r = image_slot_paint1(slot);
+		if (r == 0) {
+			// まだ準備中。
+			p = &slot->next;
+		} else {
+			// 描画したか、諦めた。
+			*p = slot->next;
+			image_slot_free(slot);
+		}
 	}
-	return rv;
+}
+
+// slot を1つ処理する。
+// 準備中なら 0 を、描画したか諦めたなら 1 を返す。
+static int
+image_slot_paint1(struct image_slot *slot)
+{
+	struct cache_entry e;
+
+	// 画面の大きさが変わったら位置はもう分からない。
+	if (slot->screen_cols != screen_cols || slot->screen_rows != screen_rows) {
+		return 1;
+	}
+	// 上端が画面から流れていたら諦める。
+	if (bottom_row - slot->row > screen_rows - 1) {
+		return 1;
+	}
+	if (fetchpool_busy(slot->img_file)) {
+		return 0;
+	}
+	if (fetchpool_wait(slot->img_file) == 0) {
+		// 失敗したので仮の画像のまま。
+		return 1;
+	}
+
+	if (cache_lookup(slot->img_file, &e) == false) {
+		return 1;
+	}
+	// 枠からはみ出す場合は、周りを壊すので描かない。
+	if ((e.height + fontheight - 1) / fontheight > slot->rows ||
+		(e.width + fontwidth - 1) / fontwidth > slot->cols)
+	{
+		return 1;
+	}
+
+	// カーソル位置を保存して枠の左上に移動して描画し、元に戻す。
+	printf(ESC "7");
+	if (cursor_row - slot->row > 0) {
+		printf(CSI "%uA", (uint)(cursor_row - slot->row));
+	}
+	printf("\r");
+	if (slot->col > 0) {
+		printf(CSI "%uC", slot->col);
+	}
+	sixel_copy(&e);
+	printf(ESC "8");
+	fflush(stdout);
+
+	return 1;
+}
+
+// 遅延表示の画像をすべて諦める。
+// 画面にカーソル位置の分からない出力をした時などに呼ぶ。
+void
+image_slot_clear(void)
+{
+	struct image_slot *slot;
+
+	while ((slot = slot_head) != NULL) {
+		slot_head = slot->next;
+		image_slot_free(slot);
+	}
+}
+
+static void
+image_slot_free(struct image_slot *slot)
+{
+	free(slot->img_file);
+	free(slot);
 }
 
 // img_url から画像をダウンロードして、
@@ -648,6 +1450,14 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 	struct image *srcimg = NULL;
 	struct image *dstimg = NULL;
 	struct image_opt localopt;
+	struct timespec start;
+	struct timespec connected;
+	struct timespec loaded;
+	struct timespec reducted;
+	struct timespec written;
+	int code = 0;
+	int code_errno = 0;
+	bool fetched = false;
 	bool rv = false;
 
 	// dst_{width,height} は
@@ -660,6 +1470,9 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 	uint dst_width = width;
 	uint dst_height = height;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	connected = start;
+
 	if (strncmp(img_url, "blurhash://", 11) == 0) {
 		ifp = fmemopen(UNCONST(&img_url[11]), strlen(img_url) - 11, "r");
 		if (ifp == NULL) {
@@ -676,16 +1489,36 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 			goto abort;
 		}
 
+	} else if ((strncmp(img_url, "http://",  7) == 0 ||
+	            strncmp(img_url, "https://", 8) == 0) &&
+	           (srcimg = rawcache_load(img_url, width, height)) != NULL)
+	{
+		// 中間キャッシュがあれば、取得もデコードも不要。
+		// (フォントサイズや色数を変えた時など)
+		image_get_preferred_size(srcimg->width, srcimg->height,
+			RESIZE_AXIS_SCALEDOWN_LONG, width, height,
+			&dst_width, &dst_height);
+
 	} else if (strncmp(img_url, "http://",  7) == 0 ||
 	           strncmp(img_url, "https://", 8) == 0)
 	{
+		// 最近失敗した URL やホストなら取りに行かない。
+		// 想定内の失敗なので、呼び出し側は Blurhash などで代用する。
+		if (negcache_allow(img_url) == false) {
+			Debug(diag_net, "%s: %s: skipped by negative cache",
+				__func__, img_url);
+			errno = 0;
+			return false;
+		}
+
 		http = httpclient_create(diag_net);
 		if (http == NULL) {
 			Debug(diag_net, "%s: httpclient_create failed", __func__);
 			return false;
 		}
-		int code = httpclient_connect(http, img_url, &netopt_image);
+		code = httpclient_connect(http, img_url, &netopt_image);
 		if (code != 0) {
+			code_errno = errno;
 			if (code < 0) {
 				Debug(diag_net, "%s: %s: connection failed: %s",
 					__func__, img_url,
@@ -696,6 +1529,7 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 			}
 			goto abort;
 		}
+		clock_gettime(CLOCK_MONOTONIC, &connected);
 		ifp = httpclient_fopen(http);
 		if (ifp == NULL) {
 			Debug(diag_net, "%s: httpclient_fopen failed: %s", __func__,
@@ -723,21 +1557,40 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 		hint.axis   = RESIZE_AXIS_SCALEDOWN_LONG;
 		hint.width  = width;
 		hint.height = height;
+		errno = 0;
 		srcimg = image_read(pstream, loader_idx, &hint, diag_image);
 		if (srcimg == NULL) {
-			Debug(diag_image, "%s: image_read failed", __func__);
+			if (errno == EFBIG) {
+				// 資源制限を超えるのも想定内の失敗なので、
+				// エラー表示はせず呼び出し側で Blurhash などで代用する。
+				Debug(diag_image, "%s: %s: too large to decode", __func__,
+					img_url);
+				errno = 0;
+			} else {
+				Debug(diag_image, "%s: image_read failed", __func__);
+			}
 			goto abort;
 		}
 
+		fetched = true;
+		negcache_success(img_url);
+
 		// いい感じにサイズを決定。
 		image_get_preferred_size(srcimg->width, srcimg->height,
 			RESIZE_AXIS_SCALEDOWN_LONG, width, height,
 			&dst_width, &dst_height);
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &loaded);
+
 	// 内部形式に変換。
 	image_convert_to16(srcimg);
 
+	// 取得した画像は中間キャッシュにも置いておく。
+	if (http) {
+		rawcache_save(img_url, srcimg);
+	}
+
 	memcpy(&localopt, &imageopt, sizeof(localopt));
 	if (shade) {
 		localopt.gain = (uint)(0.7 * 256);
@@ -749,6 +1602,7 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 		Debug(diag_image, "%s: image_reduct failed", __func__);
 		goto abort;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &reducted);
 
 	// 出力。
 	if (image_sixel_write(ofp, dstimg, &localopt, diag_image) == false) {
@@ -756,9 +1610,48 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 		goto abort;
 	}
 	fflush(ofp);
+	clock_gettime(CLOCK_MONOTONIC, &written);
+
+	// 段階ごとの所要時間。ワーカー数の調整用。
+	if (__predict_false(diag_get_level(diag_image) >= 1)) {
+		uint64 start_usec = timespec_to_usec(&start);
+		uint64 connected_usec = timespec_to_usec(&connected);
+		uint64 loaded_usec = timespec_to_usec(&loaded);
+		uint64 reducted_usec = timespec_to_usec(&reducted);
+		uint64 written_usec = timespec_to_usec(&written);
+		diag_print(diag_image,
+			"%s: Connect %4.1f, Load(+IO) %4.1f, Reduct %4.1f, SIXEL %4.1f "
+			"msec", __func__,
+			(float)(connected_usec - start_usec) / 1000,
+			(float)(loaded_usec - connected_usec) / 1000,
+			(float)(reducted_usec - loaded_usec) / 1000,
+			(float)(written_usec - reducted_usec) / 1000);
+	}
 
 	rv = true;
  abort:
+	if (rv == false && http && httpclient_is_expired(http)) {
+		// 時間切れは想定内の失敗なのでエラー表示はしない。
+		// 呼び出し側は Blurhash などで代用する。
+		Debug(diag_net, "%s: %s: deadline exceeded", __func__, img_url);
+		errno = 0;
+	}
+	if (rv == false && http && httpclient_is_too_large(http)) {
+		// 大きすぎるのも同様。
+		Debug(diag_net, "%s: %s: too large", __func__, img_url);
+		errno = 0;
+	}
+	if (rv == false && http && fetched == false) {
+		// 取得かデコードに失敗したものは覚えておく。
+		// ホスト側の問題として数えるかは negcache_is_host_failure() 参照。
+		bool host_down = negcache_is_host_failure(code, code_errno,
+			httpclient_is_too_large(http), httpclient_is_expired(http));
+		negcache_fail(img_url, host_down);
+	}
+	if (http) {
+		// 失敗しても受信した分は通信量の予算から引く。
+		budget_add(httpclient_get_received(http));
+	}
 	image_free(dstimg);
 	image_free(srcimg);
 	pstream_cleanup(pstream);
@@ -768,3 +1661,136 @@ fetch_image(FILE *ofp, const char *img_url, uint width, uint height, bool shade)
 	httpclient_destroy(http);
 	return rv;
 }
+
+// img_url の中間キャッシュのキーを返す。
+// 色数やフォントサイズには依存しない。
+static string *
+rawcache_key(const char *img_url)
+{
+	string *key = string_init();
+	if (key) {
+		string_append_printf(key, "raw-%s", img_url);
+	}
+	return key;
+}
+
+// img_url の中間キャッシュを読み込んで image を返す。
+// 長辺が width x height に縮小するには足りない場合や、中間キャッシュが
+// ない場合は NULL を返す。
+static struct image *
+rawcache_load(const char *img_url, uint width, uint height)
+{
+	struct rawcache_header hdr;
+	struct cache_entry e;
+	struct image *img;
+	string *key;
+	bool found;
+
+	key = rawcache_key(img_url);
+	if (key == NULL) {
+		return NULL;
+	}
+	found = cache_lookup(string_get(key), &e);
+	string_free(key);
+	if (found == false) {
+		return NULL;
+	}
+	if (e.length != sizeof(hdr) + e.width * e.height * 2) {
+		return NULL;
+	}
+	if (cache_read(&e, 0, (char *)&hdr, sizeof(hdr)) != sizeof(hdr) ||
+		hdr.magic[0] != 'R' || hdr.magic[1] != '6' ||
+		hdr.version != RAWCACHE_VERSION)
+	{
+		return NULL;
+	}
+	// 縮小してあるものはそれより大きくはできない。
+	if ((hdr.flags & RAWCACHE_ORIGINAL) == 0 &&
+		MAX(e.width, e.height) < MAX(width, height))
+	{
+		Debug(diag_image, "%s: %s: too small (%ux%u)", __func__,
+			img_url, e.width, e.height);
+		return NULL;
+	}
+
+	img = image_create(e.width, e.height, IMAGE_FMT_ARGB16);
+	if (img == NULL) {
+		return NULL;
+	}
+	img->has_alpha = ((hdr.flags & RAWCACHE_HAS_ALPHA) != 0);
+	uint len = e.length - sizeof(hdr);
+	for (uint pos = 0; pos < len; ) {
+		int n = cache_read(&e, sizeof(hdr) + pos, (char *)img->buf + pos,
+			len - pos);
+		if (n <= 0) {
+			image_free(img);
+			return NULL;
+		}
+		pos += n;
+	}
+
+	Debug(diag_image, "%s: %s: %ux%u", __func__, img_url,
+		img->width, img->height);
+	return img;
+}
+
+// img_url からデコードした画像 img (16bit 内部形式) を、長辺が
+// RAWCACHE_SIZE 以下になるよう縮小して中間キャッシュに保存する。
+// ローダが表示サイズに合わせて縮小してデコードしたものは、元画像の
+// 大きさではないので RAWCACHE_ORIGINAL にはしない (より大きく表示する
+// 時には使わせない)。
+// 失敗しても表示には関係ないので何も返さない。
+static void
+rawcache_save(const char *img_url, const struct image *img)
+{
+	struct rawcache_header *hdr;
+	const struct image *raw = img;
+	struct image *tmp = NULL;
+	string *key = NULL;
+	char *buf = NULL;
+	uint flags = 0;
+
+	if (MAX(img->width, img->height) > RAWCACHE_SIZE) {
+		uint raw_width;
+		uint raw_height;
+		image_get_preferred_size(img->width, img->height,
+			RESIZE_AXIS_SCALEDOWN_LONG, RAWCACHE_SIZE, RAWCACHE_SIZE,
+			&raw_width, &raw_height);
+		tmp = image_resize16(img, raw_width, raw_height);
+		if (tmp == NULL) {
+			return;
+		}
+		raw = tmp;
+	} else if (img->width == img->orig_width &&
+		img->height == img->orig_height)
+	{
+		flags |= RAWCACHE_ORIGINAL;
+	}
+	if (raw->has_alpha) {
+		flags |= RAWCACHE_HAS_ALPHA;
+	}
+
+	uint len = raw->width * raw->height * 2;
+	buf = malloc(sizeof(*hdr) + len);
+	key = rawcache_key(img_url);
+	if (buf == NULL || key == NULL) {
+		goto done;
+	}
+	hdr = (struct rawcache_header *)buf;
+	hdr->magic[0] = 'R';
+	hdr->magic[1] = '6';
+	hdr->flags = flags;
+	hdr->version = RAWCACHE_VERSION;
+	memcpy(buf + sizeof(*hdr), raw->buf, len);
+
+	if (cache_put(string_get(key), buf, sizeof(*hdr) + len,
+		raw->width, raw->height) == false)
+	{
+		Debug(diag_image, "%s: cache_put: %s", __func__, strerrno());
+	}
+
+ done:
+	string_free(key);
+	free(buf);
+	image_free(tmp);
+}
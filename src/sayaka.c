@@ -53,6 +53,7 @@ enum {
 	CMD_NONE = 0,
 	CMD_STREAM,
 	CMD_PLAY,
+	CMD_WARM,
 };
 
 // ヘッダの依存関係を減らすため。
@@ -67,7 +68,6 @@ static void mkdir_if(const char *);
 static void progress(const char *);
 static void init_screen(void);
 static void init_ngword(void);
-static void invalidate_cache(void);
 static string *get_token(const char *);
 static void signal_handler(int);
 static void sigwinch(bool);
@@ -96,26 +96,34 @@ struct net_opt netopt_main;			// メインストリーム用ネットワーク
 struct ngwords *ngwords;			// NG ワード集
 int opt_bgtheme;					// -1:自動判別 0:Dark 1:Light
 const char *opt_codeset;			// 出力文字コード (NULL なら UTF-8)
+bool opt_compress_cache;			// SIXEL キャッシュを圧縮して置く
 static uint opt_fontwidth;			// --font 指定の幅   (指定なしなら 0)
 static uint opt_fontheight;			// --font 指定の高さ (指定なしなら 0)
 bool opt_force_blurhash;			// 画像はすべて Blurhash から表示する
 uint opt_nsfw;						// NSFW コンテンツの表示方法
+uint opt_keepalive_image;			// 画像取得の接続を再利用する時間 [秒]
+uint opt_max_image_rate;			// 画像の1分あたりの通信量の上限 [byte]
 bool opt_overwrite_cache;			// キャッシュファイルを更新する
+uint opt_pong_timeout;				// PING に対する PONG を待つ時間 [秒]
 static bool opt_progress;
 const char *opt_record_file;		// 録画ファイル名 (NULL なら録画しない)
 bool opt_show_cw;					// CW を表示するか。
 int opt_show_image;					// -1:自動判別 0:出力しない 1:出力する
 uint screen_cols;					// 画面の桁数
+uint screen_rows;					// 画面の行数
 
 enum {
 	OPT__start = 0x7f,
 	OPT_ciphers,
+	OPT_compress_cache,
 	OPT_dark,
+	OPT_deadline_image,
 	OPT_debug_format,
 	OPT_debug_image,
 	OPT_debug_json,
 	OPT_debug_net,
 	OPT_debug_term,
+	OPT_defer_image,
 	OPT_eaw_a,
 	OPT_eaw_n,
 	OPT_euc_jp,
@@ -123,34 +131,44 @@ enum {
 	OPT_force_blurhash,
 	OPT_help,
 	OPT_help_all,
+	OPT_image_workers,
 	OPT_ipv4,
 	OPT_ipv6,
 	OPT_jis,
+	OPT_keepalive_image,
 	OPT_light,
 	OPT_list_supported_images,
 	OPT_mathalpha,
+	OPT_max_decode_memory,
 	OPT_max_image_cols,
+	OPT_max_image_rate,
+	OPT_max_image_size,
 	OPT_misskey,
 	OPT_no_combine,
 	OPT_no_image,	// backward compatibility
 	OPT_nsfw,
 	OPT_overwrite_cache,
+	OPT_pong_timeout,
 	OPT_progress,
 	OPT_show_cw,
 	OPT_show_image,
 	OPT_sixel_or,
 	OPT_timeout_image,
+	OPT_warm_cache,
 };
 
 static const struct option longopts[] = {
 	{ "ciphers",		required_argument,	NULL,	OPT_ciphers },
 	{ "color",			required_argument,	NULL,	'c' },
+	{ "compress-cache",	no_argument,		NULL,	OPT_compress_cache },
 	{ "dark",			no_argument,		NULL,	OPT_dark },
+	{ "deadline-image",	required_argument,	NULL,	OPT_deadline_image },
 	{ "debug-format",	required_argument,	NULL,	OPT_debug_format },
 	{ "debug-image",	required_argument,	NULL,	OPT_debug_image },
 	{ "debug-json",		required_argument,	NULL,	OPT_debug_json },
 	{ "debug-net",		required_argument,	NULL,	OPT_debug_net },
 	{ "debug-term",		required_argument,	NULL,	OPT_debug_term },
+	{ "defer-image",	no_argument,		NULL,	OPT_defer_image },
 	{ "eaw-a",			required_argument,	NULL,	OPT_eaw_a },
 	{ "eaw-n",			required_argument,	NULL,	OPT_eaw_n },
 	{ "euc-jp",			no_argument,		NULL,	OPT_euc_jp },
@@ -159,20 +177,26 @@ static const struct option longopts[] = {
 	{ "help",			no_argument,		NULL,	OPT_help },
 	{ "help-all",		no_argument,		NULL,	OPT_help_all },
 	{ "home",			no_argument,		NULL,	'h' },
+	{ "image-workers",	required_argument,	NULL,	OPT_image_workers },
 	{ "ipv4",			no_argument,		NULL,	OPT_ipv4 },
 	{ "ipv6",			no_argument,		NULL,	OPT_ipv6 },
 	{ "jis",			no_argument,		NULL,	OPT_jis },
+	{ "keepalive-image",required_argument,	NULL,	OPT_keepalive_image },
 	{ "light",			no_argument,		NULL,	OPT_light },
 	{ "list-supported-images", no_argument,	NULL,	OPT_list_supported_images },
 	{ "local",			no_argument,		NULL,	'l' },
 	{ "mathalpha",		no_argument,		NULL,	OPT_mathalpha },
+	{ "max-decode-memory", required_argument,	NULL,	OPT_max_decode_memory },
 	{ "max-image-cols",	required_argument,	NULL,	OPT_max_image_cols },
+	{ "max-image-rate",	required_argument,	NULL,	OPT_max_image_rate },
+	{ "max-image-size",	required_argument,	NULL,	OPT_max_image_size },
 	{ "misskey",		no_argument,		NULL,	OPT_misskey },
 	{ "no-combine",		no_argument,		NULL,	OPT_no_combine },
 	{ "no-image",		no_argument,		NULL,	OPT_no_image },
 	{ "nsfw",			required_argument,	NULL,	OPT_nsfw },
 	{ "overwrite-cache",no_argument,		NULL,	OPT_overwrite_cache },
 	{ "play",			required_argument,	NULL,	'p' },
+	{ "pong-timeout",	required_argument,	NULL,	OPT_pong_timeout },
 	{ "progress",		no_argument,		NULL,	OPT_progress },
 	{ "record",			required_argument,	NULL,	'r' },
 	{ "server",			required_argument,	NULL,	's' },
@@ -182,6 +206,7 @@ static const struct option longopts[] = {
 	{ "timeout-image",	required_argument,	NULL,	OPT_timeout_image },
 	{ "token",			required_argument,	NULL,	't' },
 	{ "version",		no_argument,		NULL,	'v' },
+	{ "warm-cache",		required_argument,	NULL,	OPT_warm_cache },
 	{ NULL },
 };
 
@@ -238,6 +263,18 @@ main(int ac, char *av[])
 	is_home = false;
 
 	netopt_image.timeout_msec = 3000;
+#if defined(SLOW_ARCH)
+	netopt_image.deadline_msec = 60000;
+#else
+	netopt_image.deadline_msec = 15000;
+#endif
+	opt_keepalive_image = 30;
+	opt_pong_timeout = 10;
+#if defined(SLOW_ARCH)
+	opt_image_workers = 0;
+#else
+	opt_image_workers = 4;
+#endif
 
 	while ((c = getopt_long(ac, av, "c:hlp:r:s:t:v", longopts, NULL)) != -1) {
 		switch (c) {
@@ -277,10 +314,22 @@ main(int ac, char *av[])
 			}
 			break;
 
+		 case OPT_compress_cache:
+			opt_compress_cache = true;
+			break;
+
 		 case OPT_dark:
 			opt_bgtheme = BG_DARK;
 			break;
 
+		 case OPT_deadline_image:
+			netopt_image.deadline_msec = stou32def(optarg, -1, NULL);
+			if ((int32)netopt_image.deadline_msec == -1) {
+				errno = EINVAL;
+				err(1, "--deadline-image %s", optarg);
+			}
+			break;
+
 		 case OPT_debug_format:
 			SET_DIAG_LEVEL(diag_format);
 			break;
@@ -301,6 +350,10 @@ main(int ac, char *av[])
 			SET_DIAG_LEVEL(diag_term);
 			break;
 
+		 case OPT_defer_image:
+			opt_defer_image = true;
+			break;
+
 		 case OPT_eaw_a:
 			opt_eaw_a = stou32def(optarg, -1, NULL);
 			if (opt_eaw_a < 1 || opt_eaw_a > 2) {
@@ -355,6 +408,18 @@ main(int ac, char *av[])
 			help_all();
 			exit(0);
 
+		 case OPT_image_workers:
+			opt_image_workers = stou32def(optarg, -1, NULL);
+			if ((int)opt_image_workers < 0) {
+				errno = EINVAL;
+				err(1, "--image-workers %s", optarg);
+			}
+			if (opt_image_workers > FETCHPOOL_MAX_JOBS) {
+				errx(1, "--image-workers %s: must be 0..%u", optarg,
+					FETCHPOOL_MAX_JOBS);
+			}
+			break;
+
 		 case OPT_ipv4:
 			netopt_main.address_family = 4;
 			netopt_image.address_family = 4;
@@ -369,6 +434,14 @@ main(int ac, char *av[])
 			opt_codeset = "iso-2022-jp";
 			break;
 
+		 case OPT_keepalive_image:
+			opt_keepalive_image = stou32def(optarg, -1, NULL);
+			if ((int)opt_keepalive_image < 0) {
+				errno = EINVAL;
+				err(1, "--keepalive-image %s", optarg);
+			}
+			break;
+
 		 case 'l':
 			cmd = CMD_STREAM;
 			is_home = false;
@@ -386,6 +459,21 @@ main(int ac, char *av[])
 			opt_mathalpha = true;
 			break;
 
+		 case OPT_max_decode_memory:
+		 {
+			// MB 単位で指定する。
+			struct image_limit lim;
+			uint32 mb = stou32def(optarg, -1, NULL);
+			if ((int32)mb == -1 || mb > UINT_MAX / (1024 * 1024)) {
+				errno = EINVAL;
+				err(1, "--max-decode-memory %s", optarg);
+			}
+			image_get_limit(&lim);
+			lim.max_memory = mb * 1024 * 1024;
+			image_set_limit(&lim);
+			break;
+		 }
+
 		 case OPT_max_image_cols:
 			max_image_count = stou32def(optarg, -1, NULL);
 			if (max_image_count < 0) {
@@ -394,6 +482,30 @@ main(int ac, char *av[])
 			}
 			break;
 
+		 case OPT_max_image_rate:
+		 {
+			// KB 単位で指定する。
+			uint32 kb = stou32def(optarg, -1, NULL);
+			if ((int32)kb == -1 || kb > UINT_MAX / 1024) {
+				errno = EINVAL;
+				err(1, "--max-image-rate %s", optarg);
+			}
+			opt_max_image_rate = kb * 1024;
+			break;
+		 }
+
+		 case OPT_max_image_size:
+		 {
+			// KB 単位で指定する。
+			uint32 kb = stou32def(optarg, -1, NULL);
+			if ((int32)kb == -1 || kb > UINT_MAX / 1024) {
+				errno = EINVAL;
+				err(1, "--max-image-size %s", optarg);
+			}
+			netopt_image.max_length = kb * 1024;
+			break;
+		 }
+
 		 case OPT_misskey:
 			// 今のところ何もしない。
 			break;
@@ -428,6 +540,18 @@ main(int ac, char *av[])
 			cmd = CMD_PLAY;
 			break;
 
+		 case OPT_pong_timeout:
+			opt_pong_timeout = stou32def(optarg, -1, NULL);
+			if ((int)opt_pong_timeout < 0) {
+				errno = EINVAL;
+				err(1, "--pong-timeout %s", optarg);
+			}
+			// PING の間隔 (30秒) より長くは待てない。
+			if (opt_pong_timeout > 30) {
+				errx(1, "--pong-timeout %s: must be 0..30", optarg);
+			}
+			break;
+
 		 case OPT_progress:
 			opt_progress = true;
 			break;
@@ -477,6 +601,15 @@ main(int ac, char *av[])
 			version();
 			exit(0);
 
+		 case OPT_warm_cache:
+			if (strcmp(optarg, "-") == 0) {
+				playfile = NULL;
+			} else {
+				playfile = optarg;
+			}
+			cmd = CMD_WARM;
+			break;
+
 		 case OPT_help:
 		 default:
 			usage();
@@ -496,10 +629,19 @@ main(int ac, char *av[])
 		err(1, "init failed");
 	}
 
-	if (cmd == CMD_STREAM || cmd == CMD_PLAY) {
+	if (cmd == CMD_STREAM || cmd == CMD_PLAY || cmd == CMD_WARM) {
 		init_ngword();
+		if (cmd == CMD_WARM) {
+			// 表示はしないが画像は作る。
+			opt_show_image = 1;
+		}
 		init_screen();
 
+		// 画像キャッシュを開く。開けなくても毎回取得するだけ。
+		if (opt_show_image && cache_init(cachedir) == false) {
+			warn("cache_init(%s) failed", cachedir);
+		}
+
 		if (cmd == CMD_STREAM) {
 			if (server == NULL) {
 				errx(1, "server must be specified");
@@ -514,12 +656,9 @@ main(int ac, char *av[])
 				errx(1, "Home timeline requires your access token");
 			}
 
-			// 古いキャッシュを削除する。
-			progress("Deleting expired cache files...");
-			invalidate_cache();
-			progress("done\n");
-
 			cmd_misskey_stream(server, is_home, token);
+		} else if (cmd == CMD_WARM) {
+			cmd_misskey_warm(playfile);
 		} else {
 			cmd_misskey_play(playfile);
 		}
@@ -554,6 +693,7 @@ usage(void)
 "  -h,--home           : Home timeline mode (needs --server and --token)\n"
 "  -l,--local          : Local timeline mode (needs --server)\n"
 "  -p,--play=<file|->  : Playback mode\n"
+"  --warm-cache=<file|->: Create image cache from recorded <file>\n"
 " <options>\n"
 "  -s,--server=<host>  : Set misskey server\n"
 "  -t,--token=<file>   : Set misskey access token file\n"
@@ -575,6 +715,9 @@ help_all(void)
 "  -h,--home              : Home timeline mode (needs --server and --token)\n"
 "  -l,--local             : Local timeline mode (needs --server)\n"
 "  -p,--play=<file|->     : Playback mode ('-' means stdin)\n"
+"  --warm-cache=<file|->  : Create image cache from recorded <file> without\n"
+"                           showing. Use the same --font and --color\n"
+"                           as playing. ('-' means stdin)\n"
 " <options>\n"
 "  -c,--color=<colormode> : Set color mode (default:256)\n"
 "     256      : Fixed 256 colors (MSX SCREEN8 compatible palette)\n"
@@ -585,19 +728,37 @@ help_all(void)
 "     gray[<n>]: (2..256) shades of grayscale. If <n> is omitted, 256 is used\n"
 "                'gray2' is a synonym for '2'\n"
 "  --ciphers=<ciphers>    : \"RSA\" can only be specified\n"
+"  --compress-cache       : Compress new SIXEL cache entries\n"
 "  --dark / --light       : Assume background color (default:auto detect)\n"
+"  --deadline-image=<msec>: Give up an image if downloading takes longer\n"
+"                           0 means no limit (default:15000)\n"
+"  --defer-image          : Show Blurhash first and replace it with the image\n"
+"                           when ready (needs --image-workers)\n"
 "  --eaw-a=<1|2>          : Width of Unicode EAW Anbiguous char (default:2)\n"
 "  --eaw-n=<1|2>          : Width of Unicode EAW Neutral char   (defualt:1)\n"
 "  --euc-jp / --jis       : Set output charset\n"
 "  --font=<W>x<H>         : Set font size (Normally autodetected)\n"
 "  --force-blurhash       : Show blurhash image instead of actual image\n"
 "  --help-all             : This help\n"
+"  --image-workers=<n>    : Number of threads to fetch images in advance\n"
+"                           0 means no prefetch (default:4, 0 on slow arch)\n"
 "  --ipv4 / --ipv6        : Connect only IPv4/v6 for both stream and images\n"
+"  --keepalive-image=<sec>: Keep idle image connections for reuse\n"
+"                           0 means no reuse (default:30)\n"
 "  --list-supported-images: Show supported filetype and decoder list\n"
 "  --mathalpha            : Use alternate character for some MathAlpha chars\n"
 "  --misskey              : Set misskey mode (No other choices at this point)\n"
+"  --max-decode-memory=<MB>: Limit memory to decode an image in MB.\n"
+"                           Larger images are shown by Blurhash.\n"
+"                           0 means no limit (default:512, 8 on slow arch)\n"
 "  --max-image-cols=<n>   : Set max number of images per line\n"
 "                           0 means much as possible (default:0)\n"
+"  --max-image-rate=<KB>  : Limit image download per minute in KB.\n"
+"                           Images over the limit are shown by Blurhash.\n"
+"                           0 means no limit (default:0)\n"
+"  --max-image-size=<KB>  : Limit size of an image to download in KB.\n"
+"                           Images over the limit are shown by Blurhash.\n"
+"                           0 means no limit (default:0)\n"
 "  --no-conbine           : Don't combine Unicode combined characters\n"
 "  --nsfw=<mode>          : How to show NSFW images (default:blur)\n"
 "     show     : Show image as is\n"
@@ -605,6 +766,8 @@ help_all(void)
 "     alt      : Hide image but display only filetype\n"
 "     hide     : Hide this note itself if the note has NSFW contents\n"
 "  --overwrite-cache      : Don't use cache file and overwrite it by new one\n"
+"  --pong-timeout=<sec>   : Reconnect if PONG doesn't return in <sec> after\n"
+"                           PING, 0..30. 0 means no limit (default:10)\n"
 "  --progress             : Show startup progress (for slow machines)\n"
 "  -r,--record=<file>     : Record JSON to <file>\n"
 "  -s,--server=<host>     : Set misskey server\n"
@@ -801,27 +964,6 @@ init_screen(void)
 	sigwinch(true);
 }
 
-// 古いキャッシュを削除する。
-static void
-invalidate_cache(void)
-{
-	char cmd[PATH_MAX + 80];
-
-	// アイコンは1週間分くらいか。
-	snprintf(cmd, sizeof(cmd),
-		"find %s -name icon-\\* -type f -atime +7 -exec rm {} +", cachedir);
-	if (system(cmd) < 0) {
-		warn("system(find icon)");
-	}
-
-	// 写真は2日分くらいか。
-	snprintf(cmd, sizeof(cmd),
-		"find %s -name file\\* -type f -atime +2 -exec rm {} +", cachedir);
-	if (system(cmd) < 0) {
-		warn("system(find photo)");
-	}
-}
-
 // filename からトークンを取得して返す。
 // 失敗するとその場でエラー終了する。
 static string *
@@ -879,6 +1021,7 @@ sigwinch(bool initializing)
 	struct winsize ws;
 	bool is_tty;
 	int ws_cols = 0;
+	int ws_rows = 0;
 	int ws_width = 0;
 	int ws_height = 0;
 	const char *msg_cols = "";
@@ -895,6 +1038,7 @@ sigwinch(bool initializing)
 			warn("TIOCGWINSZ failed");
 		} else {
 			ws_cols = ws.ws_col;
+			ws_rows = ws.ws_row;
 
 			if (ws.ws_col != 0) {
 				ws_width = ws.ws_xpixel / ws.ws_col;
@@ -913,6 +1057,7 @@ sigwinch(bool initializing)
 		screen_cols = 0;
 		msg_cols = " (not detected)";
 	}
+	screen_rows = ws_rows;
 
 	// フォント幅と高さは指定されてない時だけ取得した値を使う。
 	bool use_default_font = false;
@@ -59,8 +59,125 @@ enum {
 typedef uint32 unichar;
 
 struct json;
+struct msgqueue;
 struct ngwords;
 
+// 画像の通信量の予算の統計情報。
+struct budget_stat {
+	uint64 allowed;		// 予算内だった数
+	uint64 over_size;	// 1枚あたりの上限を超えていた数
+	uint64 over_rate;	// 1分あたりの上限を超えていた数
+	uint64 bytes;		// 受信したバイト数の合計
+};
+
+// SIXEL キャッシュのエントリ。
+struct cache_entry {
+	uint64 hash;		// キーのハッシュ
+	uint64 offset;		// パックファイル内のレコードの位置
+	uint length;		// SIXEL データの長さ
+	uint width;			// 画像の幅 [pixel]
+	uint height;		// 画像の高さ [pixel]
+	uint32 gen;			// 検索した時のパックファイルの世代
+};
+
+// SIXEL キャッシュの統計情報。
+struct cache_stat {
+	uint64 lookups;		// 検索回数
+	uint64 hits;		// ヒットした回数
+	uint64 puts;		// 追加した回数
+	uint64 put_bytes;	// 追加したバイト数
+	uint64 resets;		// 一杯になって空にした回数
+	uint64 expired;		// 期限切れで外した数
+	uint64 evicted;		// 予算超過で外した数
+	uint64 compactions;	// パックファイルを詰めた回数
+	uint64 reclaimed;	// 詰めて減ったバイト数
+	uint64 legacy_removed;	// 削除した古い形式のファイル数
+	uint64 lock_waits;	// 他のプロセスの取得を待った回数
+	uint64 lock_shared;	// 待った結果、他のプロセスの取得分を使った回数
+	uint count;			// 現在のエントリ数
+};
+
+// アイコンのメモリキャッシュのエントリ。
+struct hotcache_entry {
+	const char *data;	// SIXEL データ
+	uint length;		// SIXEL データの長さ
+	uint width;			// 画像の幅 [pixel]
+	uint height;		// 画像の高さ [pixel]
+};
+
+// アイコンのメモリキャッシュの統計情報。
+struct hotcache_stat {
+	uint64 lookups;		// 検索回数
+	uint64 hits;		// ヒットした回数
+	uint64 loads;		// ディスクから読み込んだ回数
+	uint64 evicted;		// 溢れて捨てた数
+	uint64 bytes;		// 保持しているバイト数
+	uint count;			// 保持しているエントリ数
+};
+
+// SIXEL キャッシュの圧縮の統計情報。
+struct sixel_pack_stat {
+	uint64 packed;		// 圧縮して置いた数
+	uint64 raw_bytes;	// その圧縮前のバイト数
+	uint64 packed_bytes;	// その圧縮後のバイト数
+	uint64 unpacked;	// 展開して読んだ数
+};
+
+// メッセージキューの統計情報。
+struct msgqueue_stat {
+	uint64 pushed;		// 追加した数
+	uint64 popped;		// 取り出した数
+	uint64 dropped;		// 溢れて捨てた数
+	uint max_depth;		// 最大の滞留数
+};
+
+// 画像取得の失敗の記録の統計情報。
+struct negcache_stat {
+	uint64 url_failures;	// 記録した URL の失敗数
+	uint64 host_failures;	// そのうちホスト側の失敗だった数
+	uint64 host_blocks;		// ホストを止めた回数
+	uint64 skipped_url;		// URL が失敗済みで取得しなかった数
+	uint64 skipped_host;	// ホストが止まっていて取得しなかった数
+};
+
+// WebSocket クライアントの統計情報。
+struct wsclient_stat {
+	uint64 deflate_msgs;	// 圧縮されていたメッセージ数
+	uint64 deflate_in;		// 圧縮されていたペイロードのバイト数
+	uint64 deflate_out;		// それを伸長したバイト数
+	uint64 inplace_msgs;	// 受信バッファ上でそのまま渡したメッセージ数
+	uint64 assembled_msgs;	// 複数フレームから組み立てたメッセージ数
+
+	uint64 wakeups;			// 受信待ちから戻った回数
+	uint64 frames;			// そこで処理したフレーム数の合計
+	uint max_frames;		// 1回で処理したフレーム数の最大値
+
+	uint64 pings;			// 送った PING の数
+	uint64 pongs;			// それに応答があった数
+	uint64 pong_timeouts;	// 期限までに応答がなかった数
+	uint64 rtt_total_usec;	// 往復時間の合計
+	uint rtt_min_usec;		// 往復時間の最小値
+	uint rtt_max_usec;		// 往復時間の最大値
+	uint max_gap_msec;		// 受信が途切れた最長時間
+};
+
+// 画像先読みワーカーが保持するジョブの最大数。
+// 完了したが表示されなかったジョブ (先読みしたノートが捨てられた場合など)
+// はこれを超えると古いほうから忘れる。
+#define FETCHPOOL_MAX_JOBS	(64)
+
+// 画像先読みワーカーの統計情報。
+struct fetchpool_stat {
+	uint64 requested;	// 依頼された数
+	uint64 rejected;	// 一杯で断った数
+	uint64 forgotten;	// 完了したが表示されずに忘れた数
+	uint64 failed;		// 失敗した数
+	uint64 ready;		// 表示時にはすでに完了していた数
+	uint64 waited;		// 表示時にまだ処理中で待った数
+	uint64 wait_msec;	// 待った時間の合計
+	uint64 self;		// 表示時に未着手で表示側で処理した数
+};
+
 // Unicode 文字列型。common.h の string と揃えること。
 struct ustring_ {
 	unichar *buf;	// len == 0 の時 buf を触らないこと。
@@ -69,9 +186,43 @@ struct ustring_ {
 };
 typedef struct ustring_ ustring;
 
+// budget.c
+extern void budget_init(uint, uint);
+extern bool budget_allow(uint64);
+extern void budget_add(uint64);
+extern void budget_get_stat(struct budget_stat *);
+
+// cache.c
+extern bool cache_init(const char *);
+extern void cache_cleanup(void);
+extern bool cache_lookup(const char *, struct cache_entry *);
+extern bool cache_put(const char *, const void *, uint, uint, uint);
+extern int  cache_read(const struct cache_entry *, uint, char *, uint);
+extern bool cache_send(const struct cache_entry *, uint, int);
+extern void cache_get_stat(struct cache_stat *);
+extern void cache_janitor_start(void);
+extern bool cache_lock_key(const char *, const char *);
+extern void cache_unlock_key(const char *);
+
 // eaw_data.c
 extern const uint8 eaw2width_packed[0x8000];
 
+// fetchpool.c
+extern uint opt_image_workers;
+extern bool fetchpool_init(void);
+extern bool fetchpool_enabled(void);
+extern void fetchpool_request(const char *, const char *, uint, uint, bool);
+extern bool fetchpool_busy(const char *);
+extern int  fetchpool_wait(const char *);
+extern uint fetchpool_drain(uint, uint);
+extern void fetchpool_get_stat(struct fetchpool_stat *);
+
+// hotcache.c
+extern const struct hotcache_entry *hotcache_get(const char *);
+extern const struct hotcache_entry *hotcache_put(const char *, const char *,
+	uint, uint, uint);
+extern void hotcache_get_stat(struct hotcache_stat *);
+
 // json.c
 extern struct json *json_create(const struct diag *);
 extern void json_destroy(struct json *);
@@ -113,6 +264,25 @@ extern unichar conv_mathalpha(unichar);
 // misskey.c
 extern void cmd_misskey_stream(const char *, bool, const char *);
 extern void cmd_misskey_play(const char *);
+extern void cmd_misskey_warm(const char *);
+
+// msgqueue.c
+extern struct msgqueue *msgqueue_create(uint);
+extern void msgqueue_destroy(struct msgqueue *);
+extern bool msgqueue_push(struct msgqueue *, string *);
+extern string *msgqueue_pop(struct msgqueue *, uint32 *);
+extern string *msgqueue_peek(struct msgqueue *, uint, uint64 *);
+extern bool msgqueue_wait(struct msgqueue *, uint);
+extern void msgqueue_close(struct msgqueue *);
+extern uint msgqueue_get_count(struct msgqueue *);
+extern void msgqueue_get_stat(struct msgqueue *, struct msgqueue_stat *);
+
+// negcache.c
+extern bool negcache_allow(const char *);
+extern void negcache_fail(const char *, bool);
+extern void negcache_success(const char *);
+extern bool negcache_is_host_failure(int, int, bool, bool);
+extern void negcache_get_stat(struct negcache_stat *);
 
 // print.c
 extern uint image_count;
@@ -124,6 +294,8 @@ extern uint opt_eaw_a;
 extern uint opt_eaw_n;
 extern bool opt_mathalpha;
 extern bool opt_nocombine;
+extern bool opt_defer_image;
+extern uint64 cursor_row;
 extern void init_color(void);
 extern const char *style_begin(uint);
 extern const char *style_end(uint);
@@ -131,8 +303,18 @@ extern void ustring_append_ascii_style(ustring *, const char *, uint);
 extern void ustring_append_utf8_style(ustring *, const char *, uint);
 extern void ustring_append_ustring_style(ustring *, const ustring *, uint);
 extern void print_indent(uint);
+extern void print_newline(void);
+extern void cursor_moved(int);
 extern void iprint(const ustring *);
+extern bool make_image_cache(const char *, const char *, uint, uint, bool);
 extern bool show_image(const char *, const char *, uint, uint, bool, int);
+extern bool show_image_deferred(const char *, const char *, const char *,
+	uint, uint, bool, int);
+extern bool image_slot_available(void);
+extern bool image_slot_pending(void);
+extern void image_slot_paint(void);
+extern void image_slot_clear(void);
+extern void sixel_get_pack_stat(struct sixel_pack_stat *);
 
 // sayaka.c
 extern const char *cachedir;
@@ -154,18 +336,24 @@ extern struct net_opt netopt_main;
 extern struct ngwords *ngwords;
 extern int opt_bgtheme;
 extern const char *opt_codeset;
+extern bool opt_compress_cache;
 extern bool opt_force_blurhash;
 extern uint opt_nsfw;
+extern uint opt_keepalive_image;
+extern uint opt_max_image_rate;
+extern uint opt_pong_timeout;
 extern bool opt_overwrite_cache;
 extern const char *opt_record_file;
 extern bool opt_show_cw;
 extern int  opt_show_image;
 extern uint screen_cols;
+extern uint screen_rows;
 
 // subr.c
 extern uint32 rnd_get32(void);
 extern void rnd_fill(void *, uint);
 extern uint32 hash_fnv1a(const char *);
+extern uint64 hash_fnv1a64(const char *);
 extern string *hash_md5(const char *);
 extern string *base64_encode(const void *, uint);
 extern time_t decode_isotime(const char *);
@@ -207,9 +395,11 @@ static inline void ustring_clear(ustring *u) {
 extern struct wsclient *wsclient_create(const struct diag *);
 extern void wsclient_destroy(struct wsclient *);
 extern void wsclient_init(struct wsclient *, void (*)(const string *));
+extern void wsclient_set_pong_timeout(struct wsclient *, uint);
 extern int  wsclient_connect(struct wsclient *, const char *,
 	const struct net_opt *);
 extern int  wsclient_process(struct wsclient *);
 extern ssize_t wsclient_send_text(struct wsclient *, const char *);
+extern void wsclient_get_stat(const struct wsclient *, struct wsclient_stat *);
 
 #endif // !sayaka_harada_h
@@ -32,6 +32,7 @@
 #include "sixelv.h"
 #include "image.h"
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
@@ -670,6 +671,7 @@ do_file(const char *infile)
 			hint.height = opt_height;
 			hint.page   = opt_page;
 			hint.no_progressive = opt_no_progressive;
+			errno = 0;
 			srcimg = image_read(pstream, loader_idx, &hint, diag_image);
 			if (srcimg) {
 				// 得られた画像サイズと引数指定から、いい感じにサイズを決定。
@@ -683,7 +685,12 @@ do_file(const char *infile)
 	PROF(&load_end);
 
 	if (srcimg == NULL) {
-		warnx("%s: Unknown image format", infilename);
+		if (errno == EFBIG) {
+			// 資源制限 (image_limit_check()) を超えた。
+			warnx("%s: Image too large to decode", infilename);
+		} else {
+			warnx("%s: Unknown image format", infilename);
+		}
 		goto abort;
 	}
 
@@ -94,6 +94,22 @@ hash_fnv1a(const char *s)
 	return hash;
 }
 
+// 文字列の FNV1a ハッシュ(64ビット) を返す。
+uint64
+hash_fnv1a64(const char *s)
+{
+	static const uint64 prime  = 1099511628211u;
+	static const uint64 offset = 14695981039346656037u;
+
+	uint64 hash = offset;
+	uint64 c;
+	while ((c = *s++) != '\0') {
+		hash ^= c;
+		hash *= prime;
+	}
+	return hash;
+}
+
 // 文字列の MD5 ハッシュ文字列を返す。
 string *
 hash_md5(const char *input)
@@ -25,13 +25,17 @@
  */
 
 #include "sayaka.h"
+#include "image.h"
 #include <err.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #define fail(fmt...)	do {	\
 	printf("%s: ", __func__);	\
@@ -41,6 +45,9 @@
 
 static volatile int signaled;
 
+// sayaka.c にあるもの。
+struct diag *diag_net;
+
 static void
 signal_handler(int signo)
 {
@@ -138,6 +145,64 @@ test_decode_isotime(void)
 	}
 }
 
+static void
+test_hash_fnv1a64(void)
+{
+	printf("%s\n", __func__);
+
+	struct {
+		const char *src;
+		uint64 expected;
+	} table[] = {
+		{ "",			0xcbf29ce484222325 },
+		{ "a",			0xaf63dc4c8601ec8c },
+		{ "foobar",		0x85944171f73967e8 },
+	};
+	for (uint i = 0; i < countof(table); i++) {
+		const char *src = table[i].src;
+		uint64 expected = table[i].expected;
+
+		uint64 actual = hash_fnv1a64(src);
+		if (expected != actual) {
+			fail("\"%s\": expects %016" PRIx64 " but %016" PRIx64,
+				src, expected, actual);
+		}
+	}
+}
+
+static void
+test_image_resize16(void)
+{
+	printf("%s\n", __func__);
+
+	// 4x2 を 2x1 に縮小すると、2x2 ずつの平均になる。
+	// 右半分は 4画素中 3画素が透明なので透明。
+	static const uint16 src16[] = {
+		0x0000, 0x7fff, 0x8000, 0x8000,
+		0x0421, 0x0c63, 0x8000, 0x7c00,
+	};
+	static const uint16 expected[] = {
+		(0x08 << 10) | (0x08 << 5) | 0x08,
+		0x8000 | (0x07 << 10),
+	};
+
+	struct image *src = image_create(4, 2, IMAGE_FMT_ARGB16);
+	memcpy(src->buf, src16, sizeof(src16));
+	struct image *dst = image_resize16(src, 2, 1);
+	if (dst == NULL) {
+		fail("returned NULL");
+	} else {
+		const uint16 *actual = (const uint16 *)dst->buf;
+		for (uint i = 0; i < countof(expected); i++) {
+			if (expected[i] != actual[i]) {
+				fail("[%u]: expects %04x but %04x", i, expected[i], actual[i]);
+			}
+		}
+	}
+	image_free(dst);
+	image_free(src);
+}
+
 static void
 test_json_unescape(void)
 {
@@ -171,6 +236,203 @@ test_json_unescape(void)
 	}
 }
 
+static void
+test_lz_compress(void)
+{
+	printf("%s\n", __func__);
+
+	static const char * const table[] = {
+		"",
+		"a",
+		"abc",
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+		"#1!20~-#2!20~-#1!20~-#2!20~-#1!20~-#2!20~-#1!20~-#2!20~-$",
+		"0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopq",
+	};
+	for (uint i = 0; i < countof(table); i++) {
+		const char *src = table[i];
+		uint srclen = strlen(src);
+		uint8 z[256];
+		char dst[256];
+
+		uint zlen = lz_compress((const uint8 *)src, srclen, z, sizeof(z));
+		if (zlen == 0) {
+			fail("\"%s\": compress failed", src);
+			continue;
+		}
+		int n = lz_decompress(z, zlen, (uint8 *)dst, sizeof(dst));
+		if (n != srclen || memcmp(src, dst, srclen) != 0) {
+			fail("\"%s\": decompress mismatch (len=%d)", src, n);
+		}
+		// 繰り返しがあれば縮む。
+		if (i >= 3 && zlen >= srclen) {
+			fail("\"%s\": expects < %u but %u", src, srclen, zlen);
+		}
+		// 出力先が足りなければ失敗する。
+		if (srclen > 0 &&
+			lz_decompress(z, zlen, (uint8 *)dst, srclen - 1) != -1)
+		{
+			fail("\"%s\": expects -1 for short buffer", src);
+		}
+	}
+
+	// 出力先が足りなければ圧縮も失敗する。
+	uint8 z[4];
+	if (lz_compress((const uint8 *)table[5], strlen(table[5]), z, sizeof(z))
+		!= 0)
+	{
+		fail("expects 0 for short buffer");
+	}
+}
+
+static void
+test_negcache(void)
+{
+	printf("%s\n", __func__);
+
+	// 大きすぎて断ったものは、何回続いてもホストは止めない。
+	const char *big1 = "https://media.example/big1.jpg";
+	const char *big2 = "https://media.example/big2.jpg";
+	const char *other = "https://media.example/other.jpg";
+	for (uint i = 0; i < 2; i++) {
+		const char *url = (i == 0) ? big1 : big2;
+		negcache_fail(url, negcache_is_host_failure(-1, EFBIG, true, false));
+	}
+	if (negcache_allow(big1) != false) {
+		fail("too large: %s must be skipped", big1);
+	}
+	if (negcache_allow(other) != true) {
+		fail("too large: %s must be allowed", other);
+	}
+
+	// デコードの資源制限 (errno == EFBIG) も同様。
+	if (negcache_is_host_failure(0, EFBIG, false, false) != false) {
+		fail("EFBIG must not be a host failure");
+	}
+
+	// 4xx もこの URL だけの問題。
+	if (negcache_is_host_failure(404, 0, false, false) != false) {
+		fail("404 must not be a host failure");
+	}
+
+	// 接続できない、時間切れ、5xx はホストの問題。
+	if (negcache_is_host_failure(-1, ETIMEDOUT, false, true) != true) {
+		fail("deadline must be a host failure");
+	}
+	if (negcache_is_host_failure(503, 0, false, false) != true) {
+		fail("503 must be a host failure");
+	}
+	const char *down1 = "https://down.example/a.jpg";
+	const char *down2 = "https://down.example/b.jpg";
+	const char *down3 = "https://down.example/c.jpg";
+	negcache_fail(down1,
+		negcache_is_host_failure(-1, ECONNREFUSED, false, false));
+	negcache_fail(down2,
+		negcache_is_host_failure(-1, ECONNREFUSED, false, false));
+	if (negcache_allow(down3) != false) {
+		fail("connection refused: %s must be skipped", down3);
+	}
+}
+
+// test_net_deadline() の相手側。
+// 接続を1つ受け付け、1バイトずつ間隔をあけて送り続ける。
+struct trickle_peer {
+	int listen_fd;
+	bool tls;			// 先に TLS の巨大なレコードヘッダを送る
+};
+
+static void *
+trickle_peer_main(void *arg)
+{
+	const struct trickle_peer *peer = arg;
+
+	int fd = accept(peer->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (peer->tls) {
+		// Handshake, TLSv1.2, 16384 バイト。
+		static const uint8 hdr[] = { 0x16, 0x03, 0x03, 0x40, 0x00 };
+		send(fd, hdr, sizeof(hdr), MSG_NOSIGNAL);
+	}
+	// 相手が切断するか、3秒くらいで終わり。
+	for (int i = 0; i < 60; i++) {
+		if (send(fd, "x", 1, MSG_NOSIGNAL) < 0) {
+			break;
+		}
+		usleep(50 * 1000);
+	}
+	close(fd);
+	return NULL;
+}
+
+static void
+test_net_deadline(void)
+{
+	printf("%s\n", __func__);
+
+	static const char * const schemes[] = {
+		"http",
+#if defined(HAVE_OPENSSL)
+		"https",
+#endif
+	};
+	for (uint i = 0; i < countof(schemes); i++) {
+		const char *scheme = schemes[i];
+		struct trickle_peer peer;
+		struct sockaddr_in sin;
+		socklen_t sinlen;
+		pthread_t th;
+		char serv[16];
+
+		peer.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sinlen = sizeof(sin);
+		if (bind(peer.listen_fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+			listen(peer.listen_fd, 1) < 0 ||
+			getsockname(peer.listen_fd, (struct sockaddr *)&sin, &sinlen) < 0)
+		{
+			fail("%s: listen: %s", scheme, strerror(errno));
+			close(peer.listen_fd);
+			continue;
+		}
+		snprintf(serv, sizeof(serv), "%u", ntohs(sin.sin_port));
+		peer.tls = (strcmp(scheme, "https") == 0);
+		pthread_create(&th, NULL, trickle_peer_main, &peer);
+
+		// 相手は 50msec ごとに 1 バイト届くので、受信 1 回ごとのタイムアウト
+		// では期限を過ぎても終わらない。期限は 300msec。
+		struct timespec start, end;
+		struct net_opt opt;
+		net_opt_init(&opt);
+		struct net *net = net_create(diag_net);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		net_set_deadline(net, timespec_to_usec(&start) + 300 * 1000);
+		int r = net_connect(net, scheme, "127.0.0.1", serv, &opt);
+		if (r == 0) {
+			char buf[16];
+			while ((r = net_read(net, buf, sizeof(buf))) > 0)
+				;
+		}
+		int error = errno;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		net_destroy(net);
+		pthread_join(th, NULL);
+		close(peer.listen_fd);
+
+		uint64 msec = timespec_to_msec(&end) - timespec_to_msec(&start);
+		if (r >= 0 || error != ETIMEDOUT) {
+			fail("%s: expects ETIMEDOUT but r=%d, %s", scheme, r,
+				strerror(error));
+		}
+		if (msec >= 1000) {
+			fail("%s: expects about 300 msec but %u msec", scheme, (uint)msec);
+		}
+	}
+}
+
 static void
 test_putd(void)
 {
@@ -544,9 +806,16 @@ main(int ac, char *av[])
 		}
 	}
 
+	diag_net = diag_alloc();
+
 	test_base64_encode();
 	test_decode_isotime();
+	test_hash_fnv1a64();
+	test_image_resize16();
 	test_json_unescape();
+	test_lz_compress();
+	test_negcache();
+	test_net_deadline();
 	test_putd();
 	test_stou32def();
 	test_stox32def();
@@ -30,10 +30,14 @@
 
 #include "sayaka.h"
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
 
 enum {
 	// フレームの +0バイト目 (の下位4ビット)
@@ -47,15 +51,23 @@ enum {
 	// フレームの +0バイト目の最上位ビットは最終フレームビット。
 	WS_OPFLAG_FIN		= 0x80,
 
+	// その次のビットは RSV1。permessage-deflate では
+	// メッセージの最初のフレームで圧縮されていることを示す。
+	WS_OPFLAG_RSV1		= 0x40,
+
 	// フレームの +1バイト目の最上位ビットはマスクビット。
 	// クライアントからサーバへのフレームには立てる。
 	WS_MASK_BIT			= 0x80,	// Frame[1]
 };
 
-// バッファサイズの初期値と増分。観測結果から 16KB を超えるメッセージは
+// バッファサイズの初期値と上限。観測結果から 16KB を超えるメッセージは
 // あまり多くはないので、このくらいでどうか。
+// 足りなければ倍々で伸ばし、伸ばしたバッファは以降のメッセージでも使い回す。
 #define INIT_BUFSIZE	(16384)
-#define INC_BUFSIZE		(4096)
+#define MAX_BUFSIZE		(64U * 1024 * 1024)
+
+// 何も受信しないまま、この時間が経ったら PING を投げる。
+#define PING_INTERVAL_MSEC	(30 * 1000)
 
 struct wsclient {
 	struct net *net;
@@ -65,21 +77,53 @@ struct wsclient {
 	uint buflen;		// buf の有効バイト数
 	uint bufpos;		// 現在の処理開始位置
 
-	uint8 opcode;		// opcode
-	string *text;		// テキストメッセージ
+	// 複数フレームに分割されたか圧縮されたテキストメッセージを
+	// 組み立てる場所。1フレームで完結するメッセージはここを経由せず
+	// 受信バッファ上のペイロードをそのまま上位に渡す。
+	string *text;
+	bool compressed;	// 受信中のメッセージは圧縮されている
+
+#if defined(HAVE_ZLIB)
+	// permessage-deflate (RFC 7692)
+	bool deflate;		// 折衝できた
+	bool no_takeover;	// server_no_context_takeover (メッセージごとに初期化)
+	bool zinit;			// zs を初期化した
+	z_stream zs;
+#endif
+
+	// PING/PONG による死活監視。
+	uint pong_timeout_msec;	// PING から PONG までの期限 (0 なら監視しない)
+	uint32 ping_seq;		// 最後に送った PING の通し番号 (ペイロード)
+	uint64 ping_usec;		// それを送った時刻。応答待ちでなければ 0
+	uint64 recv_usec;		// 最後に受信した時刻
+
+	struct wsclient_stat stat;
 
 	// テキスト受信コールバック。
-	// テキストが 1フレーム受信できた時に呼ばれる。
+	// テキストが 1メッセージ受信できた時に呼ばれる。
+	// 渡す文字列は受信バッファを直接指していることがあり、
+	// コールバックから戻った後は無効になる。
 	void (*callback)(const string *);
 
 	const struct diag *diag;
 };
 
-static inline void wsclient_send_ping(struct wsclient *);
-static inline void wsclient_send_pong(struct wsclient *);
+static void wsclient_send_ping(struct wsclient *);
+static void ws_recv_pong(struct wsclient *, const uint8 *, uint);
+static inline uint64 ws_now_usec(void);
 static int  wsclient_send(struct wsclient *, uint8, const void *, uint);
+static int  ws_wait(struct wsclient *);
+static int  ws_fill(struct wsclient *, uint);
+static uint ws_frame_ready(const struct wsclient *, uint *);
+static bool ws_text_append(struct wsclient *, const uint8 *, uint);
+static int  ws_process_frame(struct wsclient *);
 static uint ws_encode_len(uint8 *, uint);
 static uint ws_decode_len(const uint8 *, uint *);
+#if defined(HAVE_ZLIB)
+static void ws_parse_extensions(struct wsclient *, const char *);
+static bool ws_inflate(struct wsclient *, const uint8 *, uint, bool);
+static bool ws_inflate1(struct wsclient *, const uint8 *, uint);
+#endif
 
 // wsclient コンテキストを生成する。
 // 失敗すれば errno をセットし NULL を返す。
@@ -99,8 +143,8 @@ wsclient_create(const struct diag *diag)
 		goto abort;
 	}
 
-	// string は自動伸長だし ws->buf とは直接関係ないけど初期値を揃えておく。
-	ws->text = string_alloc(ws->bufsize);
+	// 組み立て用のほうは必要になってから伸ばす。
+	ws->text = string_init();
 	if (ws->text == NULL) {
 		goto abort;
 	}
@@ -119,6 +163,11 @@ void
 wsclient_destroy(struct wsclient *ws)
 {
 	if (ws) {
+#if defined(HAVE_ZLIB)
+		if (ws->zinit) {
+			inflateEnd(&ws->zs);
+		}
+#endif
 		net_destroy(ws->net);
 		free(ws->buf);
 		string_free(ws->text);
@@ -135,6 +184,17 @@ wsclient_init(struct wsclient *ws, void (*callback)(const string *))
 	ws->callback = callback;
 }
 
+// PING を送ってから PONG が返ってくるまでの期限を msec で設定する。
+// 期限までに返ってこなければ wsclient_process() は ETIMEDOUT で -1 を返す。
+// 0 なら期限を設けない。PING の間隔より長くは出来ない。
+void
+wsclient_set_pong_timeout(struct wsclient *ws, uint msec)
+{
+	assert(ws);
+
+	ws->pong_timeout_msec = MIN(msec, PING_INTERVAL_MSEC);
+}
+
 // url に接続する。
 // 失敗すれば errno をセットして -1 を返す。
 // WSS なのに SSL ライブラリがない場合は -2 を返す。
@@ -203,6 +263,10 @@ wsclient_connect(struct wsclient *ws, const char *url,
 		"Connection: Upgrade\r\n"
 		"Sec-WebSocket-Version: 13\r\n");
 	string_append_printf(hdr, "Sec-WebSocket-Key: %s\r\n", string_get(key));
+#if defined(HAVE_ZLIB)
+	// 受信メッセージの圧縮を要求する。送信するほうは圧縮しない。
+	string_append_cstr(hdr, "Sec-WebSocket-Extensions: permessage-deflate\r\n");
+#endif
 	string_append_cstr(hdr,   "\r\n");
 	if (__predict_false(diag_get_level(diag) >= 2)) {
 		diag_http_header(diag, hdr);
@@ -229,7 +293,7 @@ wsclient_connect(struct wsclient *ws, const char *url,
 	string_rtrim_inplace(response);
 	Trace(diag, "--> |%s|", string_get(response));
 
-	// 残りの行は今のところ使ってないので読み捨てる。
+	// 残りの行は拡張の折衝結果以外は使ってないので読み捨てる。
 	for (;;) {
 		string *recvhdr;
 
@@ -249,6 +313,12 @@ wsclient_connect(struct wsclient *ws, const char *url,
 		string_rtrim_inplace(recvhdr);
 		bool newline = (string_len(recvhdr) == 0);
 		Trace(diag, "--> |%s|", string_get(recvhdr));
+#if defined(HAVE_ZLIB)
+		static const char exthdr[] = "Sec-WebSocket-Extensions:";
+		if (strncasecmp(string_get(recvhdr), exthdr, strlen(exthdr)) == 0) {
+			ws_parse_extensions(ws, string_get(recvhdr) + strlen(exthdr));
+		}
+#endif
 		string_free(recvhdr);
 		if (newline) {
 			break;
@@ -281,6 +351,25 @@ wsclient_connect(struct wsclient *ws, const char *url,
 
 	// XXX Sec-WebSocket-Accept のチェックとか。
 
+	ws->recv_usec = ws_now_usec();
+
+#if defined(HAVE_ZLIB)
+	if (ws->deflate) {
+		// 圧縮データは zlib ヘッダなしの raw deflate。
+		// 窓サイズはサーバが何を選んでも最大にしておけば伸長できる。
+		memset(&ws->zs, 0, sizeof(ws->zs));
+		if (inflateInit2(&ws->zs, -MAX_WBITS) != Z_OK) {
+			Debug(diag, "%s: inflateInit2 failed", __func__);
+			errno = ENOMEM;
+			rv = -1;
+			goto abort;
+		}
+		ws->zinit = true;
+		Debug(diag, "%s: permessage-deflate enabled%s", __func__,
+			(ws->no_takeover ? " (no context takeover)" : ""));
+	}
+#endif
+
 	rv = rescode;
  abort:
 	string_free(response);
@@ -291,51 +380,118 @@ wsclient_connect(struct wsclient *ws, const char *url,
 }
 
 // net に着信したフレームの処理をする (受信までブロックする)。
+// 受信バッファと TLS 層に溜まっている完全なフレームはすべて処理してから戻る。
 // 戻り値は -1 ならエラー。0 なら EOF。
 // 1 なら何かしら処理をしたが、上位には関係がない。
-// 2 なら ws->text に上位に通知するデータが用意できた。
+// 2 なら1つ以上のメッセージをコールバックで上位に通知した。
 int
 wsclient_process(struct wsclient *ws)
 {
 	const struct diag *diag = ws->diag;
-	struct timespec now;
-	uint64 now_usec;
-	uint64 end_usec;
-	uint64 timeout_usec;
-	int fd;
+	uint nframes = 0;
+	uint need;
 	int rv = 1;
 	int r;
 
-	// 受信バッファが埋まっていれば伸ばす。
-	if (ws->buflen >= ws->bufsize) {
-		uint newsize = ws->bufsize + INC_BUFSIZE;
-		uint8 *newbuf = realloc(ws->buf, newsize);
-		if (newbuf == NULL) {
-			Debug(diag, "%s: realloc(%u): %s", __func__, newsize, strerrno());
+	for (;;) {
+		// 受信バッファに揃っているフレームを全部処理する。
+		while (ws_frame_ready(ws, &need) != 0) {
+			r = ws_process_frame(ws);
+			if (r <= 0) {
+				return r;
+			}
+			if (r == 2) {
+				rv = 2;
+			}
+			nframes++;
+		}
+
+		// 何か処理した後は、すでに届いている分だけを追加で読む。
+		// ソケットにはまだ来ていなくても、TLS 層が復号済みのデータを
+		// 抱えていることがある (select(2) では分からない)。
+		if (net_pending(ws->net) == false) {
+			if (nframes > 0) {
+				break;
+			}
+			r = ws_wait(ws);
+			if (r < 0) {
+				return -1;
+			}
+			if (r == 0) {
+				// タイムアウトで PING を投げた。
+				return 1;
+			}
+		}
+
+		r = ws_fill(ws, need);
+		if (r < 0) {
+			Debug(diag, "%s: net_read failed: %s", __func__, strerrno());
 			return -1;
 		}
-		ws->buf = newbuf;
-		ws->bufsize = newsize;
+		if (r == 0) {
+			Debug(diag, "%s: EOF", __func__);
+			return 0;
+		}
+	}
+
+	// 1回の受信待ちで処理できたフレーム数。
+	ws->stat.wakeups++;
+	ws->stat.frames += nframes;
+	if (nframes > ws->stat.max_frames) {
+		ws->stat.max_frames = nframes;
+	}
+	if (nframes > 1) {
+		Trace(diag, "%s: %u frames in a wakeup", __func__, nframes);
 	}
 
-	// キープアライブのため一定時間だけ受信を待つ。
+	return rv;
+}
+
+// キープアライブのため一定時間だけ受信を待つ。
+// 受信できるようになれば 1 を返す。
+// 一定時間何も起きなければ PING を投げて 0 を返す。
+// PING に対する PONG が期限までに返ってこなければ ETIMEDOUT で -1 を返す。
+// select(2) が失敗すれば -1 を返す。
+static int
+ws_wait(struct wsclient *ws)
+{
+	const struct diag *diag = ws->diag;
+	uint64 now_usec;
+	uint64 end_usec;
+	uint64 pong_usec;
+	uint64 timeout_usec;
+	int fd;
+	int r;
+
 	fd = net_get_fd(ws->net);
-	timeout_usec = 30 * 1000 * 1000;
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	now_usec = timespec_to_usec(&now);
-	end_usec = now_usec + timeout_usec;
+	now_usec = ws_now_usec();
+	end_usec = now_usec + PING_INTERVAL_MSEC * 1000;
+
+	// PONG を待っていれば、その期限までしか待たない。
+	pong_usec = 0;
+	if (ws->ping_usec != 0 && ws->pong_timeout_msec != 0) {
+		pong_usec = ws->ping_usec + (uint64)ws->pong_timeout_msec * 1000;
+		end_usec = MIN(end_usec, pong_usec);
+	}
+
 	for (;;) {
 		struct timeval tv;
 		fd_set rfds;
 		FD_ZERO(&rfds);
 		FD_SET(fd, &rfds);
 
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		now_usec = timespec_to_usec(&now);
+		now_usec = ws_now_usec();
+		if (pong_usec != 0 && now_usec >= pong_usec) {
+			// PONG が返ってこないので、この接続はもう死んでいる。
+			Debug(diag, "%s: No PONG in %u msec", __func__,
+				ws->pong_timeout_msec);
+			ws->stat.pong_timeouts++;
+			errno = ETIMEDOUT;
+			return -1;
+		}
 		if (now_usec >= end_usec) {
-			// 一定時間何も起きなかったので PING を投げる。
 			wsclient_send_ping(ws);
-			return 1;
+			return 0;
 		}
 
 		timeout_usec = end_usec - now_usec;
@@ -350,34 +506,122 @@ wsclient_process(struct wsclient *ws)
 			return -1;
 		}
 		if (r > 0) {
-			break;
+			return 1;
 		}
 	}
+}
 
-	r = net_read(ws->net, ws->buf + ws->buflen, ws->bufsize - ws->buflen);
-	if (r < 0) {
-		Debug(diag, "%s: net_read failed: %s", __func__, strerrno());
-		return -1;
+// 受信バッファの空きに net から読み込む。
+// need は受信途中のフレームの全長 (分かっていなければ 0)。
+// 戻り値は net_read() と同じ。
+static int
+ws_fill(struct wsclient *ws, uint need)
+{
+	const struct diag *diag = ws->diag;
+	int r;
+
+	// 処理済みの部分を詰めて空きを作る。
+	if (ws->bufpos != 0) {
+		memmove(ws->buf, ws->buf + ws->bufpos, ws->buflen - ws->bufpos);
+		ws->buflen -= ws->bufpos;
+		ws->bufpos = 0;
 	}
-	if (r == 0) {
-		Debug(diag, "%s: EOF", __func__);
-		return 0;
+
+	// 足りなければ受信バッファを倍々で伸ばす。フレームの全長が
+	// 分かっていれば一度で収まるところまで伸ばす。
+	// ペイロードをその場でゼロ終端するため、末尾に 1バイト残しておく。
+	if (need > MAX_BUFSIZE) {
+		Debug(diag, "%s: frame too large", __func__);
+		errno = EMSGSIZE;
+		return -1;
 	}
-	if (0) {
-		int j;
-		for (j = 0; j < r; j++) {
-			printf(" %02x", ws->buf[ws->buflen + j]);
-			if ((j % 16) == 15) {
-				printf("\n");
-			}
+	uint req = MAX(need, ws->buflen + 1) + 1;
+	if (req > ws->bufsize) {
+		uint newsize = ws->bufsize;
+		while (newsize < req) {
+			newsize *= 2;
 		}
-		if ((j % 16) != 15) {
-			printf("\n");
+		uint8 *newbuf = realloc(ws->buf, newsize);
+		if (newbuf == NULL) {
+			Debug(diag, "%s: realloc(%u): %s", __func__, newsize, strerrno());
+			return -1;
 		}
+		Debug(diag, "%s: bufsize %u -> %u", __func__, ws->bufsize, newsize);
+		ws->buf = newbuf;
+		ws->bufsize = newsize;
 	}
-	ws->buflen += r;
 
-	// 読めたので処理する。
+	r = net_read(ws->net, ws->buf + ws->buflen, ws->bufsize - ws->buflen - 1);
+	if (r > 0) {
+		Verbose(diag, "%s: read=%d, pos=%u/len=%u", __func__,
+			r, ws->bufpos, ws->buflen + r);
+		ws->buflen += r;
+
+		// 受信の途切れた最長時間を記録しておく。
+		uint64 now_usec = ws_now_usec();
+		uint gap_msec = (now_usec - ws->recv_usec) / 1000;
+		if (gap_msec > ws->stat.max_gap_msec) {
+			ws->stat.max_gap_msec = gap_msec;
+		}
+		ws->recv_usec = now_usec;
+	}
+	return r;
+}
+
+// 受信バッファの先頭に完全なフレームが揃っていればその全長を返す。
+// 揃っていなければ 0 を返す。
+// *needp には、ヘッダが読めていればフレームの全長、読めていなければ 0 を返す。
+static uint
+ws_frame_ready(const struct wsclient *ws, uint *needp)
+{
+	const uint8 *s = &ws->buf[ws->bufpos];
+	uint avail = ws->buflen - ws->bufpos;
+	uint hdrlen;
+	uint datalen;
+
+	*needp = 0;
+
+	// 長さフィールドまで読めているか。
+	if (avail < 2) {
+		return 0;
+	}
+	if (s[1] < 126) {
+		hdrlen = 2;
+	} else if (s[1] == 126) {
+		hdrlen = 2 + 2;
+	} else {
+		hdrlen = 2 + 8;
+	}
+	if (avail < hdrlen) {
+		return 0;
+	}
+
+	// ペイロードまで読めているか。
+	ws_decode_len(&s[1], &datalen);
+	if (datalen > MAX_BUFSIZE) {
+		// 上限を超えていることだけ ws_fill() に伝わればいい。
+		*needp = UINT_MAX;
+		return 0;
+	}
+	*needp = hdrlen + datalen;
+	if (avail < *needp) {
+		Trace(ws->diag, "%s: wait more data: filled=%u < datalen=%u",
+			__func__, avail - hdrlen, datalen);
+		return 0;
+	}
+	return *needp;
+}
+
+// 受信バッファ先頭のフレームを1つ処理する。
+// 呼び出し前に ws_frame_ready() で揃っていることを確認しておくこと。
+// 戻り値は wsclient_process() と同じ。
+static int
+ws_process_frame(struct wsclient *ws)
+{
+	const struct diag *diag = ws->diag;
+	bool assembled = false;
+	int rv = 1;
+
 	uint pos = ws->bufpos;
 	uint8 opbyte = ws->buf[pos++];
 	uint8 opcode = opbyte & 0x0f;
@@ -385,39 +629,71 @@ wsclient_process(struct wsclient *ws)
 	uint datalen;
 	pos += ws_decode_len(&ws->buf[pos], &datalen);
 
-	// ペイロードを全部読み込めているか。
-	if (ws->buflen - pos < datalen) {
-		// 足りなければ次のフレームを待つ。
-		Trace(diag, "%s: wait more data: filled=%u < datalen=%u", __func__,
-			ws->buflen - pos, datalen);
-		return 1;
-	}
-
 	// このペイロードは全部受信出来ているので現在位置は進めてよい。
 	ws->bufpos = pos;
 
 	// opcode ごとの処理。
 	// バイナリフレームは未対応。
 	if (opcode == WS_OPCODE_PING) {
+		// PONG には PING のペイロードをそのまま返す。
 		Trace(diag, "%s: PING len=%u recved", __func__, datalen);
-		wsclient_send_pong(ws);
+		wsclient_send(ws, WS_OPCODE_PONG, &ws->buf[ws->bufpos], datalen);
 		rv = 1;
 	} else if (opcode == WS_OPCODE_PONG) {
 		Trace(diag, "%s: PONG len=%u recved", __func__, datalen);
+		ws_recv_pong(ws, &ws->buf[ws->bufpos], datalen);
 		rv = 1;
 	} else if (opcode == WS_OPCODE_CLOSE) {
 		Debug(diag, "%s: CLOSE", __func__);
 		return 0;
 	} else if (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_CONT) {
 		// テキストフレーム。
-		if (ws->opcode == WS_OPCODE_TEXT) {
-			Debug(diag, "%s: TEXT len=%u", __func__, datalen);
-			ws->opcode = opcode;
+		// 圧縮されているかどうかはメッセージの最初のフレームにだけ示される。
+		if (opcode == WS_OPCODE_TEXT) {
+			ws->compressed = (opbyte & WS_OPFLAG_RSV1);
+			Debug(diag, "%s: TEXT len=%u%s", __func__, datalen,
+				(ws->compressed ? " compressed" : ""));
 			string_clear(ws->text);
 		} else {
 			Debug(diag, "%s: CONT len=%u", __func__, datalen);
 		}
-		string_append_mem(ws->text, &ws->buf[ws->bufpos], datalen);
+		if (ws->compressed) {
+			// 伸長後が大きすぎる場合は ws_inflate() が EMSGSIZE にする。
+			errno = EPROTO;
+#if defined(HAVE_ZLIB)
+			if (ws->deflate == false ||
+				ws_inflate(ws, &ws->buf[ws->bufpos], datalen, fin) == false)
+#endif
+			{
+				Debug(diag, "%s: Cannot decompress the message", __func__);
+				return -1;
+			}
+		} else if (opcode == WS_OPCODE_TEXT && fin) {
+			// 1フレームで完結しているので、受信バッファ上のペイロードを
+			// その場でゼロ終端してそのまま渡す。上位はこれを書き換えたり
+			// 保持したりしないので、終わったら元に戻す。
+			uint8 *payload = &ws->buf[ws->bufpos];
+			uint8 saved = payload[datalen];
+			string view = {
+				.buf = (char *)payload,
+				.len = datalen,
+				.capacity = datalen + 1,
+			};
+			payload[datalen] = '\0';
+			if (ws->callback) {
+				(ws->callback)(&view);
+			}
+			payload[datalen] = saved;
+			ws->stat.inplace_msgs++;
+		} else {
+			if (ws_text_append(ws, &ws->buf[ws->bufpos], datalen) == false) {
+				return -1;
+			}
+			if (fin) {
+				ws->stat.assembled_msgs++;
+			}
+			assembled = true;
+		}
 		if (fin) {
 			rv = 2;
 		}
@@ -435,7 +711,8 @@ wsclient_process(struct wsclient *ws)
 		ws->buflen = 0;
 	}
 
-	if (rv == 2) {
+	// 組み立てたメッセージが完成していれば上位に通知する。
+	if (rv == 2 && (ws->compressed || assembled)) {
 		if (ws->callback) {
 			(ws->callback)(ws->text);
 		}
@@ -445,6 +722,130 @@ wsclient_process(struct wsclient *ws)
 	return rv;
 }
 
+// 組み立て中のテキストメッセージ ws->text に src を追加する。
+// 足りなければ倍々で伸ばす。伸ばした領域は以降のメッセージでも使い回す。
+static bool
+ws_text_append(struct wsclient *ws, const uint8 *src, uint srclen)
+{
+	string *text = ws->text;
+	uint req = string_len(text) + srclen + 1;
+
+	if (req > text->capacity) {
+		uint newcap = MAX(text->capacity, INIT_BUFSIZE);
+		while (newcap < req) {
+			newcap *= 2;
+		}
+		if (string_realloc(text, newcap) == false) {
+			Debug(ws->diag, "%s: string_realloc(%u): %s", __func__,
+				newcap, strerrno());
+			return false;
+		}
+	}
+	string_append_mem(text, src, srclen);
+	return true;
+}
+
+// 統計情報を *stat にコピーする。
+void
+wsclient_get_stat(const struct wsclient *ws, struct wsclient_stat *stat)
+{
+	memcpy(stat, &ws->stat, sizeof(*stat));
+}
+
+#if defined(HAVE_ZLIB)
+
+// Sec-WebSocket-Extensions 応答ヘッダの値 val を解析する。
+// "permessage-deflate; server_no_context_takeover" のような形式。
+// サーバは要求した拡張のうち受け入れたものだけを返してくる。
+static void
+ws_parse_extensions(struct wsclient *ws, const char *val)
+{
+	const char *p = val;
+
+	while (*p == ' ')
+		p++;
+	if (strncasecmp(p, "permessage-deflate", 18) != 0) {
+		Debug(ws->diag, "%s: Unknown extension: %s", __func__, p);
+		return;
+	}
+	ws->deflate = true;
+
+	// パラメータ。
+	// server_max_window_bits は伸長側は最大の窓で受けるので見なくてよい。
+	if (strstr(p, "server_no_context_takeover")) {
+		ws->no_takeover = true;
+	}
+}
+
+// 圧縮されたメッセージのフレームのペイロード src (長さ srclen) を
+// 伸長して ws->text に追加する。
+// fin ならこれがメッセージの最後のフレーム。
+// 成功すれば true を返す。
+// 伸長後のメッセージが MAX_BUFSIZE を超えたら errno を EMSGSIZE に
+// セットして false を返す。
+static bool
+ws_inflate(struct wsclient *ws, const uint8 *src, uint srclen, bool fin)
+{
+	// メッセージの末尾から取り除かれている空ブロック。
+	static const uint8 tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+	ws->stat.deflate_in += srclen;
+	if (ws_inflate1(ws, src, srclen) == false) {
+		return false;
+	}
+	if (fin) {
+		if (ws_inflate1(ws, tail, sizeof(tail)) == false) {
+			return false;
+		}
+		ws->stat.deflate_msgs++;
+
+		// コンテキストを引き継がないならメッセージごとに初期化。
+		if (ws->no_takeover) {
+			inflateReset(&ws->zs);
+		}
+	}
+	return true;
+}
+
+// ws_inflate() の下請け。src を入力し、出力を全部 ws->text に追加する。
+static bool
+ws_inflate1(struct wsclient *ws, const uint8 *src, uint srclen)
+{
+	uint8 out[4096];
+	int r;
+
+	ws->zs.next_in = UNCONST(src);
+	ws->zs.avail_in = srclen;
+	do {
+		ws->zs.next_out = out;
+		ws->zs.avail_out = sizeof(out);
+		r = inflate(&ws->zs, Z_SYNC_FLUSH);
+		if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+			Debug(ws->diag, "%s: inflate failed: %d %s", __func__, r,
+				(ws->zs.msg ?: ""));
+			return false;
+		}
+		uint n = sizeof(out) - ws->zs.avail_out;
+		// 小さな圧縮フレームでも伸長すると巨大になり得るので、
+		// 生のフレームと同じ上限で打ち切る。
+		if (string_len(ws->text) + n > MAX_BUFSIZE) {
+			Debug(ws->diag, "%s: inflated message too large", __func__);
+			errno = EMSGSIZE;
+			return false;
+		}
+		string_append_mem(ws->text, out, n);
+		ws->stat.deflate_out += n;
+		if (r == Z_BUF_ERROR) {
+			// これ以上進まない。
+			break;
+		}
+	} while (ws->zs.avail_in > 0 || ws->zs.avail_out == 0);
+
+	return true;
+}
+
+#endif // HAVE_ZLIB
+
 // テキストフレームを送信する。
 ssize_t
 wsclient_send_text(struct wsclient *ws, const char *buf)
@@ -453,19 +854,66 @@ wsclient_send_text(struct wsclient *ws, const char *buf)
 }
 
 // PING を送信する。
-static inline void
+// ペイロードには通し番号を入れ、PONG と対応付けて往復時間を測る。
+// 前の PING の応答を待っている途中なら、そちらは諦める。
+static void
 wsclient_send_ping(struct wsclient *ws)
 {
-	wsclient_send(ws, WS_OPCODE_PING, NULL, 0);
-	Trace(ws->diag, "%s", __func__);
+	uint8 payload[4];
+
+	ws->ping_seq++;
+	payload[0] = ws->ping_seq >> 24;
+	payload[1] = ws->ping_seq >> 16;
+	payload[2] = ws->ping_seq >>  8;
+	payload[3] = ws->ping_seq;
+	ws->ping_usec = ws_now_usec();
+	wsclient_send(ws, WS_OPCODE_PING, payload, sizeof(payload));
+	ws->stat.pings++;
+	Trace(ws->diag, "%s: seq=%u", __func__, ws->ping_seq);
+}
+
+// PONG を受信した。
+// 送った PING への応答なら往復時間を記録する。
+static void
+ws_recv_pong(struct wsclient *ws, const uint8 *payload, uint len)
+{
+	const struct diag *diag = ws->diag;
+
+	if (ws->ping_usec == 0 || len != 4) {
+		// 頼んでいない PONG は無視してよい (RFC 6455 5.5.3)。
+		Trace(diag, "%s: unsolicited PONG", __func__);
+		return;
+	}
+	uint32 seq = (payload[0] << 24) | (payload[1] << 16) |
+		(payload[2] << 8) | payload[3];
+	if (seq != ws->ping_seq) {
+		Trace(diag, "%s: stale PONG seq=%u (expects %u)", __func__,
+			seq, ws->ping_seq);
+		return;
+	}
+
+	uint rtt_usec = ws_now_usec() - ws->ping_usec;
+	ws->ping_usec = 0;
+	ws->stat.pongs++;
+	ws->stat.rtt_total_usec += rtt_usec;
+	if (ws->stat.pongs == 1 || rtt_usec < ws->stat.rtt_min_usec) {
+		ws->stat.rtt_min_usec = rtt_usec;
+	}
+	if (rtt_usec > ws->stat.rtt_max_usec) {
+		ws->stat.rtt_max_usec = rtt_usec;
+	}
+	Trace(diag, "%s: seq=%u rtt=%u.%03u msec", __func__,
+		seq, rtt_usec / 1000, rtt_usec % 1000);
 }
 
-// PONG 応答を送信する。
-static inline void
-wsclient_send_pong(struct wsclient *ws)
+// 現在時刻 (CLOCK_MONOTONIC) を usec で返す。
+static inline uint64
+ws_now_usec(void)
 {
-	wsclient_send(ws, WS_OPCODE_PONG, NULL, 0);
-	Trace(ws->diag, "%s", __func__);
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_usec(&now);
 }
 
 // WebSocket フレームを送信する。